@@ -0,0 +1,67 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "arena.h"
+
+#include <cstdint>
+#include <new>
+
+namespace co {
+
+static char *AlignUp(char *p, size_t alignment) {
+  uintptr_t a = reinterpret_cast<uintptr_t>(p);
+  return reinterpret_cast<char *>((a + alignment - 1) & ~(alignment - 1));
+}
+
+void *ArenaResource::do_allocate(size_t bytes, size_t alignment) {
+  char *p = AlignUp(next_, alignment);
+  if (next_ != nullptr && p + bytes <= end_) {
+    next_ = p + bytes;
+    return p;
+  }
+  // The pool's memory is page aligned, so aligning the start of the
+  // allocation after the block header needs at most alignment bytes.
+  size_t needed = sizeof(Block) + alignment + bytes;
+  bool own_block = needed > block_size_;
+  size_t size = own_block ? StackPool::SizeClass(needed) : block_size_;
+  void *mem = pool_.Allocate(size);
+  if (mem == nullptr) {
+    throw std::bad_alloc();
+  }
+  bytes_reserved_ += size;
+  Block *block = static_cast<Block *>(mem);
+  block->size = size;
+  char *start = AlignUp(static_cast<char *>(mem) + sizeof(Block), alignment);
+  if (own_block && blocks_ != nullptr) {
+    // Keep allocating from the current block, which probably has space
+    // left in it.
+    block->next = blocks_->next;
+    blocks_->next = block;
+    return start;
+  }
+  block->next = blocks_;
+  blocks_ = block;
+  next_ = start + bytes;
+  end_ = static_cast<char *>(mem) + size;
+  return start;
+}
+
+void ArenaResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+  // Only the most recent allocation can be given back.
+  if (static_cast<char *>(p) + bytes == next_) {
+    next_ = static_cast<char *>(p);
+  }
+}
+
+void ArenaResource::Release() {
+  while (blocks_ != nullptr) {
+    Block *block = blocks_;
+    blocks_ = block->next;
+    pool_.Free(block, block->size);
+  }
+  next_ = end_ = nullptr;
+  bytes_reserved_ = 0;
+}
+
+} // namespace co
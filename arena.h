@@ -0,0 +1,70 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef arena_h
+#define arena_h
+
+#include <cstddef>
+#include <memory_resource>
+
+#include "stack_pool.h"
+
+namespace co {
+
+// A memory resource that hands out memory from blocks taken from a
+// StackPool, the same pool (and the same kind of guarded mappings) used
+// for coroutine stacks.  Allocation bumps a pointer.  Deallocation only
+// gives memory back if it was the most recent allocation (so a growing
+// string or vector can reuse its old space) and otherwise does nothing.
+// All the blocks go back to the pool at once when the arena is released,
+// and the pool keeps them for the next arena, so a steady stream of
+// short lived coroutines doesn't call mmap or malloc at all.
+//
+// Like the pool it is not thread safe.
+class ArenaResource : public std::pmr::memory_resource {
+public:
+  // Blocks are at least this big.  Bigger allocations get a block of
+  // their own.
+  static constexpr size_t kDefaultBlockSize = 32 * 1024;
+
+  explicit ArenaResource(StackPool &pool,
+                         size_t block_size = kDefaultBlockSize)
+      : pool_(pool), block_size_(StackPool::SizeClass(block_size)) {}
+  ArenaResource(const ArenaResource &) = delete;
+  ArenaResource &operator=(const ArenaResource &) = delete;
+  ~ArenaResource() override { Release(); }
+
+  // Give all the memory back to the pool.  Anything allocated from the
+  // arena must no longer be in use.
+  void Release();
+
+  // The number of bytes taken from the pool.
+  size_t BytesReserved() const { return bytes_reserved_; }
+
+protected:
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+private:
+  // At the start of each block.  The blocks form a list so that they can
+  // be released without any other bookkeeping.
+  struct Block {
+    Block *next;
+    size_t size;
+  };
+
+  StackPool &pool_;
+  size_t block_size_;
+  Block *blocks_ = nullptr; // The current block is at the front.
+  char *next_ = nullptr;    // Next free byte in the current block.
+  char *end_ = nullptr;     // End of the current block.
+  size_t bytes_reserved_ = 0;
+};
+
+} // namespace co
+#endif /* arena_h */
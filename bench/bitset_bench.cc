@@ -0,0 +1,76 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Measures allocate/free cycles on the BitSet used for coroutine ids,
+// with a large number of ids in use.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "bitset.h"
+
+using namespace co;
+
+static double NsPerOp(std::chrono::steady_clock::time_point start, long ops) {
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+int main(int argc, char **argv) {
+  long num_ids = 1000000;
+  long cycles = 10000000;
+  if (argc > 1) {
+    num_ids = atol(argv[1]);
+  }
+  if (argc > 2) {
+    cycles = atol(argv[2]);
+  }
+
+  BitSet ids;
+  std::vector<uint32_t> live;
+  live.reserve(num_ids);
+
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < num_ids; i++) {
+    live.push_back(ids.Allocate());
+  }
+  printf("Allocate %ld:       %8.1f ns/id\n", num_ids, NsPerOp(start, num_ids));
+
+  // Free a random live id and allocate a new one, like coroutines
+  // finishing and being created at random.
+  std::mt19937 rng(1234);
+  std::uniform_int_distribution<long> pick(0, num_ids - 1);
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < cycles; i++) {
+    long j = pick(rng);
+    ids.Free(live[j]);
+    live[j] = ids.Allocate();
+  }
+  printf("Free/Allocate cycle: %8.1f ns/cycle\n", NsPerOp(start, cycles));
+
+  for (long i = 0; i < num_ids; i++) {
+    if (!ids.Contains(live[i])) {
+      fprintf(stderr, "Id %u was lost\n", live[i]);
+      abort();
+    }
+  }
+  if (ids.Count() != static_cast<size_t>(num_ids)) {
+    fprintf(stderr, "Wrong count %zu\n", ids.Count());
+    abort();
+  }
+
+  start = std::chrono::steady_clock::now();
+  for (long i = num_ids - 1; i >= 0; i--) {
+    ids.Free(live[i]);
+  }
+  printf("Free %ld:           %8.1f ns/id\n", num_ids, NsPerOp(start, num_ids));
+  if (!ids.IsEmpty()) {
+    fprintf(stderr, "Not empty after freeing everything\n");
+    abort();
+  }
+}
@@ -0,0 +1,107 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "harness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace bench {
+
+uint64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void Usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [--filter=<text>] [--min_time_ms=<ms>] "
+          "[--repetitions=<n>] [--json]\n",
+          program);
+  exit(1);
+}
+
+// Returns the value of an option like --name=value, or nullptr if the
+// argument isn't that option.
+static const char *OptionValue(const char *arg, const char *name) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return nullptr;
+  }
+  return arg + length + 1;
+}
+
+Harness::Harness(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = OptionValue(argv[i], "--filter")) != nullptr) {
+      filter_ = value;
+    } else if ((value = OptionValue(argv[i], "--min_time_ms")) != nullptr) {
+      min_time_ns_ = atof(value) * 1e6;
+    } else if ((value = OptionValue(argv[i], "--repetitions")) != nullptr) {
+      repetitions_ = std::max(1, atoi(value));
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json_ = true;
+    } else {
+      Usage(argv[0]);
+    }
+  }
+}
+
+void Harness::Run(const std::string &name, const Function &function) {
+  if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+    return;
+  }
+  // Grow the number of iterations until a run is long enough to time,
+  // aiming a bit over the minimum so as not to fall just short again.
+  long iterations = 1;
+  double ns;
+  for (;;) {
+    ns = function(iterations);
+    if (ns >= min_time_ns_) {
+      break;
+    }
+    double factor = ns > 0 ? 1.4 * min_time_ns_ / ns : 100;
+    factor = std::clamp(factor, 2.0, 100.0);
+    iterations = static_cast<long>(iterations * factor);
+  }
+
+  // The run that found the number of iterations counts as the first.
+  std::vector<double> per_iteration = {ns / iterations};
+  for (int i = 1; i < repetitions_; i++) {
+    per_iteration.push_back(function(iterations) / iterations);
+  }
+  std::sort(per_iteration.begin(), per_iteration.end());
+  Result result = {name, iterations, per_iteration.front(),
+                   per_iteration[per_iteration.size() / 2]};
+  printf("%-32s %12.1f ns %12.1f ns median %12ld iterations\n",
+         result.name.c_str(), result.best_ns, result.median_ns,
+         result.iterations);
+  fflush(stdout);
+  results_.push_back(std::move(result));
+}
+
+int Harness::Finish() {
+  if (!json_) {
+    return 0;
+  }
+  printf("[\n");
+  for (size_t i = 0; i < results_.size(); i++) {
+    const Result &result = results_[i];
+    printf("  {\"name\": \"%s\", \"iterations\": %ld, \"ns\": %.2f, "
+           "\"median_ns\": %.2f}%s\n",
+           result.name.c_str(), result.iterations, result.best_ns,
+           result.median_ns, i + 1 < results_.size() ? "," : "");
+  }
+  printf("]\n");
+  return 0;
+}
+
+} // namespace bench
@@ -0,0 +1,61 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef harness_h
+#define harness_h
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// Does something a given number of times and returns how long that took
+// in nanoseconds.  Setup and teardown are left out of the time, so a
+// benchmark that needs, say, a scheduler full of idle coroutines makes
+// them before starting the clock.
+using Function = std::function<double(long iterations)>;
+
+// A minimal benchmark runner.  For each benchmark it finds a number of
+// iterations that takes at least the minimum time, runs that a few times
+// and reports the fastest run and the median, per iteration.  The fastest
+// is the one to compare between builds: the others are slower because of
+// whatever else the machine was doing.
+//
+// The command line options are:
+//   --filter=<text>      only run benchmarks whose names contain the text
+//   --min_time_ms=<ms>   minimum time for a run (default 200)
+//   --repetitions=<n>    runs to report on (default 5)
+//   --json               print the results as JSON when they're all done
+class Harness {
+public:
+  Harness(int argc, char **argv);
+
+  // Run a benchmark, if it passes the filter, and print the result.
+  void Run(const std::string &name, const Function &function);
+
+  // Print the JSON, if asked for.  Returns the exit status for main.
+  int Finish();
+
+private:
+  struct Result {
+    std::string name;
+    long iterations;
+    double best_ns;
+    double median_ns;
+  };
+
+  std::string filter_;
+  double min_time_ns_ = 200e6;
+  int repetitions_ = 5;
+  bool json_ = false;
+  std::vector<Result> results_;
+};
+
+// The monotonic clock in nanoseconds, for timing runs.
+uint64_t Now();
+
+} // namespace bench
+#endif /* harness_h */
@@ -0,0 +1,246 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Measures the scheduler: waking a coroutine through an fd, timed waits
+// and sleeps, making and finishing coroutines (with and without a pool),
+// and the cost of a trip round the scheduler's loop with lots of idle
+// coroutines about.
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "coroutine.h"
+#include "harness.h"
+
+using namespace co;
+
+static void MakePipe(int fds[2]) {
+  if (pipe(fds) == -1) {
+    perror("pipe");
+    abort();
+  }
+}
+
+// Two coroutines passing a byte back and forth over a pair of pipes.
+// Each pass is a write, a wakeup through the poller and a read, so the
+// time is what one coroutine waits for another's write to reach it.
+static double BenchPipeWakeup(long iterations) {
+  CoroutineScheduler scheduler;
+  int ping[2];
+  int pong[2];
+  MakePipe(ping);
+  MakePipe(pong);
+  long half = (iterations + 1) / 2;
+  auto body = [half](int in, int out, bool first) {
+    return [half, in, out, first](Coroutine *c) {
+      char ch = 0;
+      for (long i = 0; i < half; i++) {
+        if (!first || i > 0) {
+          c->Wait(in, POLLIN);
+          if (read(in, &ch, 1) != 1) {
+            abort();
+          }
+        }
+        if (write(out, &ch, 1) != 1) {
+          abort();
+        }
+      }
+      if (!first) {
+        return;
+      }
+      // The last byte from the other side.
+      c->Wait(in, POLLIN);
+      if (read(in, &ch, 1) != 1) {
+        abort();
+      }
+    };
+  };
+  Coroutine pinger(scheduler, body(pong[0], ping[1], true));
+  Coroutine ponger(scheduler, body(ping[0], pong[1], false));
+  uint64_t start = bench::Now();
+  scheduler.Run();
+  double ns = static_cast<double>(bench::Now() - start);
+  for (int fd : {ping[0], ping[1], pong[0], pong[1]}) {
+    close(fd);
+  }
+  return ns * iterations / (2 * half);
+}
+
+// A Wait with a timeout on an fd that's ready already, so it never times
+// out.  This is the cost of adding and removing the timer, on top of the
+// fd registration, for the common case of a timeout that doesn't fire.
+static double BenchTimedWait(long iterations) {
+  CoroutineScheduler scheduler;
+  int fds[2];
+  MakePipe(fds);
+  char ch = 0;
+  if (write(fds[1], &ch, 1) != 1) {
+    abort();
+  }
+  double ns = 0;
+  Coroutine waiter(scheduler, [iterations, &fds, &ns](Coroutine *c) {
+    uint64_t start = bench::Now();
+    for (long i = 0; i < iterations; i++) {
+      if (c->Wait(fds[0], POLLIN, 1000000000ULL) != fds[0]) {
+        abort();
+      }
+    }
+    ns = static_cast<double>(bench::Now() - start);
+  });
+  scheduler.Run();
+  close(fds[0]);
+  close(fds[1]);
+  return ns;
+}
+
+// Sleeps that are over as soon as they start: the timer goes into the
+// heap and comes straight back out on the next trip round the loop.
+static double BenchNanosleepZero(long iterations) {
+  CoroutineScheduler scheduler;
+  double ns = 0;
+  Coroutine sleeper(scheduler, [iterations, &ns](Coroutine *c) {
+    uint64_t start = bench::Now();
+    for (long i = 0; i < iterations; i++) {
+      c->Nanosleep(0);
+    }
+    ns = static_cast<double>(bench::Now() - start);
+  });
+  scheduler.Run();
+  return ns;
+}
+
+// How long a 10 microsecond sleep actually takes, which shows how late a
+// short sleep wakes up.
+static double BenchNanosleep10us(long iterations) {
+  CoroutineScheduler scheduler;
+  double ns = 0;
+  Coroutine sleeper(scheduler, [iterations, &ns](Coroutine *c) {
+    uint64_t start = bench::Now();
+    for (long i = 0; i < iterations; i++) {
+      c->Nanosleep(10000);
+    }
+    ns = static_cast<double>(bench::Now() - start);
+  });
+  scheduler.Run();
+  return ns;
+}
+
+// Spawn coroutines that return straight away, in batches so that the
+// stacks go back to the pool to be used again.  The time per coroutine
+// covers making it, its first and only run, and deleting it.
+static double BenchSpawn(long iterations) {
+  constexpr long kBatchSize = 1000;
+  CoroutineScheduler scheduler;
+  long count = 0;
+  uint64_t start = bench::Now();
+  for (long done = 0; done < iterations; done += kBatchSize) {
+    long n = std::min(kBatchSize, iterations - done);
+    for (long i = 0; i < n; i++) {
+      scheduler.Spawn([&count](Coroutine *c) { count++; });
+    }
+    scheduler.Run();
+  }
+  double ns = static_cast<double>(bench::Now() - start);
+  if (count != iterations) {
+    fprintf(stderr, "Ran %ld coroutines, expected %ld\n", count, iterations);
+    abort();
+  }
+  return ns;
+}
+
+// The same as BenchSpawn but through a CoroutinePool, so after the first
+// batch the coroutines are used again rather than made and deleted.
+static double BenchPooledSpawn(long iterations) {
+  constexpr long kBatchSize = 1000;
+  CoroutineScheduler scheduler;
+  CoroutinePool pool(scheduler, kCoDefaultStackSize, kBatchSize);
+  long count = 0;
+  uint64_t start = bench::Now();
+  for (long done = 0; done < iterations; done += kBatchSize) {
+    long n = std::min(kBatchSize, iterations - done);
+    for (long i = 0; i < n; i++) {
+      pool.Spawn([&count](Coroutine *c) { count++; });
+    }
+    scheduler.Run();
+  }
+  double ns = static_cast<double>(bench::Now() - start);
+  if (count != iterations) {
+    fprintf(stderr, "Ran %ld coroutines, expected %ld\n", count, iterations);
+    abort();
+  }
+  return ns;
+}
+
+// One coroutine yields while num_idle others sleep with a long timeout
+// (like idle connections).  Each yield is a trip round the scheduler's
+// loop, with a poll, so this shows what the idle coroutines cost the
+// busy one.  Ideally nothing.
+static double BenchTickWithIdle(long num_idle, long iterations) {
+  // Small stacks to keep the memory down with lots of coroutines.
+  constexpr size_t kIdleStackSize = 8 * 1024;
+  CoroutineScheduler scheduler;
+  for (long i = 0; i < num_idle; i++) {
+    scheduler.Spawn([](Coroutine *c) { c->Sleep(3600); }, nullptr,
+                    kIdleStackSize);
+  }
+  double ns = 0;
+  scheduler.Spawn([iterations, &ns, &scheduler](Coroutine *c) {
+    // Let the idle coroutines get to sleep.
+    c->Yield();
+    uint64_t start = bench::Now();
+    for (long i = 0; i < iterations; i++) {
+      c->Yield();
+    }
+    ns = static_cast<double>(bench::Now() - start);
+    // The scheduler deletes the sleepers.
+    scheduler.Stop();
+  });
+  scheduler.Run();
+  return ns;
+}
+
+// Each coroutine stack is two memory mappings (the stack and its guard
+// page) and Linux limits how many a process can have.  Returns how many
+// coroutines can be made with room to spare, or -1 if there's no limit
+// we know of.
+static long MaxCoroutines() {
+  long max_map_count = -1;
+  FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+  if (f != nullptr) {
+    if (fscanf(f, "%ld", &max_map_count) != 1) {
+      max_map_count = -1;
+    }
+    fclose(f);
+  }
+  return max_map_count == -1 ? -1 : (max_map_count - 1000) / 2;
+}
+
+int main(int argc, char **argv) {
+  bench::Harness harness(argc, argv);
+  harness.Run("PipeWakeup", BenchPipeWakeup);
+  harness.Run("TimedWait/Ready", BenchTimedWait);
+  harness.Run("Nanosleep/0", BenchNanosleepZero);
+  harness.Run("Nanosleep/10us", BenchNanosleep10us);
+  harness.Run("Spawn", BenchSpawn);
+  harness.Run("Spawn/Pooled", BenchPooledSpawn);
+  long max_coroutines = MaxCoroutines();
+  for (long num_idle : {10, 1000, 10000, 100000}) {
+    std::string name = "Tick/idle:" + std::to_string(num_idle);
+    if (max_coroutines != -1 && num_idle > max_coroutines) {
+      printf("%-32s skipped: needs vm.max_map_count of at least %ld\n",
+             name.c_str(), num_idle * 2 + 1000);
+      continue;
+    }
+    harness.Run(name,
+                [num_idle](long iterations) {
+                  return BenchTickWithIdle(num_idle, iterations);
+                });
+  }
+  return harness.Finish();
+}
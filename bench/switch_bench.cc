@@ -0,0 +1,100 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Measures the cost of a context switch between coroutines.  A Yield is
+// two switches: from the coroutine to the scheduler and from the
+// scheduler to the next coroutine.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "coroutine.h"
+#include "harness.h"
+
+using namespace co;
+
+// Two coroutines yielding to each other.  The time is per Yield.
+static double BenchYield(long iterations) {
+  CoroutineScheduler scheduler;
+  long half = (iterations + 1) / 2;
+  auto body = [half](Coroutine *c) {
+    for (long i = 0; i < half; i++) {
+      c->Yield();
+    }
+  };
+  Coroutine c1(scheduler, body);
+  Coroutine c2(scheduler, body);
+  uint64_t start = bench::Now();
+  scheduler.Run();
+  return static_cast<double>(bench::Now() - start) * iterations / (2 * half);
+}
+
+// A Call and the YieldValue that answers it are four switches.
+static double BenchGenerator(long iterations) {
+  CoroutineScheduler scheduler;
+  double ns = 0;
+  Coroutine caller(scheduler, [iterations, &ns](Coroutine *c) {
+    Generator<long> gen(c->Scheduler(), [iterations](Generator<long> *g) {
+      for (long i = 0; i < iterations; i++) {
+        g->YieldValue(i);
+      }
+    });
+    uint64_t start = bench::Now();
+    long sum = 0;
+    for (long i = 0; i < iterations; i++) {
+      sum += c->Call(gen);
+    }
+    ns = static_cast<double>(bench::Now() - start);
+    // Let the generator finish.
+    c->Call(gen);
+    if (sum != iterations * (iterations - 1) / 2) {
+      fprintf(stderr, "Generator produced the wrong values\n");
+      abort();
+    }
+  });
+  scheduler.Run();
+  return ns;
+}
+
+// A generator filling a batch of values per call only switches once per
+// batch.  The time is per value.
+static double BenchGeneratorBatch(long iterations) {
+  constexpr size_t kBatchSize = 64;
+  CoroutineScheduler scheduler;
+  double ns = 0;
+  Coroutine caller(scheduler, [iterations, &ns](Coroutine *c) {
+    Generator<long> gen(c->Scheduler(), [iterations](Generator<long> *g) {
+      for (long i = 0; i < iterations; i++) {
+        g->YieldValue(i);
+      }
+    });
+    uint64_t start = bench::Now();
+    long sum = 0;
+    long values[kBatchSize];
+    for (;;) {
+      size_t n = c->Call(gen, values, kBatchSize);
+      for (size_t i = 0; i < n; i++) {
+        sum += values[i];
+      }
+      if (n < kBatchSize) {
+        break;
+      }
+    }
+    ns = static_cast<double>(bench::Now() - start);
+    if (sum != iterations * (iterations - 1) / 2) {
+      fprintf(stderr, "Generator produced the wrong values\n");
+      abort();
+    }
+  });
+  scheduler.Run();
+  return ns;
+}
+
+int main(int argc, char **argv) {
+  bench::Harness harness(argc, argv);
+  harness.Run("Yield", BenchYield);
+  harness.Run("Generator/Call", BenchGenerator);
+  harness.Run("Generator/CallBatch64", BenchGeneratorBatch);
+  return harness.Finish();
+}
@@ -5,14 +5,20 @@
 #ifndef __BITSET_H
 #define __BITSET_H
 
-#include <strings.h>
-
 #include <cstddef>
-#include <cstdlib>
+#include <cstdint>
 #include <vector>
 
 namespace co {
 
+// A set of small integers, used to allocate coroutine ids.  Allocate
+// always returns the lowest free bit.
+//
+// Each word of bits has a bit in a summary vector that is set when the
+// word is full, and a hint says where in the summary to start looking, so
+// allocation skips 64 full words at a time and doesn't go back over the
+// ones it already knows are full.  The words are trimmed when the high
+// ones empty out, and a population count makes IsEmpty O(1).
 class BitSet {
  public:
   // Allocate the first free bit.
@@ -21,75 +27,132 @@ class BitSet {
   // Free a bit.
   void Free(uint32_t bit);
 
-  // Set a bit.
+  // Set a bit.  The set grows if it needs to.
   void Set(uint32_t bit);
 
   // Is the bitset empty (all bits clear)?
-  bool IsEmpty() const;
+  bool IsEmpty() const { return count_ == 0; }
+
+  // The number of bits that are set.
+  size_t Count() const { return count_; }
 
   // Is the given bit set?
   bool Contains(uint32_t bit) const;
 
  private:
-  // Note the use of explicit long long type here because
-  // we use ffsll to look for the set bits and that is
-  // explicit in its use of long long.
-  std::vector<long long> bits_;
+  static constexpr uint64_t kFull = ~uint64_t(0);
+  static uint64_t Mask(uint32_t b) { return uint64_t(1) << b; }
+
+  // Set or clear the summary bit for a word.
+  void SetFull(size_t word, bool full);
+
+  // Make sure there's a word for the given bit.
+  void Grow(size_t word);
+
+  // Drop empty words from the end.
+  void Shrink();
+
+  std::vector<uint64_t> bits_;
+  // Bit i is set when bits_[i] is full.
+  std::vector<uint64_t> full_;
+  // All the summary words before this one are full.
+  size_t free_hint_ = 0;
+  size_t count_ = 0;
 };
 
+inline void BitSet::SetFull(size_t word, bool full) {
+  if (full) {
+    full_[word / 64] |= Mask(word % 64);
+  } else {
+    full_[word / 64] &= ~Mask(word % 64);
+  }
+}
+
+inline void BitSet::Grow(size_t word) {
+  if (word >= bits_.size()) {
+    bits_.resize(word + 1, 0);
+    full_.resize(word / 64 + 1, 0);
+  }
+}
+
+inline void BitSet::Shrink() {
+  while (!bits_.empty() && bits_.back() == 0) {
+    bits_.pop_back();
+  }
+  // The summary bits for the dropped words are already clear.
+  full_.resize((bits_.size() + 63) / 64);
+  if (free_hint_ > full_.size()) {
+    free_hint_ = full_.size();
+  }
+}
+
 inline uint32_t BitSet::Allocate() {
-  uint32_t start = 0;
-  for (;;) {
-    for (uint32_t i = start; i < bits_.size(); i++) {
-      uint32_t bit = static_cast<uint32_t>(ffsll(~bits_[i]));
-      if (bit != 0) {
-        bits_[i] |= (1 << (bit - 1));
-        return i * 64 + (bit - 1);
-      }
+  size_t s = free_hint_;
+  while (s < full_.size() && full_[s] == kFull) {
+    s++;
+  }
+  free_hint_ = s;
+  size_t word = bits_.size();
+  if (s < full_.size()) {
+    // The lowest word that isn't full.  In the last summary word this
+    // might be past the end of bits_, which means all of them are full.
+    size_t w = s * 64 + static_cast<size_t>(__builtin_ctzll(~full_[s]));
+    if (w < bits_.size()) {
+      word = w;
     }
-    // Expand bit set and allocate again.  There's no point in
-    // searching the whole bitset again because we know it won't
-    // have any zero bits in it, so start at the newly added
-    // word of zeroes.
-    start = bits_.size();
-    bits_.push_back(0);
   }
+  Grow(word);
+  uint32_t b = static_cast<uint32_t>(__builtin_ctzll(~bits_[word]));
+  bits_[word] |= Mask(b);
+  count_++;
+  if (bits_[word] == kFull) {
+    SetFull(word, true);
+  }
+  return static_cast<uint32_t>(word * 64 + b);
 }
 
 inline void BitSet::Free(uint32_t bit) {
-  uint32_t word = bit / 64;
-  if (word < 0 || word >= bits_.size()) {
+  size_t word = bit / 64;
+  if (word >= bits_.size()) {
+    return;
+  }
+  uint64_t mask = Mask(bit % 64);
+  if ((bits_[word] & mask) == 0) {
     return;
   }
-  uint32_t b = bit % 64;
-  bits_[word] &= ~(1 << b);
+  if (bits_[word] == kFull) {
+    SetFull(word, false);
+  }
+  bits_[word] &= ~mask;
+  count_--;
+  if (word / 64 < free_hint_) {
+    free_hint_ = word / 64;
+  }
+  if (bits_[word] == 0 && word == bits_.size() - 1) {
+    Shrink();
+  }
 }
 
 inline void BitSet::Set(uint32_t bit) {
-  uint32_t word = bit / 64;
-  if (word < 0 || word >= bits_.size()) {
+  size_t word = bit / 64;
+  Grow(word);
+  uint64_t mask = Mask(bit % 64);
+  if ((bits_[word] & mask) != 0) {
     return;
   }
-  uint32_t b = bit % 64;
-  bits_[word] |= (1 << b);
-}
-
-inline bool BitSet::IsEmpty() const {
-  for (uint32_t i = 0; i < bits_.size(); i++) {
-    if (bits_[i] != 0) {
-      return false;
-    }
+  bits_[word] |= mask;
+  count_++;
+  if (bits_[word] == kFull) {
+    SetFull(word, true);
   }
-  return true;
 }
 
 inline bool BitSet::Contains(uint32_t bit) const {
-  uint32_t word = bit / 64;
-  if (word < 0 || word >= bits_.size()) {
+  size_t word = bit / 64;
+  if (word >= bits_.size()) {
     return false;
   }
-  uint32_t b = bit % 64;
-  return (bits_[word] & (1 << b)) != 0;
+  return (bits_[word] & Mask(bit % 64)) != 0;
 }
 }  // namespace co
 #endif  // __BITSET_H
@@ -0,0 +1,175 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef channel_h
+#define channel_h
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "coroutine.h"
+
+namespace co {
+
+// A Channel passes values from coroutines that send them to coroutines
+// that receive them, through a ring buffer with a fixed capacity.  There
+// can be any number of senders and receivers.  A sender only waits when
+// the buffer is full and a receiver only waits when it's empty, so a
+// producer can hand over a whole buffer full of values before it gives
+// up the CPU, and a consumer can take them all in one go, rather than
+// switching once per value like a Generator does.  Waiting is done
+// through a WaitQueue, so no fds are involved.
+//
+// Values are moved in and out of the channel, so T can be a move-only
+// type and doesn't need a default constructor.
+//
+// After Close, sends fail and receives take the values still in the
+// buffer, then fail.  A Channel must only be used by coroutines in the
+// same scheduler.
+template <typename T> class Channel {
+public:
+  explicit Channel(size_t capacity)
+      : capacity_(capacity == 0 ? 1 : capacity),
+        buffer_(new Slot[capacity_]) {}
+  Channel(const Channel &) = delete;
+  Channel &operator=(const Channel &) = delete;
+
+  ~Channel() {
+    while (size_ > 0) {
+      Take();
+    }
+  }
+
+  // Send a value, waiting while the channel is full.  Returns false,
+  // without touching the value, if the channel is closed.
+  bool Send(Coroutine *c, T &&value) {
+    while (IsFull() && !closed_) {
+      senders_.Wait(c);
+    }
+    return TrySend(std::move(value));
+  }
+  bool Send(Coroutine *c, const T &value) {
+    T copy(value);
+    return Send(c, std::move(copy));
+  }
+
+  // Send a value if there is space for it.  Returns false, without
+  // touching the value, if the channel is full or closed.
+  bool TrySend(T &&value) {
+    if (IsFull() || closed_) {
+      return false;
+    }
+    Put(std::move(value));
+    // The receiver runs once we give up the CPU, by which time there may
+    // be more values for it.
+    receivers_.NotifyOne();
+    return true;
+  }
+  bool TrySend(const T &value) {
+    if (IsFull() || closed_) {
+      return false;
+    }
+    T copy(value);
+    return TrySend(std::move(copy));
+  }
+
+  // Receive a value, waiting while the channel is empty.  Returns an
+  // empty optional if the channel is closed and there are no values left.
+  std::optional<T> Receive(Coroutine *c) {
+    while (IsEmpty() && !closed_) {
+      receivers_.Wait(c);
+    }
+    return TryReceive();
+  }
+
+  // Receive a value if there is one.
+  std::optional<T> TryReceive() {
+    if (IsEmpty()) {
+      return std::nullopt;
+    }
+    std::optional<T> value(Take());
+    senders_.NotifyOne();
+    return value;
+  }
+
+  // Receive up to max_values values, appending them to values and
+  // waiting only if the channel is empty.  Returns the number of values
+  // received, which is 0 only if the channel is closed and there are no
+  // values left.  max_values must be at least 1, so that a 0 can't be
+  // mistaken for the end of the channel.
+  size_t Receive(Coroutine *c, std::vector<T> &values, size_t max_values) {
+    assert(max_values > 0);
+    while (IsEmpty() && !closed_) {
+      receivers_.Wait(c);
+    }
+    size_t n = 0;
+    for (; n < max_values && !IsEmpty(); n++) {
+      values.push_back(Take());
+    }
+    // Each value taken makes room for a sender.
+    for (size_t i = 0; i < n && senders_.NotifyOne(); i++) {
+    }
+    return n;
+  }
+
+  // Stop any more values being sent and wake up everyone waiting.
+  void Close() {
+    closed_ = true;
+    senders_.NotifyAll();
+    receivers_.NotifyAll();
+  }
+
+  bool IsClosed() const { return closed_; }
+  bool IsEmpty() const { return size_ == 0; }
+  bool IsFull() const { return size_ == capacity_; }
+  size_t Size() const { return size_; }
+  size_t Capacity() const { return capacity_; }
+
+private:
+  // Uninitialized storage for a T, so that T needn't have a default
+  // constructor.
+  struct Slot {
+    alignas(T) unsigned char data[sizeof(T)];
+  };
+
+  T *At(size_t i) {
+    return std::launder(reinterpret_cast<T *>(buffer_[i].data));
+  }
+
+  void Put(T &&value) {
+    size_t tail = head_ + size_;
+    if (tail >= capacity_) {
+      tail -= capacity_;
+    }
+    new (buffer_[tail].data) T(std::move(value));
+    size_++;
+  }
+
+  T Take() {
+    T *p = At(head_);
+    T value(std::move(*p));
+    p->~T();
+    if (++head_ == capacity_) {
+      head_ = 0;
+    }
+    size_--;
+    return value;
+  }
+
+  size_t capacity_;
+  std::unique_ptr<Slot[]> buffer_;
+  size_t head_ = 0; // Index of the oldest value.
+  size_t size_ = 0; // Number of values in the buffer.
+  bool closed_ = false;
+  WaitQueue senders_;
+  WaitQueue receivers_;
+};
+
+} // namespace co
+#endif /* channel_h */
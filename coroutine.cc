@@ -12,6 +12,11 @@
 
 #include "bitset.h"
 
+#if defined(ADDRESS_SANITIZER)
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/common_interface_defs.h>
+#endif
+
 #if defined(__APPLE__)
 #include <sys/event.h>
 #include <sys/time.h>
@@ -19,7 +24,6 @@
 
 #elif defined(__linux__)
 #include <sys/eventfd.h>
-#include <sys/timerfd.h>
 
 #else
 #error "Unknown operating system"
@@ -71,15 +75,24 @@ static void ClearEvent(int fd) {
 #endif
 }
 
+static uint64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
 extern "C" {
-// Linux, when building optimized ever-so-helpfully replaces
-// longjmp with longjmp_chk unless _FORTIFY_SOURCE is not defined.
-// We are using longjmp for context switches so the checks done
-// by longjmp_chk break everything.  We could force the undef
-// of _FORTIFY_SOURCE but that seems fragile.  It's better to
-// stay out of the compiler's way and just call the function we
-// really want directly to avoid any shenanigans.
-void __real_longjmp(jmp_buf, int);
+// Save the callee-saved registers of the current context on its stack,
+// store the stack pointer in *save_sp, then switch to the stack new_sp
+// and restore the registers saved there.  Returns in the new context.
+// This is all a context switch needs, as the compiler has already saved
+// every other register around the call.
+void __co_SwapContext(void **save_sp, void *new_sp);
+
+// The first code executed on a new coroutine's stack.  The coroutine
+// pointer is in a callee-saved register set up by MakeContext.
+void __co_Start();
 }
 
 // Apple puts an underscore prefix for all external symbols.
@@ -90,49 +103,188 @@ void __real_longjmp(jmp_buf, int);
 #define SYM(name) #name
 #endif
 
-// Define __real_longjmp as a simple relay function that jumps
-// to the real longjmp function.
 // clang-format off
 #if defined(__aarch64__)
+// AAPCS64 callee-saved registers are x19-x29, the link register x30 and
+// the low 64 bits of v8-v15.
 asm(
-  SYM(__real_longjmp) ":\n"
-  "b " SYM(longjmp) "\n");
+  ".text\n"
+  ".p2align 2\n"
+  SYM(__co_SwapContext) ":\n"
+  "sub sp, sp, #160\n"
+  "stp x19, x20, [sp, #0]\n"
+  "stp x21, x22, [sp, #16]\n"
+  "stp x23, x24, [sp, #32]\n"
+  "stp x25, x26, [sp, #48]\n"
+  "stp x27, x28, [sp, #64]\n"
+  "stp x29, x30, [sp, #80]\n"
+  "stp d8, d9, [sp, #96]\n"
+  "stp d10, d11, [sp, #112]\n"
+  "stp d12, d13, [sp, #128]\n"
+  "stp d14, d15, [sp, #144]\n"
+  "mov x2, sp\n"
+  "str x2, [x0]\n"
+  "mov sp, x1\n"
+  "ldp x19, x20, [sp, #0]\n"
+  "ldp x21, x22, [sp, #16]\n"
+  "ldp x23, x24, [sp, #32]\n"
+  "ldp x25, x26, [sp, #48]\n"
+  "ldp x27, x28, [sp, #64]\n"
+  "ldp x29, x30, [sp, #80]\n"
+  "ldp d8, d9, [sp, #96]\n"
+  "ldp d10, d11, [sp, #112]\n"
+  "ldp d12, d13, [sp, #128]\n"
+  "ldp d14, d15, [sp, #144]\n"
+  "add sp, sp, #160\n"
+  "ret\n"
+
+  ".p2align 2\n"
+  SYM(__co_Start) ":\n"
+  "mov x0, x19\n"
+  "bl " SYM(__co_Invoke) "\n"
+  "brk #0\n");  // __co_Invoke never returns.
+
 #elif defined(__x86_64__)
+// System V callee-saved registers are rbx, rbp and r12-r15, plus the
+// control bits of the MXCSR and the x87 control word.
 asm(
-  SYM(__real_longjmp) ":\n"
-  "jmp " SYM(longjmp) "\n");
+  ".text\n"
+  ".p2align 4\n"
+  SYM(__co_SwapContext) ":\n"
+  "pushq %rbp\n"
+  "pushq %rbx\n"
+  "pushq %r12\n"
+  "pushq %r13\n"
+  "pushq %r14\n"
+  "pushq %r15\n"
+  "subq $8, %rsp\n"
+  "stmxcsr (%rsp)\n"
+  "fnstcw 4(%rsp)\n"
+  "movq %rsp, (%rdi)\n"
+  "movq %rsi, %rsp\n"
+  "ldmxcsr (%rsp)\n"
+  "fldcw 4(%rsp)\n"
+  "addq $8, %rsp\n"
+  "popq %r15\n"
+  "popq %r14\n"
+  "popq %r13\n"
+  "popq %r12\n"
+  "popq %rbx\n"
+  "popq %rbp\n"
+  "ret\n"
+
+  ".p2align 4\n"
+  SYM(__co_Start) ":\n"
+  "movq %r12, %rdi\n"
+  "call " SYM(__co_Invoke) "\n"
+  "ud2\n");  // __co_Invoke never returns.
 #else
 #error "Unsupported architecture"
 #endif
 // clang-format on
 
+// Build the initial context on a new coroutine's stack so that the first
+// __co_SwapContext to it "returns" into __co_Start with the coroutine
+// pointer in a callee-saved register.  The layout must match the order
+// in which __co_SwapContext pops the registers.
+static void *MakeContext(void *stack, size_t stack_size, Coroutine *c) {
+  uintptr_t top =
+      (reinterpret_cast<uintptr_t>(stack) + stack_size) & ~uintptr_t(15);
+  uint64_t *sp;
+#if defined(__aarch64__)
+  sp = reinterpret_cast<uint64_t *>(top - 160);
+  memset(sp, 0, 160);
+  sp[0] = reinterpret_cast<uint64_t>(c);          // x19
+  sp[11] = reinterpret_cast<uint64_t>(&__co_Start); // x30
+#elif defined(__x86_64__)
+  // The return address is placed so that the stack is 16 byte aligned
+  // when __co_Start calls __co_Invoke.
+  sp = reinterpret_cast<uint64_t *>(top - 80);
+  memset(sp, 0, 80);
+  uint32_t mxcsr;
+  uint16_t fpu_cw;
+  asm volatile("stmxcsr %0" : "=m"(mxcsr));
+  asm volatile("fnstcw %0" : "=m"(fpu_cw));
+  sp[0] = mxcsr | (static_cast<uint64_t>(fpu_cw) << 32);
+  sp[4] = reinterpret_cast<uint64_t>(c);          // r12
+  sp[7] = reinterpret_cast<uint64_t>(&__co_Start); // Return address.
+#endif
+  return sp;
+}
+
+// Stack monitoring fills a new stack with this and looks for the lowest
+// word that isn't it any more.  The stack grows down, so that's the
+// deepest the coroutine has been.  ASAN is kept out of it as the
+// coroutine may have left parts of its stack poisoned.
+static constexpr uint64_t kStackCanary = 0xc0c0a5a5c0c0a5a5ULL;
+
+__attribute__((no_sanitize_address)) static void FillStack(void *stack,
+                                                           size_t size) {
+  uint64_t *words = static_cast<uint64_t *>(stack);
+  for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+    words[i] = kStackCanary;
+  }
+}
+
+__attribute__((no_sanitize_address)) static size_t
+StackHighWater(const void *stack, size_t size) {
+  const uint64_t *words = static_cast<const uint64_t *>(stack);
+  size_t num_words = size / sizeof(uint64_t);
+  size_t i = 0;
+  while (i < num_words && words[i] == kStackCanary) {
+    i++;
+  }
+  return (num_words - i) * sizeof(uint64_t);
+}
+
+// AddressSanitizer needs to be told when we switch stacks, otherwise it
+// gets very confused.
+#if defined(ADDRESS_SANITIZER)
+static void StartSwitch(void **fake_stack, const void *bottom, size_t size) {
+  __sanitizer_start_switch_fiber(fake_stack, bottom, size);
+}
+static void FinishSwitch(void *fake_stack, const void **old_bottom,
+                         size_t *old_size) {
+  __sanitizer_finish_switch_fiber(fake_stack, old_bottom, old_size);
+}
+#else
+static void StartSwitch(void **, const void *, size_t) {}
+static void FinishSwitch(void *, const void **, size_t *) {}
+#endif
+
 Coroutine::Coroutine(CoroutineScheduler &machine, CoroutineFunction functor,
                      const char *name, bool autostart, size_t stack_size,
-                     void *user_data)
+                     void *user_data, Priority priority)
     : scheduler_(machine), function_(std::move(functor)),
-      stack_size_(stack_size), user_data_(user_data) {
+      stack_size_(StackPool::SizeClass(stack_size)),
+      arena_(machine.stacks_), user_data_(user_data),
+      priority_(priority) {
   id_ = scheduler_.AllocateId();
   if (name == nullptr) {
     char buf[256];
     snprintf(buf, sizeof(buf), "co-%d", id_);
     name_ = buf;
+    default_name_ = true;
   } else {
     name_ = name;
   }
 
-  stack_ = malloc(stack_size);
+  if (scheduler_.automatic_stack_sizes_ && !default_name_) {
+    stack_size_ = scheduler_.ChooseStackSize(name_, stack_size_);
+  }
+  stack_ = scheduler_.stacks_.Allocate(stack_size_);
   if (stack_ == nullptr) {
     fprintf(stderr, "Failed to allocate stack for coroutine with size %zd: %s",
-            stack_size, strerror(errno));
+            stack_size_, strerror(errno));
     abort();
   }
-  state_ = State::kCoNew;
-  event_fd_.fd = NewEventFd();
-  if (event_fd_.fd == -1) {
-    fprintf(stderr, "Failed to allocate event fd: %s\n", strerror(errno));
-    abort();
+  if (scheduler_.stack_monitoring_) {
+    FillStack(stack_, stack_size_);
+    stack_filled_ = true;
   }
-  event_fd_.events = POLLIN;
+  // A coroutine doesn't hold any kernel resources.  Making it ready to run
+  // is done through the scheduler's ready queue.
+  state_ = State::kCoNew;
 
   // Might as well take the hit for allocating the pollfd vector when the
   // coroutine is created rather than delay it until the first wait.  It's
@@ -147,98 +299,154 @@ Coroutine::Coroutine(CoroutineScheduler &machine, CoroutineFunction functor,
 }
 
 Coroutine::~Coroutine() {
-  free(stack_);
-  CloseEventFd(event_fd_.fd);
+  // Don't leave anything in the scheduler that refers to us.
+  scheduler_.RemoveFromReadyQueue(this);
+  if (state_ == State::kCoWaiting) {
+    scheduler_.EndWait(this);
+  }
+  if (scheduler_.coroutines_.Contains(this)) {
+    // Destroyed before it finished.
+#if defined(CO_TRACING)
+    scheduler_.Trace(TraceEvent::kExit, this);
+#endif
+    scheduler_.coroutines_.Remove(this);
+    scheduler_.coroutine_ids_.Free(id_);
+  }
+  scheduler_.stacks_.Free(stack_, stack_size_);
 }
 
-void Coroutine::Exit() { __real_longjmp(exit_, 1); }
+// Called once the coroutine has finished and been removed from the
+// scheduler.  Everything the last run left behind is reset, as in the
+// constructor, but the stack and the wait_fds_ capacity are kept.
+void Coroutine::Rearm(CoroutineFunction function, const char *name) {
+  function_ = std::move(function);
+  id_ = scheduler_.AllocateId();
+  if (name == nullptr) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "co-%d", id_);
+    name_ = buf;
+    default_name_ = true;
+  } else {
+    name_ = name;
+    default_name_ = false;
+  }
+  state_ = State::kCoNew;
+  yielded_address_ = nullptr;
+  context_ = nullptr;
+  wait_fds_.clear();
+  caller_ = nullptr;
+  user_data_ = nullptr;
+  last_tick_ = 0;
+  deadline_ = 0;
+  timer_index_ = -1;
+  wait_result_ = -1;
+  wait_queue_ = nullptr;
+  // It's a new coroutine as far as anyone else is concerned, so it
+  // doesn't keep a priority set for the last one.
+  priority_ = Priority::kNormal;
+  stats_ = {};
+  suspended_at_ = 0;
+  to_string_callback_ = nullptr;
+  arena_.Release();
+#if defined(ADDRESS_SANITIZER)
+  // Like a stack coming back from the stack pool, the last run may have
+  // left redzones poisoned in it.
+  ASAN_UNPOISON_MEMORY_REGION(stack_, stack_size_);
+#endif
+  stack_filled_ = false;
+  if (scheduler_.stack_monitoring_) {
+    FillStack(stack_, stack_size_);
+    stack_filled_ = true;
+  }
+  scheduler_.AddCoroutine(this);
+  Start();
+}
+
+// Switch from this coroutine to the scheduler.  Returns when the
+// scheduler resumes us.
+void Coroutine::SwitchToScheduler() {
+  void *fake_stack = nullptr;
+  // When we are dead we will never come back, so ASAN can free our
+  // fake stack.
+  StartSwitch(state_ == State::kCoDead ? nullptr : &fake_stack,
+              scheduler_.stack_bottom_, scheduler_.stack_size_);
+  __co_SwapContext(&context_, scheduler_.context_);
+  FinishSwitch(fake_stack, nullptr, nullptr);
+}
+
+// Switch from the scheduler to this coroutine.  Returns the next time
+// the coroutine switches back to the scheduler.
+void Coroutine::SwitchFromScheduler() {
+  void *fake_stack = nullptr;
+  StartSwitch(&fake_stack, stack_, stack_size_);
+  __co_SwapContext(&scheduler_.context_, context_);
+  FinishSwitch(fake_stack, nullptr, nullptr);
+}
+
+void Coroutine::Exit() {
+  state_ = State::kCoDead;
+  SwitchToScheduler();
+  // Never get here.
+}
+
+void Coroutine::SetPriority(Priority priority) {
+  if (priority == priority_) {
+    return;
+  }
+  bool ready = scheduler_.ReadyQueueFor(this).Contains(this);
+  if (ready) {
+    scheduler_.RemoveFromReadyQueue(this);
+  }
+  priority_ = priority;
+  if (ready) {
+    scheduler_.MakeReady(this);
+  }
+}
 
 void Coroutine::Start() {
   if (state_ == State::kCoNew) {
     state_ = State::kCoReady;
+    scheduler_.MakeReady(this);
   }
 }
 
-static int MakeTimer(uint64_t ns) {
-#if defined(__APPLE__)
-  // On MacOS we use a kqueue.
-  int kq = kqueue();
-  struct kevent e;
-
-  EV_SET(&e, 1, EVFILT_TIMER, EV_ADD, NOTE_NSECONDS, ns, 0);
-  kevent(kq, &e, 1, NULL, 0, NULL);
-  return kq;
-#elif defined(__linux__)
-  // Linux uses a timerfd.
-  struct itimerspec new_value;
-  struct timespec now;
-  constexpr int kBillion = 1000000000;
-
-  clock_gettime(CLOCK_REALTIME, &now);
-  new_value.it_value.tv_sec = now.tv_sec + ns / kBillion;
-  new_value.it_value.tv_nsec = now.tv_nsec + ns % kBillion;
-  new_value.it_interval.tv_sec = 0;
-  new_value.it_interval.tv_nsec = 0;
-  int fd = timerfd_create(CLOCK_REALTIME, 0);
-  timerfd_settime(fd, TFD_TIMER_ABSTIME, &new_value, NULL);
-  return fd;
-#endif
-}
-
-int Coroutine::EndOfWait(int timer_fd, int result) {
+int Coroutine::EndOfWait() {
+  scheduler_.EndWait(this);
   wait_fds_.clear();
-  if (timer_fd != -1) {
-    close(timer_fd);
-  }
-  // result contains the onescomp of the value passed to longjmp.
-  // This will be an fd.  If it's the same fd as the timer we got a timeout so
-  // return -1 to tell the caller.  The caller has no idea what
-  // the timer_fd is, so there's no point in returning that.
-  result = ~result;
-  if (result == timer_fd) {
-    return -1;
-  }
-  // A garbage value as the Resume() value will be returned as garbage.
-  return result;
+  // The scheduler tells us the fd that terminated the wait, or -1 if
+  // we timed out.
+  return wait_result_;
 }
 
-int Coroutine::AddTimeout(uint64_t timeout_ns) {
-  int timer_fd = -1;
+void Coroutine::AddTimeout(uint64_t timeout_ns) {
   if (timeout_ns > 0) {
-    timer_fd = MakeTimer(timeout_ns);
-    struct pollfd timerfd = {.fd = timer_fd, .events = POLLIN};
-    wait_fds_.push_back(timerfd);
+    scheduler_.AddTimer(this, timeout_ns);
   }
-  return timer_fd;
 }
 
 int Coroutine::Wait(int fd, short event_mask, uint64_t timeout_ns) {
   state_ = State::kCoWaiting;
   struct pollfd pfd = {.fd = fd, .events = event_mask};
   wait_fds_.push_back(pfd);
-  int timer_fd = AddTimeout(timeout_ns);
+  AddTimeout(timeout_ns);
+  scheduler_.AddWaitFds(this);
   yielded_address_ = __builtin_return_address(0);
   last_tick_ = scheduler_.TickCount();
-  int result = -1;
-  if ((result = setjmp(resume_)) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-  }
+  SwitchToScheduler();
   // Get here when resumed.
-  return EndOfWait(timer_fd, result);
+  return EndOfWait();
 }
 
 int Coroutine::Wait(struct pollfd &fd, uint64_t timeout_ns) {
   state_ = State::kCoWaiting;
   wait_fds_.push_back(fd);
-  int timer_fd = AddTimeout(timeout_ns);
+  AddTimeout(timeout_ns);
+  scheduler_.AddWaitFds(this);
   yielded_address_ = __builtin_return_address(0);
   last_tick_ = scheduler_.TickCount();
-  int result = -1;
-  if ((result = setjmp(resume_)) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-  }
+  SwitchToScheduler();
   // Get here when resumed.
-  return EndOfWait(timer_fd, result);
+  return EndOfWait();
 }
 
 int Coroutine::Wait(const std::vector<struct pollfd> &fds,
@@ -247,44 +455,34 @@ int Coroutine::Wait(const std::vector<struct pollfd> &fds,
   for (auto &fd : fds) {
     wait_fds_.push_back(fd);
   }
-  int timer_fd = AddTimeout(timeout_ns);
+  AddTimeout(timeout_ns);
+  scheduler_.AddWaitFds(this);
   yielded_address_ = __builtin_return_address(0);
   last_tick_ = scheduler_.TickCount();
-  int result = -1;
-  if ((result = setjmp(resume_)) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-  }
+  SwitchToScheduler();
   // Get here when resumed.
-  return EndOfWait(timer_fd, result);
+  return EndOfWait();
 }
 
+// Sleeping is a wait with just a timeout.  No fds are involved.
 void Coroutine::Nanosleep(uint64_t ns) {
-  int timer = MakeTimer(ns);
-  Wait(timer);
-  close(timer);
+  state_ = State::kCoWaiting;
+  scheduler_.AddTimer(this, ns);
+  yielded_address_ = __builtin_return_address(0);
+  last_tick_ = scheduler_.TickCount();
+  SwitchToScheduler();
+  EndOfWait();
 }
 
-void Coroutine::TriggerEvent() { co::TriggerEvent(event_fd_.fd); }
-
-void Coroutine::ClearEvent() { co::ClearEvent(event_fd_.fd); }
-
 void Coroutine::AddPollFds(std::vector<struct pollfd> &pollfds,
                            std::vector<Coroutine *> &covec) {
-  switch (state_) {
-  case State::kCoReady:
-  case State::kCoYielded:
-    pollfds.push_back(event_fd_);
-    covec.push_back(this);
-    break;
-  case State::kCoWaiting:
+  // Ready and yielded coroutines are in the scheduler's ready queue and
+  // don't need any fds.
+  if (state_ == State::kCoWaiting) {
     for (auto &fd : wait_fds_) {
       pollfds.push_back(fd);
       covec.push_back(this);
     }
-  case State::kCoNew:
-  case State::kCoRunning:
-  case State::kCoDead:
-    break;
   }
 }
 
@@ -318,8 +516,13 @@ std::string Coroutine::MakeDefaultString() const {
     break;
   }
   char buffer[256];
-  snprintf(buffer, sizeof(buffer), "Coroutine %d: %s: state: %s: address: %p",
-           id_, name_.c_str(), state, yielded_address_);
+  int n =
+      snprintf(buffer, sizeof(buffer), "Coroutine %d: %s: state: %s: address: %p",
+               id_, name_.c_str(), state, yielded_address_);
+  if (stack_filled_ && n >= 0 && static_cast<size_t>(n) < sizeof(buffer)) {
+    snprintf(buffer + n, sizeof(buffer) - n, ": stack: %zu of %zu", StackUsed(),
+             stack_size_);
+  }
   return buffer;
 }
 
@@ -329,20 +532,21 @@ void Coroutine::Show() const {
 
 bool Coroutine::IsAlive() const { return scheduler_.IdExists(id_); }
 
+size_t Coroutine::StackUsed() const {
+  return stack_filled_ ? StackHighWater(stack_, stack_size_) : 0;
+}
+
 void Coroutine::CallNonTemplate(Coroutine &callee) {
   // Start the callee running if it's not already running.  If it's running
-  // we trigger its event to wake it up.
+  // we put it in the ready queue to wake it up.
   if (callee.state_ == State::kCoNew) {
     callee.Start();
   } else {
-    callee.TriggerEvent();
+    scheduler_.MakeReady(&callee);
   }
   state_ = State::kCoYielded;
   last_tick_ = scheduler_.TickCount();
-  if (setjmp(resume_) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-    // Never get here.
-  }
+  SwitchToScheduler();
   // When we get here, the callee has done its work.  Remove this coroutine's
   // state from it.
   callee.caller_ = nullptr;
@@ -352,241 +556,351 @@ void Coroutine::Yield() {
   state_ = State::kCoYielded;
   yielded_address_ = __builtin_return_address(0);
   last_tick_ = scheduler_.TickCount();
-  if (setjmp(resume_) == 0) {
-    TriggerEvent();
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-    // Never get here.
-  }
-  // We get here when resumed.  We ignore the result of setjmp as we
-  // are not waiting for anything and there is no yield with timeout
-  // since the coroutine is automatically rescheduled.  If you want to
-  // sleep, use the various Sleep functions.
+  scheduler_.MakeReady(this);
+  SwitchToScheduler();
+  // We get here when resumed.  We are not waiting for anything and there
+  // is no yield with timeout since the coroutine is automatically
+  // rescheduled.  If you want to sleep, use the various Sleep functions.
 }
 
 void Coroutine::YieldNonTemplate() {
   if (caller_ != nullptr) {
     // Tell caller that there's a value available.
-    caller_->TriggerEvent();
+    scheduler_.MakeReady(caller_);
   }
 
-  // Yield control to another coroutine but don't trigger a wakup event.
+  // Yield control to another coroutine but don't make ourselves ready.
   // This will be done when another call is made.
   state_ = State::kCoYielded;
   last_tick_ = scheduler_.TickCount();
-  if (setjmp(resume_) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-    // Never get here.
-  }
+  SwitchToScheduler();
   // We get here when resumed from another call.
 }
 
-void Coroutine::InvokeFunction() { function_(this); }
+void Coroutine::InvokeFunction() {
+  // We've just arrived from the scheduler on a brand new stack.
+  FinishSwitch(nullptr, &scheduler_.stack_bottom_, &scheduler_.stack_size_);
+  function_(this);
+}
 
 // We use an intermediate function to do the invocation of
 // the coroutine's function because we really want to avoid
 // having mangled names coded into the assembly language in
-// the Resume function.  A new compiler might change the
-// name mangling rules and that would break the build.
+// __co_Start.  A new compiler might change the name mangling
+// rules and that would break the build.
 extern "C" {
-void __co_Invoke(Coroutine *c) { c->InvokeFunction(); }
+void __co_Invoke(Coroutine *c) {
+  c->InvokeFunction();
+  // Function returned, we are dead.  Exit never returns.
+  c->Exit();
+}
 }
 
-void Coroutine::Resume(int value) {
+void Coroutine::Resume() {
   switch (state_) {
   case State::kCoReady:
-    // Initial invocation of the coroutine.  We need to do a bit
-    // of magic to switch to the coroutine's stack and invoke
-    // the function using the stack.  When the function returns
-    // we longjmp to the exit environment with the stack restored
-    // to the current one, which is the stack used by the
-    // CoroutineScheduler.
-    state_ = State::kCoRunning;
+    // Initial invocation of the coroutine.  Build a context on the
+    // coroutine's stack that will invoke the function when we switch
+    // to it.
+    context_ = MakeContext(stack_, stack_size_, this);
     yielded_address_ = nullptr;
-    if (setjmp(exit_) == 0) {
-      void *sp = reinterpret_cast<char *>(stack_) + stack_size_;
-      jmp_buf &exit_state = exit_;
-
-// clang-format off
-#if defined(__aarch64__)
-      asm("mov x12, sp\n"     // Save current stack pointer.
-          "mov x13, x29\n"    // Save current frame pointer
-          "sub sp, %0, #32\n" // Set new stack pointer.
-          "stp x12, x13, [sp, #16]\n"
-          "str %1, [sp, #0]\n" // Save exit state to stack.
-          "mov x0, %2\n"
-          "bl " SYM(__co_Invoke) "\n"
-          "ldr x0, [sp, #0]\n" // Restore exit state.
-          "ldp x12, x29, [sp, #16]\n"
-          "mov sp, x12\n" // Restore stack pointer
-          "mov w1, #1\n"
-          "bl " SYM(longjmp) "\n"
-          :
-          : "r"(sp), "r"(exit_state), "r"(this)
-          : "x12", "x13");
-
-#elif defined(__x86_64__)
-      asm("movq %%rsp, %%r14\n" // Save current stack pointer.
-          "movq %%rbp, %%r15\n" // Save current frame pointer
-          "movq %0, %%rsp\n"
-          "pushq %%r14\n"    // Push rsp
-          "pushq %%r15\n"    // Push rbp
-          "pushq %1\n"       // Push env
-          "subq $8, %%rsp\n" // Align to 16
-          "movq %2, %%rdi\n" // this
-          "call " SYM(__co_Invoke) "\n"
-          "addq $8, %%rsp\n" // Remove alignment.
-          "popq %%rdi\n"     // Pop env
-          "popq %%rbp\n"
-          "popq %%rsp\n"
-          "movl $1, %%esi\n"
-          "call " SYM(longjmp) "\n"
-          :
-          : "r"(sp), "r"(exit_state), "r"(this)
-          : "%r14", "%r15");
-#else
-#error "Unknown architecture"
-#endif
-      // clang-format on
-    }
-    // Trigger the caller when we exit.
-    if (caller_ != nullptr) {
-      caller_->TriggerEvent();
-    }
-    // Functor returned, we are dead.
-    state_ = State::kCoDead;
-    scheduler_.RemoveCoroutine(this);
     break;
   case State::kCoYielded:
   case State::kCoWaiting:
-    state_ = State::kCoRunning;
-    // We use the onescomp of the result so that we can wait
-    // for standard input (fd 0).  We can't cause setjmp to
-    // return 0 from longjmp.  This means that we can't
-    // use -1 for the value as this would be returned from
-    // setjmp as 1, which is stdout's fd and that would be
-    // confusing.  Better to return something that can't be
-    // a valid fd.
-    if (value == -1) {
-      value = 0;
-    }
-    __real_longjmp(resume_, ~value);
+    // wait_result_ was set by the scheduler when the wait ended.
     break;
   case State::kCoRunning:
   case State::kCoNew:
-    // Should never get here.
-    break;
   case State::kCoDead:
-    __real_longjmp(exit_, 1);
-    break;
+    // Should never get here.
+    return;
+  }
+  state_ = State::kCoRunning;
+  stats_.resumes++;
+  scheduler_.stats_.switches++;
+  uint64_t start = 0;
+  if (scheduler_.timing_) {
+    start = Now();
+    if (suspended_at_ != 0) {
+      stats_.wait_ns += start - suspended_at_;
+    }
+  }
+#if defined(CO_TRACING)
+  scheduler_.Trace(TraceEvent::kResume, this);
+#endif
+  SwitchFromScheduler();
+
+  // Back in the scheduler.
+#if defined(CO_TRACING)
+  scheduler_.Trace(TraceEvent::kSuspend, this);
+#endif
+  if (start != 0) {
+    uint64_t now = Now();
+    uint64_t run = now - start;
+    stats_.run_ns += run;
+    stats_.max_run_ns = std::max(stats_.max_run_ns, run);
+    SchedulerStats &stats = scheduler_.stats_;
+    stats.run_ns += run;
+    if (run > stats.max_run_ns) {
+      stats.max_run_ns = run;
+      stats.max_run_name = name_;
+    }
+    suspended_at_ = now;
+  }
+  if (state_ == State::kCoDead) {
+    scheduler_.stats_.finished++;
+    if (stack_filled_ && !default_name_) {
+      scheduler_.RecordStackUsage(this);
+    }
+#if defined(CO_TRACING)
+    scheduler_.Trace(TraceEvent::kExit, this);
+#endif
+    // Wake up the caller when we exit.
+    if (caller_ != nullptr) {
+      scheduler_.MakeReady(caller_);
+    }
+    // This might delete the coroutine, so don't touch it after this.
+    scheduler_.RemoveCoroutine(this);
   }
 }
 
-CoroutineScheduler::CoroutineScheduler() {
+CoroutineScheduler::CoroutineScheduler(PollerType poller_type) {
+  poller_ = Poller::Create(poller_type);
+  if (poller_ == nullptr && poller_type == PollerType::kIoUring) {
+    // The kernel is too old or io_uring is turned off.
+    poller_ = Poller::Create(PollerType::kDefault);
+  }
+  if (poller_ == nullptr) {
+    poller_ = Poller::Create(PollerType::kPoll);
+  }
   interrupt_fd_.fd = NewEventFd();
   interrupt_fd_.events = POLLIN;
+  poller_->Add(nullptr, interrupt_fd_);
 }
 
-CoroutineScheduler::~CoroutineScheduler() { CloseEventFd(interrupt_fd_.fd); }
+CoroutineScheduler::~CoroutineScheduler() {
+  // Delete the coroutines we own that haven't finished.
+  Coroutine *c = coroutines_.Front();
+  while (c != nullptr) {
+    Coroutine *next = coroutines_.Next(c);
+    if (c->owned_by_scheduler_) {
+      // Unregisters itself.
+      delete c;
+    }
+    c = next;
+  }
+  poller_->Remove(nullptr, interrupt_fd_);
+  CloseEventFd(interrupt_fd_.fd);
+}
+
+void CoroutineScheduler::AddWaitFds(Coroutine *c) {
+  for (auto &fd : c->wait_fds_) {
+    poller_->Add(c, fd);
+  }
+}
+
+void CoroutineScheduler::RemoveWaitFds(Coroutine *c) {
+  for (auto &fd : c->wait_fds_) {
+    poller_->Remove(c, fd);
+  }
+}
+
+void CoroutineScheduler::AddTimer(Coroutine *c, uint64_t timeout_ns) {
+  c->deadline_ = Now() + timeout_ns;
+  timers_.Insert(c);
+}
+
+void CoroutineScheduler::EndWait(Coroutine *c) {
+  RemoveWaitFds(c);
+  if (c->wait_queue_ != nullptr) {
+    c->wait_queue_->Remove(c);
+  }
+  if (timers_.Contains(c)) {
+    timers_.Remove(c);
+  }
+}
+
+int64_t CoroutineScheduler::PollTimeoutNs() const {
+  if (HasReady()) {
+    return 0;
+  }
+  if (timers_.IsEmpty()) {
+    return -1;
+  }
+  uint64_t now = Now();
+  uint64_t deadline = timers_.TopDeadline();
+  if (deadline <= now) {
+    return 0;
+  }
+  uint64_t ns = deadline - now;
+  return ns > INT64_MAX ? INT64_MAX : static_cast<int64_t>(ns);
+}
+
+// For a caller's own poll, which only takes milliseconds.
+int CoroutineScheduler::PollTimeoutMs() const {
+  int64_t ns = PollTimeoutNs();
+  if (ns <= 0) {
+    return static_cast<int>(ns);
+  }
+  // Round up so that we don't wake up just before the deadline and have
+  // to poll again.
+  int64_t ms = (ns + 999999) / 1000000;
+  return ms > INT32_MAX ? INT32_MAX : static_cast<int>(ms);
+}
+
+// Any coroutine whose deadline has passed stops waiting for its fds and
+// goes into the ready queue.  It will be resumed with -1 to tell it
+// that it timed out.
+void CoroutineScheduler::ExpireTimers() {
+  if (timers_.IsEmpty()) {
+    return;
+  }
+  uint64_t now = Now();
+  while (!timers_.IsEmpty() && timers_.TopDeadline() <= now) {
+    Coroutine *c = timers_.Pop();
+    stats_.timeouts++;
+    WakeWaiter(c, -1);
+    MakeReady(c);
+  }
+}
+
+void CoroutineScheduler::WakeWaiter(Coroutine *c, int fd) {
+  EndWait(c);
+  // The registrations have gone, so EndOfWait has nothing left to do.
+  c->wait_fds_.clear();
+  c->wait_result_ = fd;
+}
 
 void CoroutineScheduler::BuildPollFds(PollState *poll_state) {
   poll_state->pollfds.clear();
   poll_state->coroutines.clear();
 
   poll_state->pollfds.push_back(interrupt_fd_);
-  for (auto *c : coroutines_) {
-    auto state = c->GetState();
-    if (state == Coroutine::State::kCoNew ||
-        state == Coroutine::State::kCoRunning ||
-        state == Coroutine::State::kCoDead) {
-      continue;
-    }
+  for (Coroutine *c = coroutines_.Front(); c != nullptr;
+       c = coroutines_.Next(c)) {
     c->AddPollFds(poll_state->pollfds, poll_state->coroutines);
-    if (state == Coroutine::State::kCoReady) {
-      // Coroutine is ready to go, trigger its event so that we can start
-      // it.
-      c->TriggerEvent();
-    }
   }
+  if (HasReady()) {
+    // There are coroutines ready to go.  Make sure that the caller's poll
+    // doesn't block.
+    TriggerEvent(interrupt_fd_.fd);
+  }
+  poll_state->timeout_ms = PollTimeoutMs();
 }
 
-// Schedule the next coroutine to run.  This scheduler chooses the
-// coroutine that has been waiting longest.  Unless they are just new
-// no two coroutines can have been waiting for the same amount of time.
-// This is a completely fair scheduler with all coroutines given the
-// same priority.
-CoroutineScheduler::ChosenCoroutine
-CoroutineScheduler::ChooseRunnable(PollState *poll_state, int num_ready) {
-  // Find the ready coroutine with the highest time waiting.
-  // We need to process all ready coroutines once to choose the
-  // one to run.
-  // Worst case is that all coroutines are ready, which means we
-  // need O(n) complexity.  We can't avoid processing all the ready
-  // coroutines so we only do it once rather than inserting them into
-  // a data structure and processing it afterwards.
-  Coroutine *chosen = nullptr;
-  int chosen_fd;
-  uint64_t max_wait;
-  for (size_t i = 1; i < poll_state->pollfds.size(); i++) {
-    struct pollfd *fd = &poll_state->pollfds[i];
-    Coroutine *co = poll_state->coroutines[i - 1];
-    uint64_t wait_time = tick_count_ - co->LastTick();
-    if (fd->revents != 0 && (chosen == nullptr || wait_time > max_wait)) {
-      chosen = co;
-      chosen_fd = fd->fd;
-      max_wait = wait_time;
-    }
-  }
-  if (chosen == nullptr) {
-    return ChosenCoroutine();
+void CoroutineScheduler::MakeReady(Coroutine *c) {
+  ReadyQueue &queue = ReadyQueueFor(c);
+  if (!queue.Contains(c)) {
+    queue.PushBack(c);
   }
-  return ChosenCoroutine(chosen, chosen_fd);
 }
 
-CoroutineScheduler::ChosenCoroutine
-CoroutineScheduler::GetRunnableCoroutine(PollState *poll_state, int num_ready) {
-  if (interrupt_fd_.revents != 0) {
-    // Interrupted.
-    ClearEvent(interrupt_fd_.fd);
+void CoroutineScheduler::RemoveFromReadyQueue(Coroutine *c) {
+  ReadyQueue &queue = ReadyQueueFor(c);
+  if (queue.Contains(c)) {
+    queue.Remove(c);
   }
+}
 
-  ChosenCoroutine chosen = ChooseRunnable(poll_state, num_ready);
+// All the coroutines whose fds are ready go into the ready queue in one
+// go, in the order of how long they have been waiting: the one that
+// last ran longest ago goes first.  They are behind anything already in
+// the queue, which has been waiting at least as long.  A coroutine can
+// appear more than once in the events if it's waiting for more than one
+// fd, but it's only woken for the first of them.
+void CoroutineScheduler::ProcessEvents(const std::vector<PollEvent> &events) {
+  woken_.clear();
+  uint64_t num_events = 0;
+  for (auto &event : events) {
+    Coroutine *co = event.co;
+    if (co == nullptr) {
+      // Interrupted, either by Stop or because functions have been posted.
+      ClearEvent(interrupt_fd_.fd);
+      RunPosted();
+      continue;
+    }
+    num_events++;
+    if (co->state_ != Coroutine::State::kCoWaiting || co->wait_fds_.empty()) {
+      // Already woken.
+      continue;
+    }
+    WakeWaiter(co, event.fd);
+    woken_.push_back(co);
+  }
+  std::sort(woken_.begin(), woken_.end(), [](Coroutine *a, Coroutine *b) {
+    return a->LastTick() < b->LastTick();
+  });
+  for (auto *co : woken_) {
+    MakeReady(co);
+  }
+  stats_.polls++;
+  stats_.poll_events += num_events;
+  stats_.max_poll_events = std::max(stats_.max_poll_events, num_events);
+}
 
-  if (chosen.co != nullptr) {
-    chosen.co->ClearEvent();
+// Run each coroutine that is in the ready queues now, highest priority
+// first.  Coroutines that become ready while the batch is running (by
+// yielding, say) go to the back of their queue and run in the next
+// batch, after another poll, so that nobody is starved: not those
+// waiting for an fd and not those with a low priority.  A coroutine that
+// is destroyed while in a queue removes itself, so it isn't run.
+//
+// A budget stops the batch early: after max_coroutines resumes, or when
+// the clock reaches end_ns if that isn't 0.  Whatever hasn't run stays
+// at the front of its queue.  Returns the number of coroutines resumed.
+size_t CoroutineScheduler::RunReadyBatch(size_t max_coroutines,
+                                         uint64_t end_ns) {
+  size_t counts[kNumPriorities];
+  size_t total = 0;
+  for (int p = 0; p < kNumPriorities; p++) {
+    counts[p] = ready_[p].Size();
+    total += counts[p];
+  }
+  int bucket = 0;
+  while (total != 0 && bucket < SchedulerStats::kReadyDepthBuckets - 1) {
+    total >>= 1;
+    bucket++;
+  }
+  stats_.ready_depth[bucket]++;
+  size_t resumed = 0;
+  for (int p = 0; p < kNumPriorities; p++) {
+    for (size_t n = counts[p]; n > 0; n--) {
+      if (resumed == max_coroutines || (end_ns != 0 && Now() >= end_ns)) {
+        return resumed;
+      }
+      Coroutine *c = ready_[p].PopFront();
+      if (c == nullptr) {
+        break;
+      }
+      // One more tick.
+      tick_count_++;
+      resumed++;
+      c->Resume();
+    }
   }
-  return chosen;
+  return resumed;
 }
 
 void CoroutineScheduler::Run() {
   running_ = true;
   while (running_) {
-    if (coroutines_.empty()) {
+    if (coroutines_.IsEmpty() && !run_forever_) {
       // No coroutines, nothing to do.
       break;
     }
-    setjmp(yield_);
-    // We get here any time a coroutine yields or waits.
-
-    BuildPollFds(&poll_state_);
-
-    // Wait for coroutines (or the interrupt fd) to trigger.
-    int num_ready =
-        ::poll(poll_state_.pollfds.data(), poll_state_.pollfds.size(), -1);
-    if (num_ready <= 0) {
-      continue;
+    if (poll_hook_ != nullptr) {
+      poll_hook_(!HasReady());
     }
 
-    // Copy interrupt fd from poll fd set.
-    interrupt_fd_ = poll_state_.pollfds[0];
-
-    // One more tick.
-    tick_count_++;
-
-    // Choose a runnable coroutine.
-    ChosenCoroutine c = GetRunnableCoroutine(&poll_state_, num_ready);
-    if (c.co != nullptr) {
-      c.co->Resume(c.fd);
-    }
+    // Wait for coroutines (or the interrupt fd) to trigger.  The poller
+    // already knows about all the fds we are interested in.  If there
+    // are coroutines in the ready queue we just pick up any fds that
+    // are ready without blocking.
+    events_.clear();
+    poller_->Poll(events_, PollTimeoutNs());
+    ExpireTimers();
+    ProcessEvents(events_);
+    RunReadyBatch();
   }
 }
 
@@ -595,42 +909,73 @@ void CoroutineScheduler::GetPollState(PollState *poll_state) {
 }
 
 void CoroutineScheduler::ProcessPoll(PollState *poll_state) {
-  int num_ready = 0;
+  events_.clear();
+  if (poll_state->pollfds[0].revents != 0) {
+    events_.emplace_back(nullptr, poll_state->pollfds[0].fd);
+  }
   for (size_t i = 1; i < poll_state->pollfds.size(); i++) {
     if (poll_state->pollfds[i].revents != 0) {
-      num_ready++;
+      events_.emplace_back(poll_state->coroutines[i - 1],
+                           poll_state->pollfds[i].fd);
     }
   }
-  // One more tick.
-  tick_count_++;
+  ExpireTimers();
+  ProcessEvents(events_);
+  RunReadyBatch();
+}
 
-  // Choose a runnable coroutine.
-  ChosenCoroutine c = GetRunnableCoroutine(poll_state, num_ready);
-  if (c.co != nullptr) {
-    c.co->Resume(c.fd);
+uint64_t CoroutineScheduler::NextDeadline() {
+  if (!poller_->PrepareWait() || HasReady()) {
+    return 0;
   }
+  return timers_.IsEmpty() ? kNoDeadline : timers_.TopDeadline();
+}
+
+size_t CoroutineScheduler::RunReady(size_t max_coroutines, uint64_t max_ns) {
+  uint64_t end_ns = max_ns == 0 ? 0 : Now() + max_ns;
+  size_t resumed = 0;
+  do {
+    events_.clear();
+    poller_->Poll(events_, 0);
+    ExpireTimers();
+    ProcessEvents(events_);
+    resumed += RunReadyBatch(max_coroutines - resumed, end_ns);
+  } while (HasReady() && resumed < max_coroutines &&
+           (end_ns == 0 || Now() < end_ns));
+  return resumed;
 }
 
 void CoroutineScheduler::AddCoroutine(Coroutine *c) {
-  coroutines_.push_back(c);
+  coroutines_.PushBack(c);
+  stats_.spawned++;
+#if defined(CO_TRACING)
+  Trace(TraceEvent::kSpawn, c);
+#endif
 }
 
 // Removes a coroutine but doesn't destruct it.  The coroutines's id will
 // be removed and can be reused immediately after the completion callback
 // is called.
 void CoroutineScheduler::RemoveCoroutine(Coroutine *c) {
+  if (!coroutines_.Contains(c)) {
+    return;
+  }
+  coroutines_.Remove(c);
   coroutine_ids_.Free(c->Id());
   last_freed_coroutine_id_ = c->Id();
 
-  for (auto it = coroutines_.begin(); it != coroutines_.end(); it++) {
-    if (*it == c) {
-      coroutines_.erase(it);
-      // Call completion callback to allow for external memory management.
-      if (completion_callback_ != nullptr) {
-        completion_callback_(c);
-      }
-      break;
-    }
+  // The callback may delete the coroutine if we don't own it, so don't
+  // touch it afterwards.
+  bool owned = c->owned_by_scheduler_;
+  CoroutinePool *pool = c->pool_;
+  // Call completion callback to allow for external memory management.
+  if (completion_callback_ != nullptr) {
+    completion_callback_(c);
+  }
+  if (owned) {
+    delete c;
+  } else if (pool != nullptr) {
+    pool->Finished(c);
   }
 }
 
@@ -646,23 +991,242 @@ uint32_t CoroutineScheduler::AllocateId() {
   return id;
 }
 
+// The interrupt fd is the only event fd in the scheduler.  Triggering
+// it wakes up the scheduler if it's blocked in a poll.
 void CoroutineScheduler::Stop() {
   running_ = false;
   TriggerEvent(interrupt_fd_.fd);
 }
 
+void CoroutineScheduler::Wake() { TriggerEvent(interrupt_fd_.fd); }
+
+void CoroutineScheduler::Post(std::function<void()> function) {
+  {
+    std::lock_guard<std::mutex> lock(posted_lock_);
+    posted_.push_back(std::move(function));
+  }
+  TriggerEvent(interrupt_fd_.fd);
+}
+
+// The interrupt event has already been cleared, so anything posted while
+// we are running the functions will trigger it again.
+void CoroutineScheduler::RunPosted() {
+  {
+    std::lock_guard<std::mutex> lock(posted_lock_);
+    running_posted_.swap(posted_);
+  }
+  for (auto &function : running_posted_) {
+    function();
+  }
+  running_posted_.clear();
+}
+
+Coroutine *CoroutineScheduler::Spawn(CoroutineFunction function,
+                                     const char *name, size_t stack_size,
+                                     void *user_data) {
+  Coroutine *c = new Coroutine(*this, std::move(function), name,
+                               /*autostart=*/false, stack_size, user_data);
+  c->owned_by_scheduler_ = true;
+  c->Start();
+  return c;
+}
+
+CoroutinePool::CoroutinePool(CoroutineScheduler &scheduler, size_t stack_size,
+                             size_t max_idle)
+    : scheduler_(scheduler), stack_size_(stack_size), max_idle_(max_idle) {}
+
+CoroutinePool::~CoroutinePool() {
+  while (!idle_.IsEmpty()) {
+    delete idle_.PopFront();
+  }
+  // Running coroutines become the scheduler's to delete.
+  while (!busy_.IsEmpty()) {
+    Coroutine *c = busy_.PopFront();
+    c->pool_ = nullptr;
+    c->owned_by_scheduler_ = true;
+  }
+}
+
+Coroutine *CoroutinePool::Spawn(CoroutineFunction function,
+                                const char *name) {
+  Coroutine *c;
+  if (idle_.IsEmpty()) {
+    c = new Coroutine(scheduler_, std::move(function), name,
+                      /*autostart=*/false, stack_size_);
+    c->pool_ = this;
+    c->Start();
+  } else {
+    c = idle_.PopFront();
+    c->Rearm(std::move(function), name);
+  }
+  busy_.PushBack(c);
+  return c;
+}
+
+void CoroutinePool::Finished(Coroutine *c) {
+  busy_.Remove(c);
+  if (idle_.Size() >= max_idle_) {
+    delete c;
+    return;
+  }
+  // Let go of whatever the function captured now rather than when the
+  // coroutine is next used.
+  c->function_ = nullptr;
+  idle_.PushFront(c);
+}
+
+#if defined(CO_TRACING)
+void CoroutineScheduler::Trace(TraceEvent event, Coroutine *c) {
+  if (trace_callback_ != nullptr) {
+    trace_callback_(event, c, Now());
+  }
+}
+#endif
+
+void CoroutineScheduler::RecordStackUsage(const Coroutine *c) {
+  size_t used = c->StackUsed();
+  size_t pages = (used + StackPool::PageSize() - 1) / StackPool::PageSize();
+  int bucket = 0;
+  while ((size_t(1) << bucket) < pages && bucket < kStackBuckets - 1) {
+    bucket++;
+  }
+  StackRecord &record = stack_records_[c->name_];
+  record.runs++;
+  record.max_used = std::max(record.max_used, used);
+  record.counts[bucket]++;
+}
+
+size_t CoroutineScheduler::StackP99(const StackRecord &record) {
+  uint64_t target = record.runs - record.runs / 100;
+  uint64_t total = 0;
+  for (int i = 0; i < kStackBuckets; i++) {
+    total += record.counts[i];
+    if (total >= target) {
+      return (size_t(1) << i) * StackPool::PageSize();
+    }
+  }
+  return record.max_used;
+}
+
+size_t CoroutineScheduler::ChooseStackSize(const std::string &name,
+                                           size_t stack_size) const {
+  auto it = stack_records_.find(name);
+  if (it == stack_records_.end() || it->second.runs < kMinStackRuns) {
+    return stack_size;
+  }
+  const StackRecord &record = it->second;
+  return StackPool::SizeClass(
+      std::max(StackP99(record), record.max_used + StackPool::PageSize()));
+}
+
+std::vector<StackUsage> CoroutineScheduler::StackUsages() const {
+  std::vector<StackUsage> usages;
+  for (auto &[name, record] : stack_records_) {
+    StackUsage usage;
+    usage.name = name;
+    usage.runs = record.runs;
+    usage.max_used = record.max_used;
+    usage.p99_used = StackP99(record);
+    if (record.runs >= kMinStackRuns) {
+      usage.stack_size = ChooseStackSize(name, 0);
+    }
+    usages.push_back(std::move(usage));
+  }
+  std::sort(usages.begin(), usages.end(),
+            [](const StackUsage &a, const StackUsage &b) {
+              return a.name < b.name;
+            });
+  return usages;
+}
+
+SchedulerStats CoroutineScheduler::Stats() const {
+  SchedulerStats stats = stats_;
+  stats.num_coroutines = coroutines_.Size();
+  for (auto &queue : ready_) {
+    stats.num_ready += queue.Size();
+  }
+  stats.num_timers = timers_.Size();
+  return stats;
+}
+
+std::string SchedulerStats::ToString() const {
+  char buffer[512];
+  int n = snprintf(
+      buffer, sizeof(buffer),
+      "coroutines %zu ready %zu timers %zu spawned %llu finished %llu "
+      "switches %llu polls %llu events/poll %.2f max %llu timeouts %llu",
+      num_coroutines, num_ready, num_timers,
+      static_cast<unsigned long long>(spawned),
+      static_cast<unsigned long long>(finished),
+      static_cast<unsigned long long>(switches),
+      static_cast<unsigned long long>(polls),
+      polls == 0 ? 0.0 : static_cast<double>(poll_events) / polls,
+      static_cast<unsigned long long>(max_poll_events),
+      static_cast<unsigned long long>(timeouts));
+  std::string s(buffer, std::min(static_cast<size_t>(n), sizeof(buffer) - 1));
+  if (run_ns != 0) {
+    snprintf(buffer, sizeof(buffer),
+             " run %.3fs longest %.3fms (%s)", run_ns / 1e9,
+             max_run_ns / 1e6, max_run_name.c_str());
+    s += buffer;
+  }
+  return s;
+}
+
 void CoroutineScheduler::Show() {
-  for (auto *co : coroutines_) {
+  for (Coroutine *co = coroutines_.Front(); co != nullptr;
+       co = coroutines_.Next(co)) {
     co->Show();
   }
 }
 
 std::vector<std::string> CoroutineScheduler::AllCoroutineStrings() const {
   std::vector<std::string> r;
-  for (auto *co : coroutines_) {
+  for (Coroutine *co = coroutines_.Front(); co != nullptr;
+       co = coroutines_.Next(co)) {
     r.emplace_back(co->ToString());
   }
   return r;
 }
 
+WaitQueue::~WaitQueue() {
+  while (Coroutine *c = waiters_.PopFront()) {
+    c->wait_queue_ = nullptr;
+  }
+}
+
+void WaitQueue::Remove(Coroutine *c) {
+  waiters_.Remove(c);
+  c->wait_queue_ = nullptr;
+}
+
+bool WaitQueue::Wait(Coroutine *c, uint64_t timeout_ns) {
+  c->state_ = Coroutine::State::kCoWaiting;
+  c->wait_queue_ = this;
+  waiters_.PushBack(c);
+  c->AddTimeout(timeout_ns);
+  c->yielded_address_ = __builtin_return_address(0);
+  c->last_tick_ = c->scheduler_.TickCount();
+  c->SwitchToScheduler();
+  // Get here when notified or timed out.  Either way the scheduler has
+  // taken us out of the queue.
+  return c->EndOfWait() != -1;
+}
+
+bool WaitQueue::NotifyOne() {
+  Coroutine *c = waiters_.Front();
+  if (c == nullptr) {
+    return false;
+  }
+  // Removes c from the queue.  There's no fd, so the wait result is 0.
+  c->scheduler_.WakeWaiter(c, 0);
+  c->scheduler_.MakeReady(c);
+  return true;
+}
+
+void WaitQueue::NotifyAll() {
+  while (NotifyOne()) {
+  }
+}
+
 } // namespace co
@@ -7,24 +7,38 @@
 
 #include <poll.h>
 
-#include <csetjmp>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <ctime>
 #include <functional>
-#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "arena.h"
 #include "bitset.h"
+#include "inline_function.h"
+#include "intrusive_list.h"
+#include "poller.h"
+#include "stack_pool.h"
+#include "timer_heap.h"
 
 namespace co {
 
 class CoroutineScheduler;
 class Coroutine;
 template <typename T> class Generator;
+class WaitQueue;
+class CoroutinePool;
 
-using CoroutineFunction = std::function<void(Coroutine *)>;
+// The body of a coroutine.  A lambda with up to 48 bytes of captures is
+// held inside it, so making a coroutine from one doesn't allocate memory
+// for the function.
+using CoroutineFunction = InlineFunction<void(Coroutine *)>;
 using CompletionCallback = std::function<void(Coroutine *)>;
 
 template <typename T>
@@ -32,6 +46,87 @@ using GeneratorFunction = std::function<void(Generator<T> *)>;
 
 constexpr size_t kCoDefaultStackSize = 32 * 1024;
 
+// The scheduler runs the ready coroutines in a batch after each poll.
+// Within a batch, high priority coroutines run before normal ones and
+// normal before low.  Everything that was ready when the batch started
+// runs in that batch, so a low priority coroutine is delayed by at most
+// one batch's worth of higher priority work and is never starved.
+enum class Priority {
+  kHigh,
+  kNormal,
+  kLow,
+};
+constexpr int kNumPriorities = 3;
+
+// Counters kept by the scheduler, for monitoring.  Get a snapshot with
+// CoroutineScheduler::Stats.  The counters cost an increment or two per
+// switch and are always kept.  The times are only kept while timing is
+// turned on with CoroutineScheduler::SetTiming, as they need the clock to
+// be read twice per switch.
+struct SchedulerStats {
+  static constexpr int kReadyDepthBuckets = 16;
+
+  uint64_t switches = 0;        // Times a coroutine was resumed.
+  uint64_t polls = 0;           // Times the kernel was polled.
+  uint64_t poll_events = 0;     // Fds found ready by the polls.
+  uint64_t max_poll_events = 0; // Most fds found ready by one poll.
+  uint64_t spawned = 0;         // Coroutines created.
+  uint64_t finished = 0;        // Coroutines whose function returned.
+  uint64_t timeouts = 0;        // Waits and sleeps ended by their timer.
+
+  // How many coroutines were ready to run at the start of each batch.
+  // Bucket 0 counts the empty batches and bucket i the batches of 2^(i-1)
+  // to 2^i - 1 coroutines.  The last bucket has all the bigger ones.
+  uint64_t ready_depth[kReadyDepthBuckets] = {};
+
+  // Only while timing is on.
+  uint64_t run_ns = 0;      // Time spent running coroutines.
+  uint64_t max_run_ns = 0;  // Longest a coroutine ran without switching.
+  std::string max_run_name; // The coroutine that did that.
+
+  // As of the snapshot.
+  size_t num_coroutines = 0;
+  size_t num_ready = 0;
+  size_t num_timers = 0;
+
+  // A one line summary, for logs.
+  std::string ToString() const;
+};
+
+// Counters for a coroutine.  As with SchedulerStats, the times are only
+// kept while the scheduler's timing is on.
+struct CoroutineStats {
+  uint64_t resumes = 0;    // Times the coroutine was switched to.
+  uint64_t run_ns = 0;     // Time spent running.
+  uint64_t wait_ns = 0;    // Time between switching out and back in.
+  uint64_t max_run_ns = 0; // Longest run without switching out.
+};
+
+// How much stack the coroutines with a given name have used, from
+// CoroutineScheduler::StackUsages.
+struct StackUsage {
+  std::string name;
+  uint64_t runs = 0;     // Coroutines that have exited.
+  size_t max_used = 0;   // The most any of them used, in bytes.
+  size_t p99_used = 0;   // 99% used this or less (rounded up to a power
+                         // of two pages).
+  size_t stack_size = 0; // The size new ones get with automatic sizes, or
+                         // 0 if there aren't enough runs to go on yet.
+};
+
+// What a trace callback is being told about.
+enum class TraceEvent {
+  kSpawn,   // A coroutine was created.
+  kResume,  // The coroutine is about to run.
+  kSuspend, // The coroutine has switched back to the scheduler.
+  kExit,    // The coroutine's function returned, or it was destroyed first.
+};
+
+// Called in the scheduler's thread with the event, the coroutine and the
+// CLOCK_MONOTONIC time in nanoseconds.  A kSuspend follows every kResume.
+using TraceCallback =
+    std::function<void(TraceEvent event, Coroutine *c, uint64_t now_ns)>;
+
 extern "C" {
 // This is needed here because it's a friend with C linkage.
 void __co_Invoke(class Coroutine *c);
@@ -42,7 +137,8 @@ template <typename T> class Generator;
 // This is a Coroutine.  It executes its function (pointer to a function
 // or a lambda).
 //
-// It has its own stack with default size kCoDefaultStackSize.
+// It has its own stack with default size kCoDefaultStackSize.  The
+// stack size is rounded up to a whole number of pages.
 // By default, the coroutine will be given a unique name and will
 // be started automatically.  It can have some user data which is
 // not owned by the coroutine.
@@ -50,7 +146,8 @@ class Coroutine {
 public:
   Coroutine(CoroutineScheduler &machine, CoroutineFunction function,
             const char *name = nullptr, bool autostart = true,
-            size_t stack_size = kCoDefaultStackSize, void *user_data = nullptr);
+            size_t stack_size = kCoDefaultStackSize, void *user_data = nullptr,
+            Priority priority = Priority::kNormal);
 
   ~Coroutine();
 
@@ -60,9 +157,25 @@ public:
   // Yield control to another coroutine.
   void Yield();
 
-  // Call another coroutine and store the result.
+  // Call another coroutine and store the result.  If the generator
+  // finishes without yielding a value, the result is a default
+  // constructed T.
   template <typename T> T Call(Generator<T> &callee);
 
+  // Call a generator and return the value it yields, or an empty optional
+  // if it finishes without yielding one.  The value is moved, not copied,
+  // and T doesn't need a default constructor.
+  template <typename T> std::optional<T> CallOptional(Generator<T> &callee);
+
+  // Call a generator and have it fill values[0..max_values) before it
+  // switches back to us.  Each YieldValue stores a value and carries on
+  // running the generator until the batch is full (or it finishes), so a
+  // tight producer loop costs one round trip per batch instead of per
+  // value.  Returns the number of values stored, which is less than
+  // max_values only if the generator finished.
+  template <typename T>
+  size_t Call(Generator<T> &callee, T *values, size_t max_values);
+
   // For all Wait functions, the timeout is optional and if greater than zero
   // specifies a nanosecond timeout.  If the timeout occurs before the fd (or
   // one of the fds) becomes ready, Wait will return -1. If an fd is ready, Wait
@@ -92,7 +205,10 @@ public:
 
   // Set and get the name.  You can change the name at any time.  It's
   // only for debug really.
-  void SetName(const std::string &name) { name_ = name; }
+  void SetName(const std::string &name) {
+    name_ = name;
+    default_name_ = false;
+  }
   const std::string &Name() const { return name_; }
 
   // Set and get the user data (not owned by the coroutine).  It's up
@@ -101,15 +217,42 @@ public:
   void SetUserData(void *user_data) { user_data_ = user_data; }
   void *UserData() const { return user_data_; }
 
+  // Set and get the priority.  Changing the priority of a coroutine that
+  // is ready to run moves it to the back of its new priority's queue.
+  void SetPriority(Priority priority);
+  Priority GetPriority() const { return priority_; }
+
+  // Memory that lasts as long as the coroutine, for its short lived
+  // allocations.  Allocating is a pointer bump and freeing does nothing
+  // until the coroutine is destroyed, when all the memory goes back to the
+  // scheduler's stack pool in one go.  Use it with the std::pmr types:
+  //
+  //   std::pmr::string s(c->Arena());
+  //
+  // Nothing allocated from it can outlive the coroutine.
+  std::pmr::memory_resource *Arena() { return &arena_; }
+
   // Is the given coroutine alive?
   bool IsAlive() const;
 
   uint64_t LastTick() const { return last_tick_; }
   CoroutineScheduler &Scheduler() const { return scheduler_; }
 
+  const CoroutineStats &Stats() const { return stats_; }
+
+  // The size of the stack, and the most of it that has been used so far
+  // if the scheduler was monitoring stacks when the coroutine was made
+  // (0 if not).  The usage is found by looking for the deepest point at
+  // which the pattern the stack was filled with has been overwritten, so
+  // it's a little low if the deepest frame left some of it alone.
+  size_t StackSize() const { return stack_size_; }
+  size_t StackUsed() const;
+
   void Show() const;
 
-  // Each coroutine has a unique id.
+  // Each coroutine has a unique id.  Ids are small integers that are
+  // reused when coroutines finish, so a vector indexed by Id() is an O(1)
+  // way to find the owner of a coroutine in a completion callback.
   uint32_t Id() const { return id_; }
 
   void SeToStringCallback(std::function<std::string()> cb) {
@@ -131,17 +274,22 @@ private:
   };
   friend class CoroutineScheduler;
   template <typename T> friend class Generator;
+  friend class WaitQueue;
+  friend class CoroutinePool;
 
   friend void __co_Invoke(Coroutine *c);
   void InvokeFunction();
-  int EndOfWait(int timer_fd, int result);
-  int AddTimeout(uint64_t timeout_ns);
+  // Make a coroutine that has finished ready to run another function,
+  // keeping its stack.
+  void Rearm(CoroutineFunction function, const char *name);
+  int EndOfWait();
+  void AddTimeout(uint64_t timeout_ns);
   State GetState() const { return state_; }
   void AddPollFds(std::vector<struct pollfd> &pollfds,
                   std::vector<Coroutine *> &covec);
-  void Resume(int value);
-  void TriggerEvent();
-  void ClearEvent();
+  void Resume();
+  void SwitchToScheduler();
+  void SwitchFromScheduler();
   void CallNonTemplate(Coroutine &c);
   void YieldNonTemplate();
 
@@ -152,16 +300,30 @@ private:
   CoroutineFunction function_; // Coroutine body.
   std::string name_;           // Optional name.
   State state_;
-  void *stack_;                     // Stack, allocated from malloc.
+  void *stack_;                     // Stack, from scheduler's stack pool.
   void *yielded_address_ = nullptr; // Address at which we've yielded.
   size_t stack_size_;
-  jmp_buf resume_;                      // Program environemnt for resuming.
-  jmp_buf exit_;                        // Program environemt to exit.
-  struct pollfd event_fd_;              // Pollfd for event.
+  ArenaResource arena_;                 // Memory for the coroutine's use.
+  void *context_ = nullptr;             // Saved stack pointer when switched out.
   std::vector<struct pollfd> wait_fds_; // Pollfds for waiting for an fd.
   Coroutine *caller_ = nullptr;         // If being called, who is calling us.
   void *user_data_;                     // User data, not owned by this.
   uint64_t last_tick_ = 0;              // Tick count of last resume.
+  ListLink<Coroutine> ready_link_;      // Link in scheduler's ready queue.
+  ListLink<Coroutine> registry_link_;   // Link in scheduler's coroutines_.
+  bool owned_by_scheduler_ = false;     // Created by Spawn.
+  Priority priority_;                   // Which ready queue we go in.
+  uint64_t deadline_ = 0;               // Wait timeout (CLOCK_MONOTONIC ns).
+  int timer_index_ = -1;                // Index in scheduler's timer heap.
+  int wait_result_ = -1;                // Fd that ended wait, -1 if timeout.
+  WaitQueue *wait_queue_ = nullptr;     // Wait queue we are parked in.
+  ListLink<Coroutine> wait_link_;       // Link in wait_queue_.
+  CoroutineStats stats_;
+  uint64_t suspended_at_ = 0; // When it last switched out, if timing.
+  bool default_name_ = false; // Name made up from the id.
+  bool stack_filled_ = false; // Stack filled with the canary pattern.
+  CoroutinePool *pool_ = nullptr; // The pool it goes back to when done.
+  ListLink<Coroutine> pool_link_; // Link in the pool's idle or busy list.
 
   // Function used to create a string for this coroutine.
   std::function<std::string()> to_string_callback_;
@@ -185,23 +347,40 @@ public:
                   name, /*autostart=*/false, stack_size, user_data),
         gen_function_(function) {}
 
-  // Yield control and store value.
+  // Yield control and store value.  During a batched Call, control is
+  // only yielded when the batch is full.
   void YieldValue(const T &value);
+  void YieldValue(T &&value);
 
 private:
   friend class Coroutine;
+
+  // Store a value for the caller.  Returns true if it's time to switch
+  // back to the caller.
+  template <typename U> bool Store(U &&value);
+
   GeneratorFunction<T> gen_function_;
-  T *result_ = nullptr; // Where to put result in YieldValue.
+  std::optional<T> *result_ = nullptr; // Where to put result in YieldValue.
+  T *batch_ = nullptr;                 // Where to put results in a batch.
+  size_t batch_size_ = 0;
+  size_t batch_count_ = 0;
 };
 
 struct PollState {
   std::vector<struct pollfd> pollfds;
   std::vector<Coroutine *> coroutines;
+  // Timeout in milliseconds to use for the poll so that coroutines waiting
+  // with a timeout are woken in time.  -1 means no timeout.
+  int timeout_ms = -1;
 };
 
 class CoroutineScheduler {
 public:
-  CoroutineScheduler();
+  // The poller type determines the kernel facility used to wait for
+  // file descriptors.  If the requested type isn't available on this
+  // operating system, the portable ::poll fallback is used (kIoUring
+  // falls back to the default first).
+  CoroutineScheduler(PollerType poller_type = PollerType::kDefault);
   ~CoroutineScheduler();
 
   // Run the scheduler until all coroutines have terminated or
@@ -209,18 +388,86 @@ public:
   void Run();
 
   // Stop the scheduler.  Running coroutines will not be terminated.
+  // This can be called from any thread, or a signal handler.
   void Stop();
 
+  // Normally Run returns when there are no coroutines left.  If run_forever
+  // is set it only returns when Stop is called, so that work can be posted
+  // to the scheduler from other threads.
+  void SetRunForever(bool run_forever) { run_forever_ = run_forever; }
+
+  // Call a function in the scheduler's thread.  This, and Stop, are the
+  // only functions that can be called from other threads.  The function is
+  // called by the scheduler (not in a coroutine) the next time it wakes up,
+  // so it must not block.  It can create coroutines.
+  void Post(std::function<void()> function);
+
+  // Wake the scheduler if it is blocked in a poll.  Can be called from any
+  // thread.
+  void Wake();
+
+  // Set a function to be called each time round the scheduler's loop in
+  // Run, before it polls.  The argument is true if there are no coroutines
+  // ready to run, so the scheduler will block in the poll unless the hook
+  // makes a coroutine ready.  SchedulerGroup uses this to hand out fresh
+  // coroutines.
+  void SetPollHook(std::function<void(bool idle)> hook) {
+    poll_hook_ = std::move(hook);
+  }
+
+  // Create a coroutine that is owned by the scheduler.  It's deleted when
+  // it finishes, after the completion callback has been called.  This must
+  // be called in the scheduler's thread.  Use Post to spawn a coroutine
+  // from another thread.
+  Coroutine *Spawn(CoroutineFunction function, const char *name = nullptr,
+                   size_t stack_size = kCoDefaultStackSize,
+                   void *user_data = nullptr);
+
+  // Coroutine registration.  Both are O(1) and don't allocate memory.
   void AddCoroutine(Coroutine *c);
   void RemoveCoroutine(Coroutine *c);
   void StartCoroutine(Coroutine *c);
 
   // When you don't want to use the Run function, these
   // functions allow you to incorporate the multiplexed
-  // IO into your own poll loop.
+  // IO into your own poll loop.  Use the timeout_ms in
+  // the PollState as the timeout for your poll.  They don't
+  // work with the io_uring poller, whose completions don't
+  // come through pollfds.
   void GetPollState(PollState *poll_state);
   void ProcessPoll(PollState *poll_state);
 
+  // Another way to run the scheduler from your own event loop, such as an
+  // epoll loop, that doesn't build anything per iteration.  Add PollFd to
+  // your loop, waiting for it to be readable, and call RunReady when it
+  // is or when the time given by NextDeadline comes.  Once the scheduler
+  // has warmed up none of these allocate memory.
+  static constexpr uint64_t kNoDeadline = ~0ULL;
+
+  // The fd for your loop to wait for.  It's the same for the life of the
+  // scheduler.  It is -1 with PollerType::kPoll, which has no such fd;
+  // use GetPollState and ProcessPoll with that.  With io_uring your wait
+  // may fail with EINTR when the kernel has finished work for the ring;
+  // treat that as the fd being readable.
+  int PollFd() const { return poller_->Fd(); }
+
+  // When RunReady must be called even if PollFd isn't readable, as a
+  // CLOCK_MONOTONIC time in nanoseconds: 0 if there's work to do now,
+  // kNoDeadline if there's no timer.  Call this just before your loop
+  // waits, as it also passes anything the coroutines have queued up for
+  // the kernel (io_uring submissions) to it.
+  uint64_t NextDeadline();
+
+  // Pick up the events that are ready, without waiting, and run the
+  // ready coroutines, with a poll between each batch as in Run, until
+  // none are ready or the budget is used up: max_coroutines resumes, or
+  // max_ns nanoseconds if that isn't 0.  A running coroutine can't be
+  // interrupted, so the time can be overrun by one coroutine's run.  As a
+  // coroutine that yields is ready again straight away, the count is what
+  // stops one that loops yielding from keeping us here.  Returns the
+  // number of coroutines resumed.
+  size_t RunReady(size_t max_coroutines, uint64_t max_ns = 0);
+
   // Print the state of all the coroutines to stderr.
   void Show();
 
@@ -234,46 +481,263 @@ public:
   // coroutines.
   std::vector<std::string> AllCoroutineStrings() const;
 
+  // A snapshot of the scheduler's counters.  Call it in the scheduler's
+  // thread, from a coroutine say, and publish the result if other threads
+  // want it.
+  SchedulerStats Stats() const;
+
+  // Turn on timing of the coroutines' runs and waits, in SchedulerStats
+  // and CoroutineStats.  It costs two reads of the clock per switch.
+  void SetTiming(bool timing) { timing_ = timing; }
+
+  // Set a function to be called when coroutines are created, resumed,
+  // suspended and exit, to feed a tracer (like Perfetto or Chrome's
+  // about:tracing).  Tracing is compiled in only when the library is built
+  // with CO_TRACING defined (bazel build --config=trace).  Otherwise the
+  // callback is never called and there is no cost at all.
+  void SetTraceCallback(TraceCallback callback) {
+    trace_callback_ = std::move(callback);
+  }
+  static constexpr bool kTracingEnabled =
+#if defined(CO_TRACING)
+      true;
+#else
+      false;
+#endif
+
+  // Stack monitoring fills the stack of each new coroutine with a pattern
+  // so that the most of it that is used can be measured, by Coroutine's
+  // StackUsed and in its ToString.  When a coroutine with a name (other
+  // than the one made up from its id) exits, its usage is added to the
+  // figures for that name, so coroutines made in the same place are
+  // counted together.  Filling the stack touches every page of it, so
+  // it costs memory as well as time.
+  //
+  // With automatic sizes, which turns on monitoring, a coroutine whose
+  // name has been seen to exit at least kMinStackRuns times gets a stack
+  // big enough for what 99 of 100 of them used and for the most any of
+  // them used, plus a page, whatever stack size it asks for.
+  static constexpr uint64_t kMinStackRuns = 100;
+  void SetStackMonitoring(bool monitoring) { stack_monitoring_ = monitoring; }
+  void SetAutomaticStackSizes(bool automatic) {
+    automatic_stack_sizes_ = automatic;
+    stack_monitoring_ |= automatic;
+  }
+
+  // The stack usage for each name, in name order.
+  std::vector<StackUsage> StackUsages() const;
+
+  PollerType GetPollerType() const { return poller_->Type(); }
+
+  // The poller's io_uring, or nullptr if it doesn't use one.
+  IoUring *Uring() { return poller_->Uring(); }
+
 private:
   friend class Coroutine;
   template <typename T> friend class Generator;
-  struct ChosenCoroutine {
-    ChosenCoroutine() = default;
-    ChosenCoroutine(Coroutine *c, int f) : co(c), fd(f) {}
-    Coroutine *co = nullptr;
-    int fd = 0x12345678;
-  };
-
+  friend class WaitQueue;
   void BuildPollFds(PollState *poll_state);
-  ChosenCoroutine ChooseRunnable(PollState *poll_state, int num_ready);
 
-  ChosenCoroutine GetRunnableCoroutine(PollState *poll_state, int num_ready);
+  // Move the coroutines whose fds are ready into the ready queue, then run
+  // everything in the ready queue once.
+  void ProcessEvents(const std::vector<PollEvent> &events);
+  size_t RunReadyBatch(size_t max_coroutines = SIZE_MAX, uint64_t end_ns = 0);
+
+  // End a coroutine's wait because an fd is ready (or -1 for a timeout).
+  void WakeWaiter(Coroutine *c, int fd);
+
+  // Register and unregister the fds a coroutine is waiting for.
+  void AddWaitFds(Coroutine *c);
+  void RemoveWaitFds(Coroutine *c);
+
+  // Put a coroutine at the back of the ready queue, if it's not already
+  // in it.  This doesn't involve the kernel at all.
+  void MakeReady(Coroutine *c);
+  void RemoveFromReadyQueue(Coroutine *c);
+
+  // Timeouts for waits and sleeps are held in the timer heap.  The
+  // nearest deadline is the timeout for the poll.
+  void AddTimer(Coroutine *c, uint64_t timeout_ns);
+  void EndWait(Coroutine *c);
+  int64_t PollTimeoutNs() const;
+  int PollTimeoutMs() const;
+  void ExpireTimers();
+  void RunPosted();
   uint32_t AllocateId();
   uint64_t TickCount() const { return tick_count_; }
+#if defined(CO_TRACING)
+  void Trace(TraceEvent event, Coroutine *c);
+#endif
+
+  // The stack usage of the coroutines with a name.  Bucket i counts
+  // those that used more than 2^(i-1) pages and up to 2^i.
+  static constexpr int kStackBuckets = 32;
+  struct StackRecord {
+    uint64_t runs = 0;
+    size_t max_used = 0;
+    uint64_t counts[kStackBuckets] = {};
+  };
+  void RecordStackUsage(const Coroutine *c);
+  static size_t StackP99(const StackRecord &record);
+  size_t ChooseStackSize(const std::string &name, size_t stack_size) const;
   bool IdExists(uint32_t id) const { return coroutine_ids_.Contains(id); }
-  jmp_buf &YieldBuf() { return yield_; }
 
-  std::list<Coroutine *> coroutines_;
+  // All the coroutines in the scheduler, in the order they were created.
+  IntrusiveList<Coroutine, &Coroutine::registry_link_> coroutines_;
+  StackPool stacks_;
+  // Coroutines that are ready to run and are not waiting for an fd, in the
+  // order in which they became ready.  One queue per priority.
+  using ReadyQueue = IntrusiveList<Coroutine, &Coroutine::ready_link_>;
+  ReadyQueue &ReadyQueueFor(const Coroutine *c) {
+    return ready_[static_cast<int>(c->priority_)];
+  }
+  bool HasReady() const {
+    return !ready_[0].IsEmpty() || !ready_[1].IsEmpty() || !ready_[2].IsEmpty();
+  }
+  ReadyQueue ready_[kNumPriorities];
+  TimerHeap<Coroutine, &Coroutine::deadline_, &Coroutine::timer_index_>
+      timers_;
   BitSet coroutine_ids_;
   uint32_t last_freed_coroutine_id_ = -1U;
-  jmp_buf yield_;
-  bool running_ = false;
+  void *context_ = nullptr; // Scheduler's stack pointer while a coroutine runs.
+  // The scheduler's stack, for ASAN's benefit.
+  const void *stack_bottom_ = nullptr;
+  size_t stack_size_ = 0;
+  std::atomic<bool> running_ = false;
+  bool run_forever_ = false;
   PollState poll_state_;
+  std::unique_ptr<Poller> poller_;
+  std::vector<PollEvent> events_; // Events from the last poll.
+  std::vector<Coroutine *> woken_; // Coroutines woken by the last poll.
   struct pollfd interrupt_fd_;
   uint64_t tick_count_ = 0;
+  SchedulerStats stats_; // The counters.  The gauges are filled in by Stats.
+  bool timing_ = false;
+  TraceCallback trace_callback_;
+  bool stack_monitoring_ = false;
+  bool automatic_stack_sizes_ = false;
+  std::unordered_map<std::string, StackRecord> stack_records_;
   CompletionCallback completion_callback_;
+  std::function<void(bool)> poll_hook_;
+
+  // Functions posted from other threads.
+  std::mutex posted_lock_;
+  std::vector<std::function<void()>> posted_;
+  std::vector<std::function<void()>> running_posted_;
 };
 
-template <typename T> inline void Generator<T>::YieldValue(const T &value) {
-  // Copy value.
+// A queue of coroutines that are waiting for something that isn't an fd,
+// like space in a Channel.  Waiting and notifying don't involve the
+// kernel at all: a notified coroutine just goes into the scheduler's
+// ready queue.  Waiters are notified in the order they started to wait.
+//
+// A WaitQueue must only be used by coroutines in the same scheduler.
+// If it is destroyed while coroutines are waiting in it, they are left
+// waiting (they will still time out if they gave a timeout).
+class WaitQueue {
+public:
+  WaitQueue() = default;
+  WaitQueue(const WaitQueue &) = delete;
+  WaitQueue &operator=(const WaitQueue &) = delete;
+  ~WaitQueue();
+
+  // Park the coroutine until it is notified.  The timeout is optional and
+  // if greater than zero specifies a nanosecond timeout.  Returns true if
+  // notified, false on timeout.
+  bool Wait(Coroutine *c, uint64_t timeout_ns = 0);
+
+  // Make the longest waiting coroutine ready to run.  Returns false if
+  // there was no coroutine waiting.
+  bool NotifyOne();
+
+  // Make all the waiting coroutines ready to run.
+  void NotifyAll();
+
+  bool IsEmpty() const { return waiters_.IsEmpty(); }
+
+private:
+  friend class CoroutineScheduler;
+  void Remove(Coroutine *c);
+
+  IntrusiveList<Coroutine, &Coroutine::wait_link_> waiters_;
+};
+
+// A pool of coroutines that are used again rather than destroyed when
+// their functions return.  A coroutine that finishes goes back to the
+// pool with its stack, and Spawn gives it a new function and starts it
+// again, so once the pool has warmed up starting a coroutine costs no
+// memory allocation at all (as long as the function's captures fit in a
+// CoroutineFunction and the name, if any, is short enough for the
+// std::string not to allocate).  This suits a server that starts a
+// coroutine for every connection.
+//
+// The pool owns its coroutines; don't delete them.  It must be destroyed
+// before the scheduler, in the scheduler's thread.  Coroutines that are
+// still running when it is destroyed are handed over to the scheduler,
+// which deletes them when they finish, as if they had been spawned by it.
+class CoroutinePool {
+public:
+  static constexpr size_t kDefaultMaxIdle = 1024;
+
+  // All the coroutines have stacks of the same size.  At most max_idle
+  // finished coroutines are kept and any more are deleted.
+  explicit CoroutinePool(CoroutineScheduler &scheduler,
+                         size_t stack_size = kCoDefaultStackSize,
+                         size_t max_idle = kDefaultMaxIdle);
+  ~CoroutinePool();
+  CoroutinePool(const CoroutinePool &) = delete;
+  CoroutinePool &operator=(const CoroutinePool &) = delete;
+
+  // Start a coroutine running the function, using an idle one if there is
+  // one and making a new one if not.  The completion callback is called
+  // when it finishes, as for any coroutine.
+  Coroutine *Spawn(CoroutineFunction function, const char *name = nullptr);
+
+  size_t NumIdle() const { return idle_.Size(); }
+  size_t NumBusy() const { return busy_.Size(); }
+
+private:
+  friend class CoroutineScheduler;
+  using List = IntrusiveList<Coroutine, &Coroutine::pool_link_>;
+
+  // Called by the scheduler when one of our coroutines finishes.
+  void Finished(Coroutine *c);
+
+  CoroutineScheduler &scheduler_;
+  size_t stack_size_;
+  size_t max_idle_;
+  List idle_; // Most recently finished first, as its stack is warmest.
+  List busy_;
+};
+
+template <typename T>
+template <typename U>
+inline bool Generator<T>::Store(U &&value) {
+  if (batch_ != nullptr) {
+    batch_[batch_count_++] = std::forward<U>(value);
+    return batch_count_ == batch_size_;
+  }
   if (result_ != nullptr) {
-    *result_ = value;
+    result_->emplace(std::forward<U>(value));
   }
-  YieldNonTemplate();
+  return true;
 }
 
-template <typename T> inline T Coroutine::Call(Generator<T> &callee) {
-  T result;
+template <typename T> inline void Generator<T>::YieldValue(const T &value) {
+  if (Store(value)) {
+    YieldNonTemplate();
+  }
+}
+
+template <typename T> inline void Generator<T>::YieldValue(T &&value) {
+  if (Store(std::move(value))) {
+    YieldNonTemplate();
+  }
+}
+
+template <typename T>
+inline std::optional<T> Coroutine::CallOptional(Generator<T> &callee) {
+  std::optional<T> result;
   // Tell the callee that it's being called and where to store the value.
   callee.caller_ = this;
   callee.result_ = &result;
@@ -283,5 +747,28 @@ template <typename T> inline T Coroutine::Call(Generator<T> &callee) {
   return result;
 }
 
+template <typename T> inline T Coroutine::Call(Generator<T> &callee) {
+  std::optional<T> result = CallOptional(callee);
+  if (!result.has_value()) {
+    return T();
+  }
+  return std::move(*result);
+}
+
+template <typename T>
+inline size_t Coroutine::Call(Generator<T> &callee, T *values,
+                              size_t max_values) {
+  if (max_values == 0) {
+    return 0;
+  }
+  callee.caller_ = this;
+  callee.batch_ = values;
+  callee.batch_size_ = max_values;
+  callee.batch_count_ = 0;
+  CallNonTemplate(callee);
+  callee.batch_ = nullptr;
+  return callee.batch_count_;
+}
+
 } // namespace co
 #endif /* coroutine_h */
@@ -1,13 +1,25 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <memory>
+#include <thread>
 #include <vector>
 
 #include "coroutine.h"
+#include "scheduler_group.h"
 
 using namespace co;
 
+#define CHECK(e)                                                               \
+  do {                                                                         \
+    if (!(e)) {                                                                \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #e);    \
+      abort();                                                                 \
+    }                                                                          \
+  } while (0)
+
 void Test(Coroutine* c) {
   for (int i = 0; i < 10; i++) {
     // printf("%s: %d\n", c->Name().c_str(), i);
@@ -15,6 +27,67 @@ void Test(Coroutine* c) {
   }
 }
 
+// Threads outside a 4 scheduler group post closures and spawn coroutines
+// into it, and half of those coroutines spawn another from inside the
+// group.  Every item must run exactly once and Join must return after
+// Stop.
+void TestGroup() {
+  constexpr int kThreads = 4;
+  constexpr int kItemsPerThread = 5000;
+  constexpr int kItems = kThreads * kItemsPerThread;
+  SchedulerGroup group(4);
+  group.Start();
+  std::vector<std::atomic<int>> runs(kItems);
+  std::atomic<int> done = 0;
+  auto run = [&runs, &done](int item) {
+    runs[item]++;
+    done++;
+  };
+
+  std::vector<std::thread> posters;
+  for (int t = 0; t < kThreads; t++) {
+    posters.emplace_back([&group, &run, t]() {
+      for (int i = 0; i < kItemsPerThread; i++) {
+        int item = t * kItemsPerThread + i;
+        switch (i % 4) {
+        case 0:
+          group.Post(item % group.Size(), [&run, item]() { run(item); });
+          break;
+        case 1:
+          group.Spawn(item % group.Size(), [&run, item](Coroutine* c) {
+            c->Yield();
+            run(item);
+          });
+          break;
+        case 2:
+          group.Spawn([&run, item](Coroutine* c) { run(item); });
+          break;
+        case 3:
+          // The second coroutine is spawned from inside the group so it
+          // goes through the scheduler's own deque.
+          group.Spawn([&group, &run, item](Coroutine* c) {
+            group.Spawn([&run, item](Coroutine* c) { run(item); });
+          });
+          break;
+        }
+      }
+    });
+  }
+  for (auto& poster : posters) {
+    poster.join();
+  }
+  for (int i = 0; i < 30000 && done < kItems; i++) {
+    usleep(1000);
+  }
+  CHECK(done == kItems);
+  group.Stop();
+  group.Join();
+  for (int i = 0; i < kItems; i++) {
+    CHECK(runs[i] == 1);
+  }
+  printf("group: %d items\n", kItems);
+}
+
 int main(int argc, char** argv) {
   CoroutineScheduler scheduler;
   std::vector<std::unique_ptr<Coroutine>> coroutines;
@@ -22,4 +95,5 @@ int main(int argc, char** argv) {
     coroutines.push_back(std::make_unique<Coroutine>(scheduler, Test));
   }
   scheduler.Run();
+  TestGroup();
 }
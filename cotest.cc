@@ -2,15 +2,47 @@
 // All Rights Reserved
 // See LICENSE file for licensing information.
 
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bitset.h"
+#include "channel.h"
 #include "coroutine.h"
+#include "dns.h"
+#include "http.h"
+#include "io.h"
+#include "offload.h"
+#include "poller.h"
+#include "uring.h"
 
 using namespace co;
 
 int pipes[2];
 
+// Abort with a message if a check fails.
+#define CHECK(e)                                                               \
+  do {                                                                         \
+    if (!(e)) {                                                                \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #e);    \
+      abort();                                                                 \
+    }                                                                          \
+  } while (0)
+
 void Co1(Coroutine *c) {
   Generator<int> generator(c->Scheduler(), [](Generator<int> *c) {
     for (int i = 1; i < 5; i++) {
@@ -133,7 +165,786 @@ void TestWaitWithTimeout(Coroutine *c) {
   close(trigger3_end);
 }
 
+// A sender and a receiver passing values through a channel that only
+// holds one, so that each has to wait for the other.
+void TestChannelHandOff(Coroutine *c) {
+  Channel<int> channel(1);
+  bool sent_all = false;
+  Coroutine sender(c->Scheduler(), [&channel, &sent_all](Coroutine *c) {
+    for (int i = 0; i < 100; i++) {
+      CHECK(channel.Send(c, i));
+    }
+    sent_all = true;
+    channel.Close();
+  });
+  int expected = 0;
+  while (std::optional<int> value = channel.Receive(c)) {
+    CHECK(*value == expected);
+    expected++;
+  }
+  CHECK(expected == 100);
+  CHECK(sent_all);
+  printf("Channel hand-off: %d values\n", expected);
+}
+
+// Close wakes senders waiting for room, which then fail, and receivers
+// waiting for values, which get nothing.  Values already in the channel
+// can still be received after it's closed.
+void TestChannelClose(Coroutine *c) {
+  Channel<int> full(2);
+  CHECK(full.TrySend(1));
+  CHECK(full.TrySend(2));
+  CHECK(!full.TrySend(3));
+  int failed_sends = 0;
+  auto send_func = [&full, &failed_sends](Coroutine *c) {
+    if (!full.Send(c, 3)) {
+      failed_sends++;
+    }
+  };
+  Coroutine sender1(c->Scheduler(), send_func);
+  Coroutine sender2(c->Scheduler(), send_func);
+
+  Channel<int> empty(2);
+  int failed_receives = 0;
+  Coroutine receiver(c->Scheduler(), [&empty, &failed_receives](Coroutine *c) {
+    if (!empty.Receive(c).has_value()) {
+      failed_receives++;
+    }
+  });
+
+  // Let them all get stuck, then close the channels under them.
+  c->Yield();
+  CHECK(failed_sends == 0 && failed_receives == 0);
+  full.Close();
+  empty.Close();
+  while (sender1.IsAlive() || sender2.IsAlive() || receiver.IsAlive()) {
+    c->Yield();
+  }
+  CHECK(failed_sends == 2);
+  CHECK(failed_receives == 1);
+  CHECK(!full.Send(c, 4));
+
+  // Drain what was sent before the close.
+  std::vector<int> values;
+  CHECK(full.Receive(c, values, 10) == 2);
+  CHECK(values.size() == 2 && values[0] == 1 && values[1] == 2);
+  CHECK(full.Receive(c, values, 10) == 0);
+  CHECK(!full.Receive(c).has_value());
+  printf("Channel close: %d failed sends, %d failed receives\n", failed_sends,
+         failed_receives);
+}
+
+// Values are moved through the channel, so a move-only type works,
+// including ones left behind for the destructor.
+void TestChannelMoveOnly(Coroutine *c) {
+  Channel<std::unique_ptr<int>> channel(4);
+  Coroutine sender(c->Scheduler(), [&channel](Coroutine *c) {
+    for (int i = 0; i < 10; i++) {
+      CHECK(channel.Send(c, std::make_unique<int>(i)));
+    }
+    channel.Close();
+  });
+  std::vector<std::unique_ptr<int>> values;
+  while (channel.Receive(c, values, 3) > 0) {
+  }
+  CHECK(values.size() == 10);
+  for (int i = 0; i < 10; i++) {
+    CHECK(values[i] != nullptr && *values[i] == i);
+  }
+
+  Channel<std::unique_ptr<int>> leftover(2);
+  CHECK(leftover.TrySend(std::make_unique<int>(1)));
+  printf("Channel move-only: %zu values\n", values.size());
+}
+
+// A value type with no default constructor.
+struct NoDefault {
+  explicit NoDefault(int v) : value(v) {}
+  int value;
+};
+
+// CallOptional works for a T that can't be default constructed, and
+// gives an empty optional once the generator finishes.
+void TestCallOptional(Coroutine *c) {
+  Generator<NoDefault> generator(c->Scheduler(),
+                                 [](Generator<NoDefault> *c) {
+                                   for (int i = 0; i < 3; i++) {
+                                     c->YieldValue(NoDefault(i * 10));
+                                   }
+                                 });
+  int count = 0;
+  while (std::optional<NoDefault> value = c->CallOptional(generator)) {
+    CHECK(value->value == count * 10);
+    count++;
+  }
+  CHECK(count == 3);
+  CHECK(!generator.IsAlive());
+  printf("CallOptional: %d values\n", count);
+}
+
+// A batched Call fills the whole batch until the generator finishes part
+// way through one, when it returns a short count and leaves the rest of
+// the batch alone.
+void TestBatchedCall(Coroutine *c) {
+  Generator<int> generator(c->Scheduler(), [](Generator<int> *c) {
+    for (int i = 0; i < 10; i++) {
+      c->YieldValue(i);
+    }
+  });
+  int values[4];
+  std::vector<size_t> counts;
+  int next = 0;
+  while (generator.IsAlive()) {
+    for (int &v : values) {
+      v = -1;
+    }
+    size_t n = c->Call(generator, values, 4);
+    counts.push_back(n);
+    for (size_t i = 0; i < n; i++) {
+      CHECK(values[i] == next);
+      next++;
+    }
+    for (size_t i = n; i < 4; i++) {
+      CHECK(values[i] == -1);
+    }
+  }
+  CHECK(next == 10);
+  CHECK(counts.size() == 3 && counts[0] == 4 && counts[1] == 4 &&
+        counts[2] == 2);
+  printf("Batched Call: %zu batches, last %zu\n", counts.size(),
+         counts.back());
+}
+
+// Allocation order across the upper half of a word and past the first
+// summary word (64 words, 4096 ids), and reuse of freed ids below the
+// free hint.
+void TestBitSet() {
+  BitSet set;
+  for (uint32_t i = 0; i < 64; i++) {
+    CHECK(set.Allocate() == i);
+  }
+  for (uint32_t i = 32; i < 64; i++) {
+    CHECK(set.Contains(i));
+  }
+  set.Free(40);
+  CHECK(!set.Contains(40) && set.Contains(39) && set.Contains(63));
+  CHECK(set.Allocate() == 40);
+
+  const uint32_t kIds = 64 * 64 + 100;
+  for (uint32_t i = 64; i < kIds; i++) {
+    CHECK(set.Allocate() == i);
+  }
+  CHECK(set.Count() == kIds);
+
+  // Freeing a lower id has to pull the hint back from the second summary
+  // word.
+  set.Free(4100);
+  set.Free(70);
+  set.Free(33);
+  CHECK(set.Allocate() == 33);
+  CHECK(set.Allocate() == 70);
+  CHECK(set.Allocate() == 4100);
+  CHECK(set.Allocate() == kIds);
+
+  for (uint32_t i = 0; i <= kIds; i++) {
+    set.Free(i);
+  }
+  CHECK(set.IsEmpty());
+  set.Set(4095);
+  CHECK(set.Contains(4095) && set.Count() == 1);
+  CHECK(set.Allocate() == 0);
+  printf("BitSet: %u ids\n", kIds + 1);
+}
+
+// A header parsed in two pieces, split at every possible point, gives
+// the same result as parsing it all at once.
+void TestHttpSplitHeader() {
+  const std::string request = "GET /index.html HTTP/1.1\r\n"
+                              "Host: example.com\r\n"
+                              "Content-Length: 12\r\n"
+                              "X-Folded: one\r\n two\r\n"
+                              "\r\n"
+                              "body follows";
+  size_t header_length = request.find("body");
+  for (size_t split = 0; split < header_length; split++) {
+    HttpParser parser(HttpParser::Type::kRequest);
+    // Copy the first piece so that the data moves between the calls, as
+    // it can in an HttpBuffer.
+    std::string first = request.substr(0, split);
+    CHECK(parser.Parse(first.data(), first.size()) ==
+          HttpParser::Status::kIncomplete);
+    CHECK(parser.Parse(request.data(), request.size()) ==
+          HttpParser::Status::kComplete);
+    CHECK(parser.HeaderLength() == header_length);
+    CHECK(parser.Method() == "GET");
+    CHECK(parser.Target() == "/index.html");
+    CHECK(parser.Protocol() == "HTTP/1.1");
+    CHECK(parser.NumHeaders() == 3);
+    CHECK(parser.Find(HttpHeader::kHost) == "example.com");
+    CHECK(parser.ContentLength() == 12);
+    CHECK(parser.Find("x-folded") == "one\r\n two");
+  }
+  printf("HTTP split header: %zu splits\n", header_length);
+}
+
+// Requests sent one after another without waiting for the responses.
+// Each parse stops at the end of its header and the rest is left for the
+// next one.
+void TestHttpPipelined() {
+  const std::string requests = "GET /a HTTP/1.1\r\nHost: x\r\n\r\n"
+                               "GET /b HTTP/1.1\r\n\r\n"
+                               "GET /c HTTP/1.1\r\nConnection: close\r\n\r\n"
+                               "GET /d";
+  const char *targets[] = {"/a", "/b", "/c"};
+  HttpParser parser(HttpParser::Type::kRequest);
+  size_t offset = 0;
+  for (const char *target : targets) {
+    CHECK(parser.Parse(requests.data() + offset, requests.size() - offset) ==
+          HttpParser::Status::kComplete);
+    CHECK(parser.Target() == target);
+    CHECK(parser.KeepAlive() == (target[1] != 'c'));
+    offset += parser.HeaderLength();
+    parser.Reset();
+  }
+  CHECK(requests.substr(offset) == "GET /d");
+  CHECK(parser.Parse(requests.data() + offset, requests.size() - offset) ==
+        HttpParser::Status::kIncomplete);
+  printf("HTTP pipelined: %zu requests\n",
+         sizeof(targets) / sizeof(targets[0]));
+}
+
+// Headers too big to handle are rejected: too many fields is a parse
+// error and a header that doesn't fit in the buffer fails the read.
+void TestHttpOversize(Coroutine *c) {
+  std::string request = "GET / HTTP/1.1\r\n";
+  for (size_t i = 0; i <= HttpParser::kMaxHeaders; i++) {
+    request += "X-Header-" + std::to_string(i) + ": value\r\n";
+  }
+  request += "\r\n";
+  HttpParser parser(HttpParser::Type::kRequest);
+  CHECK(parser.Parse(request.data(), request.size()) ==
+        HttpParser::Status::kError);
+  // The error sticks until Reset.
+  CHECK(parser.Parse(request.data(), request.size()) ==
+        HttpParser::Status::kError);
+
+  // Nothing here waits, so the pipe is closed again before any other
+  // coroutine gets a chance to open an fd.
+  int fds[2];
+  (void)pipe(fds);
+  (void)write(fds[1], request.data(), request.size());
+  HttpBuffer buffer(64);
+  parser.Reset();
+  ssize_t n;
+  while ((n = buffer.Read(c, fds[0])) > 0) {
+    CHECK(parser.Parse(buffer.Data(), buffer.Size()) ==
+          HttpParser::Status::kIncomplete);
+  }
+  CHECK(n == -1 && errno == ENOBUFS);
+  CHECK(buffer.IsFull());
+  close(fds[0]);
+  close(fds[1]);
+  printf("HTTP oversize: rejected\n");
+}
+
+static void Append16(std::string *s, uint16_t v) {
+  s->push_back(static_cast<char>(v >> 8));
+  s->push_back(static_cast<char>(v));
+}
+
+static void Append32(std::string *s, uint32_t v) {
+  Append16(s, static_cast<uint16_t>(v >> 16));
+  Append16(s, static_cast<uint16_t>(v));
+}
+
+// A resource record.  The name is in wire format and may be compressed.
+static std::string DnsRecord(const std::string &name, uint16_t type,
+                             uint32_t ttl, const std::string &data) {
+  std::string record = name;
+  Append16(&record, type);
+  Append16(&record, 1); // IN
+  Append32(&record, ttl);
+  Append16(&record, static_cast<uint16_t>(data.size()));
+  return record + data;
+}
+
+static std::string Ipv4(const char *s) {
+  struct in_addr a;
+  inet_pton(AF_INET, s, &a);
+  return std::string(reinterpret_cast<const char *>(&a), sizeof(a));
+}
+
+static std::string Ipv6(const char *s) {
+  struct in6_addr a;
+  inet_pton(AF_INET6, s, &a);
+  return std::string(reinterpret_cast<const char *>(&a), sizeof(a));
+}
+
+// Answer a query for one of the test names.  The question starts at
+// offset 12, so a pointer to it is "\xc0\x0c".
+static std::string DnsAnswer(const std::string &query, const std::string &name,
+                             uint16_t type) {
+  static const std::string kQuestionName("\xc0\x0c", 2);
+  constexpr uint16_t kA = 1;
+  constexpr uint16_t kAAAA = 28;
+  std::string response = query;
+  response[2] = static_cast<char>(response[2] | 0x80); // A response.
+  uint8_t rcode = 0;
+  uint8_t truncated = 0;
+  std::vector<std::string> answers;
+  std::string cut; // Part of a record, to end the message with.
+  if (name == "compressed.test") {
+    if (type == kA) {
+      answers.push_back(DnsRecord(kQuestionName, kA, 300, Ipv4("10.0.0.1")));
+      // A label followed by a pointer: www.compressed.test.
+      answers.push_back(DnsRecord(std::string("\x03www\xc0\x0c", 6), kA, 300,
+                                  Ipv4("10.0.0.2")));
+    } else {
+      answers.push_back(DnsRecord(kQuestionName, kAAAA, 300, Ipv6("::1")));
+    }
+  } else if (name == "truncated.test" || name == "broken.test") {
+    if (type == kA) {
+      // The second answer is cut off part way through its address.  A
+      // nameserver marks a message like that as truncated, and the
+      // addresses before the cut can be used.  Without the mark it's
+      // broken and is ignored.
+      truncated = name == "truncated.test" ? 0x02 : 0;
+      answers.push_back(DnsRecord(kQuestionName, kA, 300, Ipv4("10.0.0.3")));
+      answers.push_back("");
+      cut = DnsRecord(kQuestionName, kA, 300, Ipv4("10.0.0.4")).substr(0, 12);
+    }
+  } else if (name == "ttl.test") {
+    if (type == kA) {
+      answers.push_back(DnsRecord(kQuestionName, kA, 1, Ipv4("10.0.0.5")));
+    }
+  } else {
+    rcode = 3; // No such name.
+  }
+  response[2] = static_cast<char>(response[2] | truncated);
+  response[3] = static_cast<char>(0x80 | rcode);
+  response[6] = 0;
+  response[7] = static_cast<char>(answers.size());
+  for (const std::string &answer : answers) {
+    response += answer;
+  }
+  return response + cut;
+}
+
+// A nameserver on a UDP port on the loopback, for the resolver tests.
+// Counts the queries it gets for each name.
+static void FakeNameserver(Coroutine *c, int fd, const bool *done,
+                           std::map<std::string, int> *queries) {
+  while (!*done) {
+    if (c->Wait(fd, POLLIN, 10000000) == -1) {
+      continue;
+    }
+    char buf[512];
+    struct sockaddr_storage from;
+    socklen_t from_length = sizeof(from);
+    ssize_t n = recvfrom(fd, buf, sizeof(buf), 0,
+                         reinterpret_cast<struct sockaddr *>(&from),
+                         &from_length);
+    if (n < 12) {
+      continue;
+    }
+    // Just the header and the question, which is all a query has.
+    std::string query(buf, static_cast<size_t>(n));
+    std::string name;
+    size_t pos = 12;
+    while (pos < query.size() && query[pos] != 0) {
+      size_t length = static_cast<uint8_t>(query[pos]);
+      if (!name.empty()) {
+        name += '.';
+      }
+      name += query.substr(pos + 1, length);
+      pos += 1 + length;
+    }
+    CHECK(pos + 5 <= query.size());
+    uint16_t type = static_cast<uint16_t>(
+        (static_cast<uint8_t>(query[pos + 1]) << 8) |
+        static_cast<uint8_t>(query[pos + 2]));
+    (*queries)[name]++;
+    std::string response = DnsAnswer(query, name, type);
+    if (name == "broken.test") {
+      // And something too short to be a message at all.
+      sendto(fd, "junk", 4, 0, reinterpret_cast<struct sockaddr *>(&from),
+             from_length);
+    }
+    sendto(fd, response.data(), response.size(), 0,
+           reinterpret_cast<struct sockaddr *>(&from), from_length);
+  }
+}
+
+static std::string ToString(const std::vector<IpAddress> &addresses) {
+  std::string s;
+  for (const IpAddress &address : addresses) {
+    if (!s.empty()) {
+      s += ' ';
+    }
+    s += address.ToString();
+  }
+  return s;
+}
+
+// Look names up through the fake nameserver: answers with compressed
+// names, truncated and broken messages, and the cache expiring an answer
+// when its TTL runs out.
+void TestResolver(Coroutine *c) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_length = sizeof(addr);
+  CHECK(bind(fd, reinterpret_cast<struct sockaddr *>(&addr), addr_length) ==
+        0);
+  CHECK(getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                    &addr_length) == 0);
+  CHECK(SetNonBlocking(fd));
+  bool done = false;
+  std::map<std::string, int> queries;
+  Coroutine nameserver(c->Scheduler(), [fd, &done, &queries](Coroutine *c) {
+    FakeNameserver(c, fd, &done, &queries);
+  });
+
+  Resolver::Options options;
+  Resolver::Nameserver ns;
+  IpAddress::Parse("127.0.0.1", &ns.address);
+  ns.port = ntohs(addr.sin_port);
+  options.nameservers.push_back(ns);
+  options.hosts_file = "";
+  options.timeout_ns = 100000000;
+  options.attempts = 1;
+  Resolver resolver(options);
+  std::vector<IpAddress> addresses;
+
+  CHECK(resolver.Lookup(c, "compressed.test", &addresses) ==
+        Resolver::Status::kOk);
+  CHECK(ToString(addresses) == "10.0.0.1 10.0.0.2 ::1");
+
+  CHECK(resolver.Lookup(c, "truncated.test", &addresses) ==
+        Resolver::Status::kOk);
+  CHECK(ToString(addresses) == "10.0.0.3");
+
+  // The A query never gets a usable answer.
+  CHECK(resolver.Lookup(c, "broken.test", &addresses) ==
+        Resolver::Status::kTimeout);
+  CHECK(addresses.empty());
+
+  CHECK(resolver.Lookup(c, "missing.test", &addresses) ==
+        Resolver::Status::kNotFound);
+
+  // The answer for ttl.test lasts a second.
+  CHECK(resolver.Lookup(c, "ttl.test", &addresses) == Resolver::Status::kOk);
+  CHECK(ToString(addresses) == "10.0.0.5");
+  CHECK(queries["ttl.test"] == 2);
+  CHECK(resolver.Lookup(c, "ttl.test", &addresses) == Resolver::Status::kOk);
+  CHECK(queries["ttl.test"] == 2);
+  c->Millisleep(1100);
+  CHECK(resolver.Lookup(c, "ttl.test", &addresses) == Resolver::Status::kOk);
+  CHECK(ToString(addresses) == "10.0.0.5");
+  CHECK(queries["ttl.test"] == 4);
+
+  done = true;
+  while (nameserver.IsAlive()) {
+    c->Yield();
+  }
+  close(fd);
+  printf("Resolver: %zu names queried\n", queries.size());
+}
+
+// A coroutine from a pool that has finished is used again by the next
+// Spawn, as if it were a new one.
+void TestPoolRearm(Coroutine *c) {
+  CoroutinePool pool(c->Scheduler());
+  int first_runs = 0;
+  int second_runs = 0;
+  Coroutine *first = pool.Spawn([&first_runs](Coroutine *c) {
+    first_runs++;
+    // Leave something in the arena.
+    (void)c->Arena()->allocate(1000);
+    c->Yield();
+  });
+  first->SetPriority(Priority::kHigh);
+  uint32_t first_id = first->Id();
+  while (pool.NumIdle() == 0) {
+    c->Yield();
+  }
+  CHECK(first_runs == 1);
+  CHECK(static_cast<ArenaResource *>(first->Arena())->BytesReserved() > 0);
+
+  // Take the freed ids up to and including the one the first coroutine
+  // had, so that keeping the old id can't pass for getting a new one.
+  std::vector<std::unique_ptr<Coroutine>> blockers;
+  while (blockers.empty() || blockers.back()->Id() != first_id) {
+    CHECK(blockers.size() < 1000);
+    blockers.push_back(std::make_unique<Coroutine>(
+        c->Scheduler(), [](Coroutine *c) {}, nullptr, /*autostart=*/false));
+  }
+
+  size_t arena_at_start = 1;
+  Priority priority_at_start = Priority::kLow;
+  Coroutine *second = pool.Spawn(
+      [&second_runs, &arena_at_start, &priority_at_start](Coroutine *c) {
+        second_runs++;
+        arena_at_start =
+            static_cast<ArenaResource *>(c->Arena())->BytesReserved();
+        priority_at_start = c->GetPriority();
+      });
+  CHECK(second == first);
+  CHECK(second->Id() != first_id);
+  CHECK(second->GetPriority() == Priority::kNormal);
+  while (pool.NumIdle() == 0) {
+    c->Yield();
+  }
+  CHECK(first_runs == 1 && second_runs == 1);
+  CHECK(arena_at_start == 0);
+  CHECK(priority_at_start == Priority::kNormal);
+  printf("Pool rearm: coroutine reused\n");
+}
+
+// A listening socket on a loopback port.  Fills in its address.
+static int ListenLoopback(struct sockaddr_in *addr) {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  *addr = {};
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_length = sizeof(*addr);
+  CHECK(bind(s, reinterpret_cast<struct sockaddr *>(addr), addr_length) == 0);
+  CHECK(getsockname(s, reinterpret_cast<struct sockaddr *>(addr),
+                    &addr_length) == 0);
+  CHECK(listen(s, 16) == 0);
+  CHECK(SetNonBlocking(s));
+  return s;
+}
+
+static int CountOpenFds() {
+  int n = 0;
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == nullptr) {
+    return -1;
+  }
+  while (readdir(dir) != nullptr) {
+    n++;
+  }
+  closedir(dir);
+  return n;
+}
+
+// co::Read, Write, Writev and Connect on sockets.
+void TestIo(Coroutine *c) {
+  int sv[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  CHECK(SetNonBlocking(sv[0]) && SetNonBlocking(sv[1]));
+
+  // Nothing to read.
+  char ch;
+  errno = 0;
+  CHECK(Read(c, sv[1], &ch, 1, 10000000) == -1);
+  CHECK(errno == ETIMEDOUT);
+
+  // Fill the socket, then write some more.  The write waits until the
+  // reader has drained enough of it.
+  static char chunk[4096];
+  size_t filled = 0;
+  for (;;) {
+    ssize_t n = write(sv[0], chunk, sizeof(chunk));
+    if (n <= 0) {
+      break;
+    }
+    filled += static_cast<size_t>(n);
+  }
+  CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+  static char block[65536];
+  // Everything up to here is zeros; the writev below sends 100000 'a's,
+  // one 'b' and 100000 'c's.
+  static char parts[3][100000];
+  size_t zeros = filled + sizeof(block);
+  bool draining = false;
+  bool in_order = true;
+  size_t drained = 0;
+  Coroutine reader(c->Scheduler(), [&](Coroutine *c) {
+    c->Millisleep(10);
+    draining = true;
+    static char buf[16384];
+    for (;;) {
+      ssize_t n = Read(c, sv[1], buf, sizeof(buf), 100000000);
+      if (n <= 0) {
+        break;
+      }
+      for (ssize_t i = 0; i < n; i++, drained++) {
+        char want = 0;
+        if (drained >= zeros) {
+          size_t q = drained - zeros;
+          want = q < sizeof(parts[0]) ? 'a' : q == sizeof(parts[0]) ? 'b' : 'c';
+        }
+        if (buf[i] != want) {
+          in_order = false;
+        }
+      }
+    }
+  });
+  CHECK(Write(c, sv[0], block, sizeof(block)) ==
+        static_cast<ssize_t>(sizeof(block)));
+  CHECK(draining);
+
+  // A writev bigger than the socket can take, so it's written in pieces
+  // that end part way through an iovec.  Each iovec has its own pattern
+  // so the reader can tell they arrive whole and in order.
+  for (int i = 0; i < 3; i++) {
+    memset(parts[i], 'a' + i, sizeof(parts[i]));
+  }
+  struct iovec iov[3] = {{parts[0], sizeof(parts[0])},
+                         {parts[1], 1},
+                         {parts[2], sizeof(parts[2])}};
+  size_t total = sizeof(parts[0]) + 1 + sizeof(parts[2]);
+  CHECK(Writev(c, sv[0], iov, 3) == static_cast<ssize_t>(total));
+  shutdown(sv[0], SHUT_WR);
+  while (reader.IsAlive()) {
+    c->Yield();
+  }
+  CHECK(drained == zeros + total);
+  CHECK(in_order);
+  close(sv[0]);
+  close(sv[1]);
+
+  // Connect to a port that nothing is listening on.
+  struct sockaddr_in addr;
+  int s = ListenLoopback(&addr);
+  close(s);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  errno = 0;
+  CHECK(Connect(c, fd, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr), 1000000000) == -1);
+  CHECK(errno == ECONNREFUSED);
+  close(fd);
+  printf("I/O: ok\n");
+}
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Two coroutines offload a blocking call at the same time while a third
+// keeps ticking in the same scheduler.
+void TestOffload(Coroutine *c) {
+  OffloadPool pool(2);
+  int results[2] = {0, 0};
+  int done = 0;
+  uint64_t start = NowNs();
+  std::vector<std::unique_ptr<Coroutine>> sleepers;
+  for (int i = 0; i < 2; i++) {
+    sleepers.push_back(std::make_unique<Coroutine>(
+        c->Scheduler(), [&pool, &results, &done, i](Coroutine *c) {
+          results[i] = Offload(
+              c,
+              [i]() {
+                usleep(50000);
+                return i + 1;
+              },
+              pool);
+          done++;
+        }));
+  }
+  int ticks = 0;
+  while (done < 2) {
+    c->Millisleep(1);
+    ticks++;
+  }
+  uint64_t elapsed = NowNs() - start;
+  CHECK(results[0] == 1 && results[1] == 2);
+  // The scheduler wasn't blocked by the sleeps, and they overlapped.
+  CHECK(ticks >= 10);
+  CHECK(elapsed < 95000000);
+
+  bool caught = false;
+  try {
+    Offload(c, []() { throw std::runtime_error("offloaded"); }, pool);
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+  CHECK(caught);
+  printf("Offload: ok\n");
+}
+
+// The io_uring poller, operations submitted to the ring with a linked
+// timeout, fixed buffers and the multishot accept.
+void TestUring(Coroutine *c) {
+  CHECK(UringOf(c) != nullptr);
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  CHECK(SetNonBlocking(fds[0]) && SetNonBlocking(fds[1]));
+
+  // A wait on a pipe, woken by another coroutine writing to it.
+  Coroutine writer(c->Scheduler(), [&fds](Coroutine *c) {
+    c->Millisleep(10);
+    CHECK(write(fds[1], "x", 1) == 1);
+  });
+  CHECK(c->Wait(fds[0], POLLIN, 1000000000) == fds[0]);
+  char ch;
+  CHECK(read(fds[0], &ch, 1) == 1 && ch == 'x');
+
+  // A read of the empty pipe goes to the ring with a linked timeout,
+  // which cancels it.
+  errno = 0;
+  CHECK(Read(c, fds[0], &ch, 1, 20000000) == -1);
+  CHECK(errno == ETIMEDOUT);
+
+  // Through a registered buffer and back.
+  static char buffer[4096];
+  struct iovec iov = {buffer, sizeof(buffer)};
+  CHECK(UringOf(c)->RegisterBuffers(&iov, 1));
+  memcpy(buffer, "fixed buffers", 13);
+  CHECK(UringWriteFixed(c, fds[1], buffer, 13, 0) == 13);
+  CHECK(UringReadFixed(c, fds[0], buffer + 100, 13, 0, -1, 1000000000) ==
+        13);
+  CHECK(memcmp(buffer + 100, "fixed buffers", 13) == 0);
+  CHECK(UringOf(c)->UnregisterBuffers());
+  close(fds[0]);
+  close(fds[1]);
+
+  // One multishot accept takes both connections.
+  struct sockaddr_in addr;
+  int s = ListenLoopback(&addr);
+  auto connect_func = [&addr](Coroutine *c) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(Connect(c, fd, reinterpret_cast<struct sockaddr *>(&addr),
+                  sizeof(addr)) == 0);
+    close(fd);
+  };
+  int accepted = 0;
+  {
+    MultishotAcceptor acceptor(c, s);
+    Coroutine client1(c->Scheduler(), connect_func);
+    Coroutine client2(c->Scheduler(), connect_func);
+    for (int i = 0; i < 2; i++) {
+      int fd = acceptor.Accept(c, 1000000000);
+      CHECK(fd != -1);
+      close(fd);
+      accepted++;
+    }
+    while (client1.IsAlive() || client2.IsAlive()) {
+      c->Yield();
+    }
+  }
+
+  // Destroy an acceptor while its accept is armed.  The kernel still has
+  // it, so it's left for the ring to clean up, which happens when the
+  // scheduler is destroyed at the latest.
+  MultishotAcceptor *armed = new MultishotAcceptor(c, s);
+  errno = 0;
+  CHECK(armed->Accept(c, 10000000) == -1 && errno == ETIMEDOUT);
+  delete armed;
+  close(s);
+  printf("io_uring: %d connections accepted\n", accepted);
+}
+
 int main(int argc, const char *argv[]) {
+  TestBitSet();
+  TestHttpSplitHeader();
+  TestHttpPipelined();
+
   (void)pipe(pipes);
 
   CoroutineScheduler sched;
@@ -149,5 +960,39 @@ int main(int argc, const char *argv[]) {
 
   Coroutine wait_test(sched, TestWaitWithTimeout);
 
+  Coroutine channel_hand_off(sched, TestChannelHandOff);
+  Coroutine channel_close(sched, TestChannelClose);
+  Coroutine channel_move_only(sched, TestChannelMoveOnly);
+
+  Coroutine call_optional(sched, TestCallOptional);
+  Coroutine batched_call(sched, TestBatchedCall);
+
+  Coroutine http_oversize(sched, TestHttpOversize);
+
+  Coroutine pool_rearm(sched, TestPoolRearm);
+
   sched.Run();
+
+  // The tests with sockets are on a scheduler of their own so that they
+  // don't change which fds the tests above get.
+  CoroutineScheduler socket_sched;
+  Coroutine resolver_test(socket_sched, TestResolver);
+  Coroutine io_test(socket_sched, TestIo);
+  Coroutine offload_test(socket_sched, TestOffload);
+  socket_sched.Run();
+
+  // The io_uring tests, where the kernel allows it, again on a scheduler
+  // of their own.  Everything they open should be closed again once the
+  // scheduler (and its ring) has gone.
+  if (Poller::Create(PollerType::kIoUring) != nullptr) {
+    int open_fds = CountOpenFds();
+    {
+      CoroutineScheduler uring_sched(PollerType::kIoUring);
+      Coroutine uring_test(uring_sched, TestUring);
+      uring_sched.Run();
+    }
+    CHECK(CountOpenFds() == open_fds);
+  } else {
+    printf("io_uring: not available\n");
+  }
 }
@@ -0,0 +1,500 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "dns.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "io.h"
+
+namespace co {
+
+static uint64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+IpAddress::IpAddress(const struct in_addr &address) : family_(AF_INET) {
+  memcpy(bytes_, &address, sizeof(address));
+}
+
+IpAddress::IpAddress(const struct in6_addr &address) : family_(AF_INET6) {
+  memcpy(bytes_, &address, sizeof(address));
+}
+
+bool IpAddress::Parse(std::string_view s, IpAddress *address) {
+  if (s.size() >= 2 && s.front() == '[' && s.back() == ']') {
+    s = s.substr(1, s.size() - 2);
+  }
+  // Long enough for any IPv6 address.
+  char str[INET6_ADDRSTRLEN];
+  if (s.empty() || s.size() >= sizeof(str)) {
+    return false;
+  }
+  memcpy(str, s.data(), s.size());
+  str[s.size()] = '\0';
+  struct in_addr a4;
+  if (inet_pton(AF_INET, str, &a4) == 1) {
+    *address = IpAddress(a4);
+    return true;
+  }
+  struct in6_addr a6;
+  if (inet_pton(AF_INET6, str, &a6) == 1) {
+    *address = IpAddress(a6);
+    return true;
+  }
+  return false;
+}
+
+socklen_t IpAddress::ToSockaddr(uint16_t port,
+                                struct sockaddr_storage *addr) const {
+  memset(addr, 0, sizeof(*addr));
+  if (family_ == AF_INET6) {
+    auto *a = reinterpret_cast<struct sockaddr_in6 *>(addr);
+    a->sin6_family = AF_INET6;
+    a->sin6_port = htons(port);
+    memcpy(&a->sin6_addr, bytes_, sizeof(a->sin6_addr));
+#if defined(__APPLE__)
+    a->sin6_len = sizeof(*a);
+#endif
+    return sizeof(*a);
+  }
+  auto *a = reinterpret_cast<struct sockaddr_in *>(addr);
+  a->sin_family = AF_INET;
+  a->sin_port = htons(port);
+  memcpy(&a->sin_addr, bytes_, sizeof(a->sin_addr));
+#if defined(__APPLE__)
+  a->sin_len = sizeof(*a);
+#endif
+  return sizeof(*a);
+}
+
+std::string IpAddress::ToString() const {
+  char str[INET6_ADDRSTRLEN];
+  if (family_ == AF_UNSPEC ||
+      inet_ntop(family_, bytes_, str, sizeof(str)) == nullptr) {
+    return "";
+  }
+  return str;
+}
+
+bool IpAddress::operator==(const IpAddress &other) const {
+  return family_ == other.family_ &&
+         memcmp(bytes_, other.bytes_, sizeof(bytes_)) == 0;
+}
+
+// Names are compared without regard to case, and a trailing dot (the root)
+// makes no difference.
+static std::string CanonicalName(std::string_view name) {
+  if (!name.empty() && name.back() == '.') {
+    name.remove_suffix(1);
+  }
+  std::string s(name);
+  for (char &ch : s) {
+    if (ch >= 'A' && ch <= 'Z') {
+      ch += 'a' - 'A';
+    }
+  }
+  return s;
+}
+
+// DNS message format (RFC 1035).
+static constexpr size_t kHeaderSize = 12;
+// The largest message sent over UDP without EDNS.
+static constexpr size_t kMaxUdpMessage = 512;
+static constexpr uint16_t kTypeA = 1;
+static constexpr uint16_t kTypeAAAA = 28;
+static constexpr uint16_t kClassIN = 1;
+static constexpr int kRcodeNoError = 0;
+static constexpr int kRcodeNameError = 3;
+
+// So that a cache of names nobody asks for any more doesn't grow forever,
+// expired entries are thrown out when it gets this big.
+static constexpr size_t kMaxCacheEntries = 4096;
+
+static uint16_t Get16(const uint8_t *p) {
+  return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+static uint32_t Get32(const uint8_t *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+static void Put16(uint8_t *p, uint16_t v) {
+  p[0] = static_cast<uint8_t>(v >> 8);
+  p[1] = static_cast<uint8_t>(v);
+}
+
+// Build a query for one type of record.  Returns the length of the
+// message, or 0 if the name isn't valid.
+static size_t BuildQuery(const std::string &name, uint16_t id, uint16_t type,
+                         uint8_t *msg) {
+  memset(msg, 0, kHeaderSize);
+  Put16(msg, id);
+  msg[2] = 0x01; // Recursion desired.
+  Put16(msg + 4, 1);
+  size_t pos = kHeaderSize;
+  size_t start = 0;
+  while (start < name.size()) {
+    size_t dot = name.find('.', start);
+    if (dot == std::string::npos) {
+      dot = name.size();
+    }
+    size_t length = dot - start;
+    // Labels are 1 to 63 bytes and the whole name, with a length byte
+    // for each label and the zero at the end, at most 255.
+    if (length == 0 || length > 63 ||
+        pos - kHeaderSize + 1 + length + 1 > 255) {
+      return 0;
+    }
+    msg[pos++] = static_cast<uint8_t>(length);
+    memcpy(msg + pos, name.data() + start, length);
+    pos += length;
+    start = dot + 1;
+  }
+  if (pos == kHeaderSize) {
+    return 0;
+  }
+  msg[pos++] = 0;
+  Put16(msg + pos, type);
+  Put16(msg + pos + 2, kClassIN);
+  return pos + 4;
+}
+
+// Skip over a possibly compressed name.  Returns the offset after it, or 0
+// if it runs off the end of the message.
+static size_t SkipName(const uint8_t *msg, size_t length, size_t pos) {
+  while (pos < length) {
+    uint8_t n = msg[pos];
+    if (n == 0) {
+      return pos + 1;
+    }
+    if ((n & 0xc0) == 0xc0) {
+      // A pointer to the rest of the name ends it.
+      return pos + 2 <= length ? pos + 2 : 0;
+    }
+    pos += 1 + n;
+  }
+  return 0;
+}
+
+// The parts of a response we care about.
+struct Response {
+  uint16_t id;
+  int rcode;
+  std::vector<IpAddress> addresses;
+  uint32_t ttl = UINT32_MAX; // The smallest of the addresses' TTLs.
+};
+
+// Returns false if the message isn't a well formed response.
+static bool ParseResponse(const uint8_t *msg, size_t length,
+                          Response *response) {
+  if (length < kHeaderSize || (msg[2] & 0x80) == 0) {
+    return false;
+  }
+  response->id = Get16(msg);
+  response->rcode = msg[3] & 0x0f;
+  // A truncated response may end part way through a record.  The records
+  // before that are fine.
+  bool truncated = (msg[2] & 0x02) != 0;
+  uint16_t num_questions = Get16(msg + 4);
+  uint16_t num_answers = Get16(msg + 6);
+  size_t pos = kHeaderSize;
+  for (int i = 0; i < num_questions; i++) {
+    pos = SkipName(msg, length, pos);
+    if (pos == 0 || pos + 4 > length) {
+      return false;
+    }
+    pos += 4;
+  }
+  // The answers to a query for a name with a CNAME include the records
+  // for the name it refers to, so every A or AAAA record counts.
+  for (int i = 0; i < num_answers; i++) {
+    pos = SkipName(msg, length, pos);
+    if (pos == 0 || pos + 10 > length) {
+      return truncated;
+    }
+    uint16_t type = Get16(msg + pos);
+    uint16_t cls = Get16(msg + pos + 2);
+    uint32_t ttl = Get32(msg + pos + 4);
+    uint16_t data_length = Get16(msg + pos + 8);
+    pos += 10;
+    if (pos + data_length > length) {
+      return truncated;
+    }
+    if (cls == kClassIN && type == kTypeA && data_length == 4) {
+      struct in_addr a;
+      memcpy(&a, msg + pos, 4);
+      response->addresses.emplace_back(a);
+      response->ttl = std::min(response->ttl, ttl);
+    } else if (cls == kClassIN && type == kTypeAAAA && data_length == 16) {
+      struct in6_addr a;
+      memcpy(&a, msg + pos, 16);
+      response->addresses.emplace_back(a);
+      response->ttl = std::min(response->ttl, ttl);
+    }
+    pos += data_length;
+  }
+  return true;
+}
+
+Resolver::Resolver(Options options)
+    : options_(std::move(options)), random_(std::random_device()()) {
+  if (!options_.hosts_file.empty()) {
+    ReadHostsFile(options_.hosts_file);
+  }
+  if (options_.nameservers.empty()) {
+    ReadResolvConf();
+  }
+  if (options_.nameservers.empty()) {
+    Nameserver local;
+    IpAddress::Parse("127.0.0.1", &local.address);
+    options_.nameservers.push_back(local);
+  }
+}
+
+// Lines of an address followed by names, with # comments.
+void Resolver::ReadHostsFile(const std::string &path) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string word;
+    IpAddress address;
+    if (!(words >> word) || !IpAddress::Parse(word, &address)) {
+      continue;
+    }
+    while (words >> word) {
+      hosts_[CanonicalName(word)].push_back(address);
+    }
+  }
+}
+
+// Only the nameserver lines matter.  Search domains aren't used.
+void Resolver::ReadResolvConf() {
+  std::ifstream in("/etc/resolv.conf");
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream words(line);
+    std::string keyword;
+    std::string value;
+    Nameserver nameserver;
+    if (words >> keyword >> value && keyword == "nameserver" &&
+        IpAddress::Parse(value, &nameserver.address)) {
+      options_.nameservers.push_back(nameserver);
+    }
+  }
+}
+
+Resolver::Status Resolver::Lookup(Coroutine *c, std::string_view name,
+                                  std::vector<IpAddress> *addresses) {
+  addresses->clear();
+  IpAddress literal;
+  if (IpAddress::Parse(name, &literal)) {
+    addresses->push_back(literal);
+    return Status::kOk;
+  }
+  std::string key = CanonicalName(name);
+  if (auto it = hosts_.find(key); it != hosts_.end()) {
+    *addresses = it->second;
+    return Status::kOk;
+  }
+
+  uint64_t now = Now();
+  if (cache_.size() >= kMaxCacheEntries) {
+    Sweep(now);
+  }
+  // The entry stays put while there are users because the map is node
+  // based and Sweep leaves it alone.
+  Entry &entry = cache_[key];
+  entry.users++;
+  bool waited = false;
+  while (entry.pending) {
+    entry.waiters.Wait(c);
+    waited = true;
+  }
+  // Whatever the lookup we waited for found is the answer, even if it's
+  // already out of date.
+  if (!waited && entry.expires_at <= now) {
+    entry.pending = true;
+    Query(c, key, &entry);
+    entry.pending = false;
+    entry.waiters.NotifyAll();
+  }
+  entry.users--;
+  *addresses = entry.addresses;
+  return entry.status;
+}
+
+void Resolver::Query(Coroutine *c, const std::string &name, Entry *entry) {
+  Status status = Status::kTimeout;
+  for (const Nameserver &nameserver : options_.nameservers) {
+    status = QueryNameserver(c, nameserver, name, entry);
+    if (status == Status::kOk || status == Status::kNotFound) {
+      return;
+    }
+  }
+  // Try again next time.
+  entry->addresses.clear();
+  entry->status = status;
+  entry->expires_at = 0;
+}
+
+Resolver::Status Resolver::QueryNameserver(Coroutine *c,
+                                           const Nameserver &nameserver,
+                                           const std::string &name,
+                                           Entry *entry) {
+  static constexpr uint16_t kTypes[2] = {kTypeA, kTypeAAAA};
+  uint8_t queries[2][kMaxUdpMessage];
+  size_t query_lengths[2];
+  uint16_t ids[2];
+  for (int i = 0; i < 2; i++) {
+    ids[i] = static_cast<uint16_t>(random_());
+    query_lengths[i] = BuildQuery(name, ids[i], kTypes[i], queries[i]);
+    if (query_lengths[i] == 0) {
+      return Status::kError;
+    }
+  }
+
+  // A new socket each time gets a new random port, which along with the
+  // random ids makes forged answers hard to get accepted.  Connecting it
+  // means the kernel only gives us datagrams from the nameserver.
+  int fd = socket(nameserver.address.Family(), SOCK_DGRAM, 0);
+  if (fd == -1) {
+    return Status::kError;
+  }
+  struct sockaddr_storage addr;
+  socklen_t addr_length = nameserver.address.ToSockaddr(nameserver.port, &addr);
+  if (!SetNonBlocking(fd) ||
+      connect(fd, reinterpret_cast<struct sockaddr *>(&addr), addr_length) ==
+          -1) {
+    close(fd);
+    return Status::kError;
+  }
+
+  Response responses[2];
+  bool answered[2] = {false, false};
+  Status status = Status::kTimeout;
+  for (int attempt = 0; attempt < options_.attempts; attempt++) {
+    for (int i = 0; i < 2; i++) {
+      if (!answered[i]) {
+        co::Write(c, fd, queries[i], query_lengths[i]);
+      }
+    }
+    uint64_t deadline = Now() + options_.timeout_ns;
+    while (!(answered[0] && answered[1])) {
+      uint64_t now = Now();
+      if (now >= deadline) {
+        break;
+      }
+      uint8_t msg[kMaxUdpMessage];
+      ssize_t n = co::Read(c, fd, msg, sizeof(msg), deadline - now);
+      if (n == -1) {
+        if (errno == ETIMEDOUT) {
+          break;
+        }
+        // Usually ECONNREFUSED: nothing is listening.
+        close(fd);
+        return Status::kError;
+      }
+      Response response;
+      if (!ParseResponse(msg, static_cast<size_t>(n), &response)) {
+        continue;
+      }
+      for (int i = 0; i < 2; i++) {
+        if (!answered[i] && response.id == ids[i]) {
+          answered[i] = true;
+          responses[i] = std::move(response);
+          break;
+        }
+      }
+    }
+    if (answered[0] && answered[1]) {
+      status = Status::kOk;
+      break;
+    }
+  }
+  close(fd);
+  if (status != Status::kOk) {
+    return status;
+  }
+
+  uint64_t now = Now();
+  if (responses[0].rcode == kRcodeNameError ||
+      responses[1].rcode == kRcodeNameError) {
+    entry->addresses.clear();
+    entry->status = Status::kNotFound;
+    entry->expires_at = now + options_.negative_ttl_ns;
+    return Status::kNotFound;
+  }
+  if (responses[0].rcode != kRcodeNoError ||
+      responses[1].rcode != kRcodeNoError) {
+    // The nameserver failed or refused.  Maybe another one will do better.
+    return Status::kError;
+  }
+  entry->addresses = std::move(responses[0].addresses);
+  entry->addresses.insert(entry->addresses.end(),
+                          responses[1].addresses.begin(),
+                          responses[1].addresses.end());
+  if (entry->addresses.empty()) {
+    entry->status = Status::kNotFound;
+    entry->expires_at = now + options_.negative_ttl_ns;
+    return Status::kNotFound;
+  }
+  uint32_t ttl = std::min(responses[0].ttl, responses[1].ttl);
+  entry->status = Status::kOk;
+  entry->expires_at = now + static_cast<uint64_t>(ttl) * 1000000000ULL;
+  return Status::kOk;
+}
+
+void Resolver::Sweep(uint64_t now) {
+  for (auto it = cache_.begin(); it != cache_.end();) {
+    const Entry &entry = it->second;
+    if (entry.users == 0 && !entry.pending && entry.expires_at <= now) {
+      it = cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void Resolver::ClearCache() {
+  // Entries in use are out of date but can't go yet.
+  for (auto it = cache_.begin(); it != cache_.end();) {
+    if (it->second.users == 0) {
+      it = cache_.erase(it);
+    } else {
+      it->second.expires_at = 0;
+      ++it;
+    }
+  }
+}
+
+const char *Resolver::StatusName(Status status) {
+  switch (status) {
+  case Status::kOk:
+    return "ok";
+  case Status::kNotFound:
+    return "not found";
+  case Status::kTimeout:
+    return "timed out";
+  case Status::kError:
+    return "error";
+  }
+  return "unknown";
+}
+
+} // namespace co
@@ -0,0 +1,133 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef dns_h
+#define dns_h
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "coroutine.h"
+
+namespace co {
+
+// An IPv4 or IPv6 address.
+class IpAddress {
+public:
+  IpAddress() = default;
+  explicit IpAddress(const struct in_addr &address);
+  explicit IpAddress(const struct in6_addr &address);
+
+  // Parse a numeric address: "10.0.0.1", "::1" or "[::1]".  Returns false
+  // if it isn't one.
+  static bool Parse(std::string_view s, IpAddress *address);
+
+  // AF_INET, AF_INET6 or AF_UNSPEC for a default constructed address.
+  int Family() const { return family_; }
+
+  // Fill in a socket address for the address and a port.  Returns the
+  // length of the socket address.
+  socklen_t ToSockaddr(uint16_t port, struct sockaddr_storage *addr) const;
+
+  std::string ToString() const;
+
+  bool operator==(const IpAddress &other) const;
+  bool operator!=(const IpAddress &other) const { return !(*this == other); }
+
+private:
+  int family_ = AF_UNSPEC;
+  unsigned char bytes_[16] = {}; // Network byte order, 4 used for IPv4.
+};
+
+// A DNS resolver for coroutines.  Queries are sent over UDP with the I/O
+// functions in io.h, so a coroutine waiting for an answer doesn't hold up
+// the others the way gethostbyname holds up the whole thread.
+//
+// Answers are cached for as long as their TTL allows, and names that
+// don't exist for a short while, so repeated lookups of the same name
+// don't go to the network.  Lookups of a name that is already being looked
+// up wait for that lookup instead of sending queries of their own.
+//
+// Like the rest of a scheduler it isn't thread safe.  Use one per
+// scheduler thread.
+class Resolver {
+public:
+  enum class Status {
+    kOk,
+    kNotFound, // The name doesn't exist or has no addresses.
+    kTimeout,  // No nameserver answered.
+    kError,    // A bad name, or the nameservers failed.
+  };
+
+  struct Nameserver {
+    IpAddress address;
+    uint16_t port = 53;
+  };
+
+  struct Options {
+    // Empty means the ones in /etc/resolv.conf, or 127.0.0.1 if there
+    // aren't any.
+    std::vector<Nameserver> nameservers;
+    // Where to look before using DNS.  Empty means nowhere.
+    std::string hosts_file = "/etc/hosts";
+    // How long to wait for each attempt, and how many attempts to make
+    // with each nameserver.
+    uint64_t timeout_ns = 2000000000ULL;
+    int attempts = 2;
+    // How long to remember that a name doesn't exist.
+    uint64_t negative_ttl_ns = 5000000000ULL;
+  };
+
+  Resolver() : Resolver(Options()) {}
+  explicit Resolver(Options options);
+  Resolver(const Resolver &) = delete;
+  Resolver &operator=(const Resolver &) = delete;
+
+  // Find the addresses of a host.  A numeric address is returned as it is
+  // and a name in the hosts file comes from there.  Anything else is
+  // looked up in DNS, with the A and AAAA queries sent together to each
+  // nameserver in turn until one of them answers.  The IPv4 addresses
+  // come first.  An answer that doesn't fit in a UDP datagram is
+  // truncated by the nameserver, and what's there is used.
+  Status Lookup(Coroutine *c, std::string_view name,
+                std::vector<IpAddress> *addresses);
+
+  // Forget all the answers.
+  void ClearCache();
+
+  static const char *StatusName(Status status);
+
+private:
+  struct Entry {
+    std::vector<IpAddress> addresses;
+    Status status = Status::kOk;
+    uint64_t expires_at = 0;
+    bool pending = false; // Queries are in flight.
+    int users = 0;        // Coroutines in Lookup for this entry.
+    WaitQueue waiters;    // Waiting for the queries.
+  };
+
+  void ReadHostsFile(const std::string &path);
+  void ReadResolvConf();
+  void Query(Coroutine *c, const std::string &name, Entry *entry);
+  Status QueryNameserver(Coroutine *c, const Nameserver &nameserver,
+                         const std::string &name, Entry *entry);
+  void Sweep(uint64_t now);
+
+  Options options_;
+  std::unordered_map<std::string, std::vector<IpAddress>> hosts_;
+  std::unordered_map<std::string, Entry> cache_;
+  std::mt19937 random_;
+};
+
+} // namespace co
+#endif /* dns_h */
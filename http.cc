@@ -0,0 +1,341 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "http.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "io.h"
+
+namespace co {
+
+static char ToLower(char ch) {
+  return ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch;
+}
+
+static bool IsSpace(char ch) { return ch == ' ' || ch == '\t'; }
+
+static bool IsDigit(char ch) { return ch >= '0' && ch <= '9'; }
+
+bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (ToLower(a[i]) != ToLower(b[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Is token one of the comma separated tokens in value?
+static bool HasToken(std::string_view value, std::string_view token) {
+  while (!value.empty()) {
+    size_t comma = value.find(',');
+    std::string_view t = value.substr(0, comma);
+    while (!t.empty() && IsSpace(t.front())) {
+      t.remove_prefix(1);
+    }
+    while (!t.empty() && IsSpace(t.back())) {
+      t.remove_suffix(1);
+    }
+    if (EqualsIgnoreCase(t, token)) {
+      return true;
+    }
+    if (comma == std::string_view::npos) {
+      break;
+    }
+    value.remove_prefix(comma + 1);
+  }
+  return false;
+}
+
+// Work out which of the recognized headers a name is.  The length is
+// enough to tell most of them apart.
+static HttpHeader Identify(std::string_view name) {
+  switch (name.size()) {
+  case 4:
+    if (EqualsIgnoreCase(name, "host")) {
+      return HttpHeader::kHost;
+    }
+    break;
+  case 6:
+    if (EqualsIgnoreCase(name, "accept")) {
+      return HttpHeader::kAccept;
+    }
+    break;
+  case 10:
+    if (EqualsIgnoreCase(name, "connection")) {
+      return HttpHeader::kConnection;
+    }
+    if (EqualsIgnoreCase(name, "user-agent")) {
+      return HttpHeader::kUserAgent;
+    }
+    break;
+  case 12:
+    if (EqualsIgnoreCase(name, "content-type")) {
+      return HttpHeader::kContentType;
+    }
+    break;
+  case 14:
+    if (EqualsIgnoreCase(name, "content-length")) {
+      return HttpHeader::kContentLength;
+    }
+    break;
+  case 15:
+    if (EqualsIgnoreCase(name, "accept-encoding")) {
+      return HttpHeader::kAcceptEncoding;
+    }
+    break;
+  case 17:
+    if (EqualsIgnoreCase(name, "transfer-encoding")) {
+      return HttpHeader::kTransferEncoding;
+    }
+    break;
+  }
+  return HttpHeader::kOther;
+}
+
+void HttpParser::Reset() {
+  status_ = Status::kIncomplete;
+  data_ = nullptr;
+  line_start_ = 0;
+  scanned_ = 0;
+  have_start_line_ = false;
+  header_length_ = 0;
+  first_ = second_ = third_ = Span{0, 0};
+  status_code_ = 0;
+  num_fields_ = 0;
+  for (int i = 0; i < kNumHttpHeaders; i++) {
+    index_[i] = -1;
+  }
+}
+
+HttpParser::Status HttpParser::Parse(const char *data, size_t length) {
+  if (status_ != Status::kIncomplete) {
+    return status_;
+  }
+  // Offsets are 32 bits.
+  if (length > UINT32_MAX) {
+    return status_ = Status::kError;
+  }
+  data_ = data;
+  while (scanned_ < length) {
+    // memchr is vectorized by the C library so this is the fast way to
+    // find the end of a line.  Each byte is only scanned once, however
+    // the data arrives.
+    const void *nl = memchr(data + scanned_, '\n', length - scanned_);
+    if (nl == nullptr) {
+      scanned_ = length;
+      break;
+    }
+    size_t end = static_cast<const char *>(nl) - data;
+    scanned_ = end + 1;
+    // Lines end with CRLF but a bare LF is accepted too.
+    if (end > line_start_ && data[end - 1] == '\r') {
+      end--;
+    }
+    bool ok = true;
+    if (!have_start_line_) {
+      // Empty lines before the start line are allowed.
+      if (end != line_start_) {
+        ok = ParseStartLine(line_start_, end);
+        have_start_line_ = true;
+      }
+    } else if (end == line_start_) {
+      // A blank line ends the header.
+      header_length_ = scanned_;
+      return status_ = Status::kComplete;
+    } else if (IsSpace(data[line_start_])) {
+      ok = ParseContinuation(line_start_, end);
+    } else {
+      ok = ParseHeaderLine(line_start_, end);
+    }
+    if (!ok) {
+      return status_ = Status::kError;
+    }
+    line_start_ = scanned_;
+  }
+  return Status::kIncomplete;
+}
+
+bool HttpParser::ParseStartLine(size_t begin, size_t end) {
+  // Three parts separated by single spaces.  The last part of a status
+  // line (the reason) can contain spaces or be missing.
+  const char *p = data_ + begin;
+  const char *e = data_ + end;
+  Span *spans[3] = {&first_, &second_, &third_};
+  for (int i = 0; i < 3 && p <= e; i++) {
+    const char *sp = i == 2 ? nullptr
+                            : static_cast<const char *>(memchr(p, ' ', e - p));
+    const char *part_end = sp == nullptr ? e : sp;
+    *spans[i] = Span{static_cast<uint32_t>(p - data_),
+                     static_cast<uint32_t>(part_end - p)};
+    p = part_end + 1;
+    if (sp == nullptr) {
+      break;
+    }
+  }
+  // The protocol is HTTP/<digit>.<digit>.
+  std::string_view protocol = Protocol();
+  if (protocol.size() != 8 || protocol.substr(0, 5) != "HTTP/" ||
+      !IsDigit(protocol[5]) || protocol[6] != '.' || !IsDigit(protocol[7])) {
+    return false;
+  }
+  if (type_ == Type::kRequest) {
+    return first_.length > 0 && second_.length > 0;
+  }
+  std::string_view code = View(second_);
+  if (code.size() != 3) {
+    return false;
+  }
+  status_code_ = 0;
+  for (char ch : code) {
+    if (!IsDigit(ch)) {
+      return false;
+    }
+    status_code_ = status_code_ * 10 + (ch - '0');
+  }
+  return true;
+}
+
+bool HttpParser::ParseHeaderLine(size_t begin, size_t end) {
+  if (num_fields_ == kMaxHeaders) {
+    return false;
+  }
+  const char *p = data_ + begin;
+  const char *colon = static_cast<const char *>(memchr(p, ':', end - begin));
+  if (colon == nullptr || colon == p || IsSpace(colon[-1])) {
+    // No name, or whitespace before the colon which isn't allowed.
+    return false;
+  }
+  size_t name_end = colon - data_;
+  size_t value_begin = name_end + 1;
+  while (value_begin < end && IsSpace(data_[value_begin])) {
+    value_begin++;
+  }
+  size_t value_end = end;
+  while (value_end > value_begin && IsSpace(data_[value_end - 1])) {
+    value_end--;
+  }
+  Field &f = fields_[num_fields_];
+  f.name = Span{static_cast<uint32_t>(begin),
+                static_cast<uint32_t>(name_end - begin)};
+  f.value = Span{static_cast<uint32_t>(value_begin),
+                 static_cast<uint32_t>(value_end - value_begin)};
+  f.id = Identify(View(f.name));
+  int id = static_cast<int>(f.id);
+  if (f.id != HttpHeader::kOther && index_[id] == -1) {
+    index_[id] = static_cast<int8_t>(num_fields_);
+  }
+  num_fields_++;
+  return true;
+}
+
+bool HttpParser::ParseContinuation(size_t begin, size_t end) {
+  if (num_fields_ == 0) {
+    return false;
+  }
+  // The value of the last header now runs to the end of this line.
+  Field &f = fields_[num_fields_ - 1];
+  while (end > begin && IsSpace(data_[end - 1])) {
+    end--;
+  }
+  if (end > begin) {
+    if (f.value.length == 0) {
+      // The value starts on this line.
+      while (IsSpace(data_[begin])) {
+        begin++;
+      }
+      f.value.offset = static_cast<uint32_t>(begin);
+    }
+    f.value.length = static_cast<uint32_t>(end - f.value.offset);
+  }
+  return true;
+}
+
+std::string_view HttpParser::Find(HttpHeader id) const {
+  if (id == HttpHeader::kOther) {
+    return {};
+  }
+  int i = index_[static_cast<int>(id)];
+  return i == -1 ? std::string_view() : View(fields_[i].value);
+}
+
+std::string_view HttpParser::Find(std::string_view name) const {
+  HttpHeader id = Identify(name);
+  if (id != HttpHeader::kOther) {
+    return Find(id);
+  }
+  for (size_t i = 0; i < num_fields_; i++) {
+    if (EqualsIgnoreCase(View(fields_[i].name), name)) {
+      return View(fields_[i].value);
+    }
+  }
+  return {};
+}
+
+bool HttpParser::KeepAlive() const {
+  std::string_view connection = Find(HttpHeader::kConnection);
+  if (Protocol() == "HTTP/1.1") {
+    return !HasToken(connection, "close");
+  }
+  return HasToken(connection, "keep-alive");
+}
+
+int64_t HttpParser::ContentLength() const {
+  std::string_view value = Find(HttpHeader::kContentLength);
+  if (value.empty() || value.size() > 18) {
+    return -1;
+  }
+  int64_t length = 0;
+  for (char ch : value) {
+    if (!IsDigit(ch)) {
+      return -1;
+    }
+    length = length * 10 + (ch - '0');
+  }
+  return length;
+}
+
+bool HttpParser::IsChunked() const {
+  return HasToken(Find(HttpHeader::kTransferEncoding), "chunked");
+}
+
+HttpBuffer::HttpBuffer(size_t capacity, std::pmr::memory_resource *memory)
+    : capacity_(capacity), memory_(memory),
+      buffer_(static_cast<char *>(memory->allocate(capacity, 1))) {}
+
+HttpBuffer::~HttpBuffer() { memory_->deallocate(buffer_, capacity_, 1); }
+
+ssize_t HttpBuffer::Read(Coroutine *c, int fd, uint64_t timeout_ns) {
+  if (end_ == capacity_) {
+    if (start_ == 0) {
+      errno = ENOBUFS;
+      return -1;
+    }
+    // Move what's left to the front to make room.
+    memmove(buffer_, buffer_ + start_, end_ - start_);
+    end_ -= start_;
+    start_ = 0;
+  }
+  ssize_t n =
+      co::Read(c, fd, buffer_ + end_, capacity_ - end_, timeout_ns);
+  if (n > 0) {
+    end_ += static_cast<size_t>(n);
+  }
+  return n;
+}
+
+void HttpBuffer::Consume(size_t n) {
+  start_ += n;
+  if (start_ >= end_) {
+    // Nothing left, so start again at the front.
+    start_ = end_ = 0;
+  }
+}
+
+} // namespace co
@@ -0,0 +1,204 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef http_h
+#define http_h
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+
+namespace co {
+
+class Coroutine;
+
+// Headers that are common enough for the parser to recognize them, so
+// that they can be found without comparing names.
+enum class HttpHeader {
+  kOther,
+  kAccept,
+  kAcceptEncoding,
+  kConnection,
+  kContentLength,
+  kContentType,
+  kHost,
+  kTransferEncoding,
+  kUserAgent,
+};
+constexpr int kNumHttpHeaders = 9;
+
+struct HttpField {
+  HttpHeader id;
+  std::string_view name;
+  std::string_view value;
+};
+
+// ASCII case insensitive comparison, as used for header names and tokens.
+bool EqualsIgnoreCase(std::string_view a, std::string_view b);
+
+// An incremental parser for the header of an HTTP/1.x request or
+// response.  Give it the data received so far on a connection, and call
+// it again with the same data and whatever has been added to the end
+// when more arrives.  It only looks at the new bytes each time so
+// parsing a header that arrives in pieces is O(n).
+//
+// The parser holds offsets into the data rather than copies, and a fixed
+// number of header fields, so it never allocates memory.  The views it
+// returns point into the data given to the last call to Parse and are
+// only valid while that data is.
+//
+// Header names are compared without regard to case and the data isn't
+// modified.  A folded (obsolete multi-line) header value is returned as
+// it stands, CRLFs and all.
+class HttpParser {
+public:
+  enum class Type {
+    kRequest,
+    kResponse,
+  };
+
+  enum class Status {
+    kIncomplete, // Need more data.
+    kComplete,   // The header has been parsed.
+    kError,      // The data isn't an HTTP header we understand.
+  };
+
+  // Headers after this many are an error.
+  static constexpr size_t kMaxHeaders = 32;
+
+  explicit HttpParser(Type type) : type_(type) { Reset(); }
+
+  // Parse the data received so far.  The data must start with what was
+  // given to the last call (it may have moved in memory).  Once the
+  // result is kComplete or kError, the same result is returned until
+  // Reset is called.
+  Status Parse(const char *data, size_t length);
+
+  // Get ready to parse another header.
+  void Reset();
+
+  // The length of the header, including the blank line at the end.
+  // Anything after it is the body or the next request.  Valid when the
+  // parse is complete.
+  size_t HeaderLength() const { return header_length_; }
+
+  // The parts of a request line: "GET /index.html HTTP/1.1".
+  std::string_view Method() const { return View(first_); }
+  std::string_view Target() const { return View(second_); }
+
+  // The parts of a status line: "HTTP/1.1 404 Not Found".
+  int StatusCode() const { return status_code_; }
+  std::string_view Reason() const { return View(third_); }
+
+  // "HTTP/1.1" or "HTTP/1.0" in either.
+  std::string_view Protocol() const {
+    return View(type_ == Type::kRequest ? third_ : first_);
+  }
+
+  size_t NumHeaders() const { return num_fields_; }
+  HttpField Header(size_t i) const {
+    const Field &f = fields_[i];
+    return HttpField{f.id, View(f.name), View(f.value)};
+  }
+
+  // The value of the first header with the given name.  Returns an empty
+  // view (with a nullptr data()) if there isn't one.
+  std::string_view Find(HttpHeader id) const;
+  std::string_view Find(std::string_view name) const;
+
+  // Should the connection stay open after this message?  HTTP/1.1
+  // connections do unless there's a "Connection: close", HTTP/1.0 ones
+  // only if there's a "Connection: keep-alive".
+  bool KeepAlive() const;
+
+  // The Content-Length, or -1 if there isn't a valid one.
+  int64_t ContentLength() const;
+
+  // Is the body sent in chunks (Transfer-Encoding: chunked)?
+  bool IsChunked() const;
+
+private:
+  // A piece of the data, held as an offset so that the data can move.
+  struct Span {
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  struct Field {
+    HttpHeader id;
+    Span name;
+    Span value;
+  };
+
+  std::string_view View(Span s) const {
+    return std::string_view(data_ + s.offset, s.length);
+  }
+
+  bool ParseStartLine(size_t begin, size_t end);
+  bool ParseHeaderLine(size_t begin, size_t end);
+  bool ParseContinuation(size_t begin, size_t end);
+
+  Type type_;
+  Status status_;
+  const char *data_;   // The data given to the last Parse.
+  size_t line_start_;  // Offset of the start of the line being parsed.
+  size_t scanned_;     // Offset of the first byte not yet looked at.
+  bool have_start_line_;
+  size_t header_length_;
+  Span first_;
+  Span second_;
+  Span third_;
+  int status_code_;
+  size_t num_fields_;
+  Field fields_[kMaxHeaders];
+  // Index into fields_ of the first of each of the recognized headers,
+  // -1 if there isn't one.
+  int8_t index_[kNumHttpHeaders];
+};
+
+// A fixed size buffer for the data read from a connection.  Data is read
+// in at the end and consumed from the front.  The buffer is allocated
+// once, when it's made, so a connection can handle any number of requests
+// without allocating any more memory for them.  The capacity limits the
+// size of a header.  The memory can come from a coroutine's arena.
+class HttpBuffer {
+public:
+  static constexpr size_t kDefaultCapacity = 16 * 1024;
+
+  explicit HttpBuffer(
+      size_t capacity = kDefaultCapacity,
+      std::pmr::memory_resource *memory = std::pmr::get_default_resource());
+  ~HttpBuffer();
+  HttpBuffer(const HttpBuffer &) = delete;
+  HttpBuffer &operator=(const HttpBuffer &) = delete;
+
+  const char *Data() const { return buffer_ + start_; }
+  size_t Size() const { return end_ - start_; }
+  bool IsEmpty() const { return start_ == end_; }
+  bool IsFull() const { return end_ - start_ == capacity_; }
+
+  // Read as much as there is room for at the end, waiting if there's
+  // nothing to read.  The result is as for co::Read, so 0 means EOF.
+  // The data that's already there may move to the start of the buffer
+  // to make room.  Fails with ENOBUFS if the buffer is full.
+  ssize_t Read(Coroutine *c, int fd, uint64_t timeout_ns = 0);
+
+  // Throw away the first n bytes.
+  void Consume(size_t n);
+
+  void Clear() { start_ = end_ = 0; }
+
+private:
+  size_t capacity_;
+  std::pmr::memory_resource *memory_;
+  char *buffer_;
+  size_t start_ = 0;
+  size_t end_ = 0;
+};
+
+} // namespace co
+#endif /* http_h */
@@ -0,0 +1,72 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Values below kSubBuckets have a bucket each.  Above that, a value whose
+// top bit is bit n goes in one of the kSubBuckets / 2 buckets for that
+// power of two, picked by the kSubBucketBits bits below and including the
+// top bit.
+Histogram::Histogram()
+    : counts_((64 - kSubBucketBits) * (kSubBuckets / 2) + kSubBuckets) {}
+
+size_t Histogram::Index(uint64_t value) {
+  if (value < kSubBuckets) {
+    return static_cast<size_t>(value);
+  }
+  int shift = 63 - __builtin_clzll(value) - (kSubBucketBits - 1);
+  return shift * (kSubBuckets / 2) + (value >> shift);
+}
+
+uint64_t Histogram::HighestInBucket(size_t index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  int shift = static_cast<int>(index / (kSubBuckets / 2)) - 1;
+  uint64_t sub_bucket = index - shift * (kSubBuckets / 2);
+  // Wraps around to the right answer for the very last bucket.
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+void Histogram::Record(uint64_t value) {
+  counts_[Index(value)]++;
+  count_++;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+  sum_ += static_cast<double>(value);
+}
+
+void Histogram::Merge(const Histogram &other) {
+  for (size_t i = 0; i < counts_.size(); i++) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  sum_ += other.sum_;
+}
+
+double Histogram::Mean() const {
+  return count_ == 0 ? 0 : sum_ / static_cast<double>(count_);
+}
+
+uint64_t Histogram::Percentile(double percent) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  uint64_t target = static_cast<uint64_t>(
+      std::ceil(std::clamp(percent, 0.0, 100.0) / 100 * count_));
+  target = std::max<uint64_t>(target, 1);
+  uint64_t total = 0;
+  for (size_t i = 0; i < counts_.size(); i++) {
+    total += counts_[i];
+    if (total >= target) {
+      return std::min(HighestInBucket(i), max_);
+    }
+  }
+  return max_;
+}
@@ -0,0 +1,52 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef histogram_h
+#define histogram_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A histogram of 64 bit values with buckets that get wider as the values
+// get bigger, in the style of HdrHistogram: each power of two is split
+// into kSubBuckets / 2 equal buckets, so any value is recorded to within
+// 1 part in 64 whatever its size.  Recording is a couple of shifts and an
+// increment, and memory use is fixed (about 30KB).
+//
+// Not thread safe.  Give each thread its own and Merge them at the end.
+class Histogram {
+public:
+  Histogram();
+
+  void Record(uint64_t value);
+
+  // Add the counts of another histogram to this one.
+  void Merge(const Histogram &other);
+
+  uint64_t Count() const { return count_; }
+  uint64_t Min() const { return count_ == 0 ? 0 : min_; }
+  uint64_t Max() const { return max_; }
+  double Mean() const;
+
+  // The value that percentile percent (0 to 100) of the values are less
+  // than or equal to, to the precision of a bucket.  The largest value in
+  // the bucket is returned, but never more than Max.
+  uint64_t Percentile(double percent) const;
+
+private:
+  static constexpr int kSubBucketBits = 7;
+  static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+
+  static size_t Index(uint64_t value);
+  static uint64_t HighestInBucket(size_t index);
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+  double sum_ = 0;
+};
+
+#endif /* histogram_h */
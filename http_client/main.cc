@@ -3,364 +3,577 @@
 // See LICENSE file for licensing information.
 
 #include "coroutine.h"
+#include "dns.h"
+#include "histogram.h"
+#include "http.h"
+#include "io.h"
+#include "scheduler_group.h"
+#include <atomic>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <map>
-#include <netdb.h>
+#include <memory>
 #include <netinet/in.h>
-#include <set>
-#include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
 void Usage(void) {
-  fprintf(stderr, "usage: client -j <jobs> <host> <filename>\n");
+  fprintf(stderr,
+          "usage: client -j <jobs> [-c <connections>] "
+          "[-n <requests per job>] [-t <threads>] [-d <seconds>] "
+          "[-q <requests per second>] [-b] [-u] <host> <filename>\n"
+          "  -b: benchmark: discard the contents and print stats as JSON\n"
+          "      (implied by -d and -q)\n"
+          "  -u: use io_uring\n");
   exit(1);
 }
 
-// Send data to the server from a coroutine.
+// Set by -b, -d and -q.
+static bool g_benchmark = false;
+
+// Send data to the server from a coroutine.  This only yields to other
+// coroutines if the socket's buffer is full.
 static bool SendToServer(co::Coroutine *c, int fd, const char *request,
                          size_t length) {
-  int offset = 0;
-  const size_t kMaxLength = 1024;
-  while (length > 0) {
-    // Wait until we can send to the network.  This will yield to other
-    // coroutines and we will be resumed when we can write.
-    c->Wait(fd, POLLOUT);
-    size_t nbytes = length;
-    if (nbytes > kMaxLength) {
-      nbytes = kMaxLength;
-    }
-    ssize_t n = write(fd, request + offset, nbytes);
-    if (n == -1) {
-      perror("write");
-      return false;
-    }
-    if (n == 0) {
-      return false;
-    }
-    length -= n;
-    offset += n;
+  if (co::Write(c, fd, request, length) == -1) {
+    perror("write");
+    return false;
   }
   return true;
 }
 
-static std::vector<std::string> SplitString(const std::string &str) {
-  std::vector<std::string> result;
-  std::istringstream iss(str);
-  std::string token;
-
-  while (std::getline(iss, token, ' ')) {
-    result.push_back(token);
-  }
-
-  return result;
-}
-
-static size_t ReadHeaders(std::string &buffer, std::vector<std::string> &header,
-                          std::map<std::string, std::string> &http_headers) {
-  // Parse the header.
-  size_t i = 0;
-  // Find the \r\n at the end of the first line.
-  while (i < buffer.size() && buffer[i] != '\r') {
-    i++;
-  }
-  if (i == buffer.size()) {
-    // No header line.
-    return i;
-  }
-  std::string header_line(buffer.substr(0, i));
-  i += 2; // Skip \r\n.
-
-  // Parse the header line.  By splitting it at space into String objects
-  // allocated from the heap.
-  header = SplitString(header_line);
-
-  // Extract MIME headers.  Holds pointers to the data in the buffer.  Does
-  // not own the pointers.
-  while (i < buffer.length()) {
-    if (buffer[i] == '\r') {
-      // End of headers is a blank line.
-      i += 2;
-      break;
-    }
-    char *name = &buffer[i];
-    while (i < buffer.size() && buffer[i] != ':') {
-      // Convert name to upper case as they are case insensitive.
-      buffer[i] = toupper(buffer[i]);
-      i++;
-    }
-    // No header value, end of headers.
-    if (i == buffer.size()) {
-      break;
-    }
-    buffer[i] = '\0'; // Replace : by EOL
-    i++;
-    // Skip to non-space.
-    while (i < buffer.size() && isspace(buffer[i])) {
-      i++;
-    }
-    char *value = &buffer[i];
-    while (i < buffer.size()) {
-      if (i < buffer.size() + 3 && buffer[i] == '\r') {
-        // Check for continuation with a space as the first character on the
-        // next line.  TAB too.
-        if (buffer[i + 2] != ' ' && buffer[i + 2] != '\t') {
-          break;
-        }
-      } else if (buffer[i] == '\r') {
-        // No continuation, check for end of value.
-        break;
-      }
-      i++;
-    }
-    buffer[i] = '\0'; // Replace \r by EOL
-    i += 2;
-    http_headers[name] = value;
-  }
-  return i;
-}
-
-static size_t ReadContents(co::Coroutine *c, int fd, std::string &buffer,
-                           size_t i, int length, bool write_to_output) {
+// Read length bytes of contents, from the buffer and then from the
+// server.  Returns false if the server closes the connection or there is
+// an error before we have it all.
+static bool ReadContents(co::Coroutine *c, int fd, co::HttpBuffer &buffer,
+                         int64_t length, bool write_to_output) {
   while (length > 0) {
-    if (i < buffer.size()) {
-      // Data remaining in buffer
-      size_t nbytes = buffer.size() - i;
-      if (nbytes > length) {
-        nbytes = length;
-      }
-      if (write_to_output) {
-        fwrite(&buffer[i], 1, nbytes, stdout);
-      }
-      length -= nbytes;
-      i += nbytes;
-    } else {
+    if (buffer.IsEmpty()) {
       // No data in buffer, read some more into the buffer.
-      buffer.clear();
-      i = 0;
-      char buf[256];
-      c->Wait(fd, POLLIN);
-      ssize_t n = read(fd, buf, sizeof(buf));
+      ssize_t n = buffer.Read(c, fd);
       if (n == -1) {
         perror("read");
-        break;
+        return false;
       }
       if (n == 0) {
         printf("done\n");
-        break;
+        return false;
       }
-      buffer += std::string(buf, n);
+      continue;
     }
+    // Data remaining in buffer
+    size_t nbytes = buffer.Size();
+    if (static_cast<int64_t>(nbytes) > length) {
+      nbytes = static_cast<size_t>(length);
+    }
+    if (write_to_output) {
+      fwrite(buffer.Data(), 1, nbytes, stdout);
+    }
+    buffer.Consume(nbytes);
+    length -= nbytes;
   }
-  return i;
+  return true;
 }
 
-static size_t ReadChunkLength(co::Coroutine *c, int fd, std::string &buffer,
-                              size_t i, int *length) {
-  for (;;) {
-    char ch;
-    if (i < buffer.size()) {
-      ch = toupper(buffer[i++]);
-    } else {
-      // Fill the buffer with some more data.
-      buffer.clear();
-      i = 0;
-      c->Wait(fd, POLLIN);
-      char buf[256];
-      ssize_t n = read(fd, buf, sizeof(buf));
-      if (n == -1) {
-        perror("read");
-        *length = 0;
-        return i;
-      }
-      if (n == 0) {
-        // Didn't read anything, EOF on input.
-        return i;
-      }
-      buffer += std::string(buf, n);
-      continue;
-    }
-    if (ch == '\r') {
-      i++;
-      break;
+// Make sure there's a whole line at the front of the buffer.  Returns
+// its length, including the LF at the end, or 0 if the server closes the
+// connection or there is an error first.
+static size_t ReadLine(co::Coroutine *c, int fd, co::HttpBuffer &buffer) {
+  const void *nl;
+  while ((nl = memchr(buffer.Data(), '\n', buffer.Size())) == nullptr) {
+    ssize_t n = buffer.Read(c, fd);
+    if (n == -1) {
+      perror("read");
+      return 0;
     }
-    if (ch > '9') {
-      ch = ch - 'A' + 10;
-    } else {
-      ch -= '0';
+    if (n == 0) {
+      return 0;
     }
-    *length = (*length << 4) | ch;
   }
-  return i;
+  return static_cast<const char *>(nl) - buffer.Data() + 1;
 }
 
-static void ReadChunkedContents(co::Coroutine *c, int fd, std::string &buffer,
-                                size_t i) {
+// Read chunked contents, adding the length of each chunk to *length.
+static bool ReadChunkedContents(co::Coroutine *c, int fd,
+                                co::HttpBuffer &buffer, bool write_to_output,
+                                int64_t *length_read) {
   for (;;) {
-    // First line is the length of the chunk in hex.
-    int length = 0;
-    i = ReadChunkLength(c, fd, buffer, i, &length);
+    // First line is the length of the chunk in hex.  It may be followed
+    // by extensions, which we ignore.
+    size_t line_length = ReadLine(c, fd, buffer);
+    if (line_length == 0) {
+      return false;
+    }
+    int64_t length = 0;
+    for (size_t i = 0; i < line_length && isxdigit(buffer.Data()[i]); i++) {
+      char ch = toupper(buffer.Data()[i]);
+      length = (length << 4) | (ch > '9' ? ch - 'A' + 10 : ch - '0');
+    }
+    buffer.Consume(line_length);
     if (length == 0) {
       break;
     }
-    i = ReadContents(c, fd, buffer, i, length, true);
-
+    *length_read += length;
     // Chunk is followed by a CRLF.  Don't print this, just skip it.
-    i = ReadContents(c, fd, buffer, i, 2, false);
+    if (!ReadContents(c, fd, buffer, length, write_to_output) ||
+        !ReadContents(c, fd, buffer, 2, false)) {
+      return false;
+    }
+  }
+  // The last chunk is followed by trailers, if any, and a blank line.
+  for (;;) {
+    size_t line_length = ReadLine(c, fd, buffer);
+    if (line_length == 0) {
+      return false;
+    }
+    buffer.Consume(line_length);
+    if (line_length <= 2) {
+      return true;
+    }
   }
 }
 
-void Client(co::Coroutine *c, std::string server_name, in_addr_t ipaddr,
-            std::string filename) {
+// The connections to the server, shared by all the jobs.  A job takes an
+// idle connection if there is one and opens a new one if there are fewer
+// than the maximum.  Otherwise it waits for another job to give one back.
+//
+// The host is looked up each time a connection is made, which costs
+// nothing while the resolver has the answer cached.  New connections go to
+// each of the host's addresses in turn.
+class ConnectionPool {
+public:
+  ConnectionPool(co::Resolver &resolver, std::string host,
+                 int max_connections)
+      : resolver_(resolver), host_(std::move(host)),
+        max_connections_(max_connections) {}
+
+  ~ConnectionPool() {
+    for (int fd : idle_) {
+      close(fd);
+    }
+  }
+
+  // Get a connection to the server.  *reused is set to true if the
+  // connection has been used before, in which case the server may have
+  // closed it since.  Returns -1 if a new connection can't be made.
+  int Get(co::Coroutine *c, bool *reused) {
+    for (;;) {
+      if (!idle_.empty()) {
+        int fd = idle_.back();
+        idle_.pop_back();
+        *reused = true;
+        return fd;
+      }
+      if (num_connections_ < max_connections_) {
+        break;
+      }
+      waiters_.Wait(c);
+    }
+    *reused = false;
+    num_connections_++;
+    int fd = Connect(c);
+    if (fd == -1) {
+      num_connections_--;
+      waiters_.NotifyOne();
+    }
+    return fd;
+  }
 
-  int fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (fd == -1) {
-    perror("socket");
-    exit(1);
+  // Give back a connection that can be used for another request.
+  void Put(int fd) {
+    idle_.push_back(fd);
+    waiters_.NotifyOne();
   }
 
-  struct sockaddr_in addr = {.sin_family = AF_INET,
-                             .sin_port = htons(80),
-                             .sin_len = sizeof(int),
-                             .sin_addr.s_addr = ipaddr};
-  int e = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-  if (e != 0) {
+  // Give back a connection that can't be used again.
+  void Discard(int fd) {
     close(fd);
-    perror("connect");
-    return;
+    num_connections_--;
+    waiters_.NotifyOne();
   }
+
+private:
+  int Connect(co::Coroutine *c) {
+    std::vector<co::IpAddress> addresses;
+    co::Resolver::Status status = resolver_.Lookup(c, host_, &addresses);
+    if (status != co::Resolver::Status::kOk) {
+      fprintf(stderr, "can't resolve %s: %s\n", host_.c_str(),
+              co::Resolver::StatusName(status));
+      return -1;
+    }
+    // If an address doesn't work, try the next one.
+    size_t first = next_address_++;
+    for (size_t i = 0; i < addresses.size(); i++) {
+      const co::IpAddress &address =
+          addresses[(first + i) % addresses.size()];
+      int fd = socket(address.Family(), SOCK_STREAM, 0);
+      if (fd == -1) {
+        perror("socket");
+        continue;
+      }
+      struct sockaddr_storage addr;
+      socklen_t addr_length = address.ToSockaddr(80, &addr);
+      // Connect without blocking the other coroutines.
+      int e = co::Connect(c, fd, (struct sockaddr *)&addr, addr_length);
+      if (e == 0) {
+        return fd;
+      }
+      fprintf(stderr, "connect to %s: %s\n", address.ToString().c_str(),
+              strerror(errno));
+      close(fd);
+    }
+    return -1;
+  }
+
+  co::Resolver &resolver_;
+  std::string host_;
+  size_t next_address_ = 0;
+  int max_connections_;
+  int num_connections_ = 0; // Idle and in use.
+  std::vector<int> idle_;
+  co::WaitQueue waiters_;
+};
+
+
+enum class FetchResult {
+  kKeepAlive, // The connection can be used again.
+  kClose,     // The connection must be closed.
+  kError,     // The response didn't arrive whole.  Close the connection.
+  kNoReply,   // The server closed the connection without replying.
+};
+
+// Send a request for a file on a connection and read the reply.  The
+// status code and the length of the contents are put in *status_code and
+// *content_length when the response arrives.
+static FetchResult Fetch(co::Coroutine *c, int fd, co::HttpBuffer &buffer,
+                         const std::string &server_name,
+                         const std::string &filename, int *status_code,
+                         int64_t *content_length) {
   char request[256];
 
-  int reqlen =
-      snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
-               filename.c_str(), server_name.c_str());
+  int reqlen = snprintf(request, sizeof(request),
+                        "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                        "Connection: keep-alive\r\n\r\n",
+                        filename.c_str(), server_name.c_str());
   bool ok = SendToServer(c, fd, request, reqlen);
   if (!ok) {
     fprintf(stderr, "Failed to send to server: %s\n", strerror(errno));
-    close(fd);
-    return;
+    return FetchResult::kNoReply;
   }
 
-  std::string buffer;
-
-  // Read incoming HTTP request and parse it.
-  for (;;) {
-    char buf[64];
-
-    // Wait for data to arrive.  This will yield to other coroutines and
-    // we will resume when data is available to read.
-    c->Wait(fd, POLLIN);
-    ssize_t n = read(fd, buf, sizeof(buf));
+  // Read the response header and parse it as it arrives.
+  buffer.Clear();
+  co::HttpParser response(co::HttpParser::Type::kResponse);
+  co::HttpParser::Status status;
+  while ((status = response.Parse(buffer.Data(), buffer.Size())) ==
+         co::HttpParser::Status::kIncomplete) {
+    // Read the data if it has arrived.  Otherwise this will yield to other
+    // coroutines and we will resume when data is available to read.
+    ssize_t n = buffer.Read(c, fd);
     if (n == -1) {
       perror("read");
-      close(fd);
-      return;
+      return FetchResult::kError;
     }
     if (n == 0) {
       // EOF while reading header, nothing we can do.
-      close(fd);
-      return;
+      return buffer.IsEmpty() ? FetchResult::kNoReply : FetchResult::kError;
     }
-    // Append to data buffer.
-    buffer += std::string(buf, n);
+  }
+  if (status == co::HttpParser::Status::kError) {
+    fprintf(stderr, "Bad response from server\n");
+    return FetchResult::kError;
+  }
 
-    // A blank line terminates the read.
-    if (buffer.find("\r\n\r\n") != std::string::npos) {
-      break;
-    }
+  // The connection can only be used again if the server agrees and we can
+  // tell where the response ends.
+  bool keep_alive = response.KeepAlive();
+
+  // We now need to work out the length of the contents.  This is either
+  // from the CONTENT-LENGTH header or if TRANSFER-ENCODING is "chunked",
+  // we have a series of chunks, each of which is preceded by a hex length
+  // on a line of its own and terminated with a CRLF
+  bool is_chunked = response.IsChunked();
+  int64_t length = response.ContentLength();
+
+  // Check for valid status.  When benchmarking the errors are counted
+  // rather than printed, and so are the contents.
+  int status_value = response.StatusCode();
+  *status_code = status_value;
+  bool write_to_output = status_value == 200 && !g_benchmark;
+  if (status_value != 200 && !g_benchmark) {
+    std::string_view protocol = response.Protocol();
+    std::string_view reason = response.Reason();
+    fprintf(stderr, "%.*s Error: %d: %.*s\n",
+            static_cast<int>(protocol.size()), protocol.data(), status_value,
+            static_cast<int>(reason.size()), reason.data());
   }
 
-  std::vector<std::string> header;
-  std::map<std::string, std::string> http_headers;
+  // The contents follow the header in the buffer.  The contents of an
+  // error response are read but not printed.
+  buffer.Consume(response.HeaderLength());
+  *content_length = 0;
+  if (is_chunked) {
+    ok = ReadChunkedContents(c, fd, buffer, write_to_output, content_length);
+  } else if (length != -1) {
+    ok = ReadContents(c, fd, buffer, length, write_to_output);
+    *content_length = length;
+  } else {
+    if (write_to_output) {
+      fprintf(stderr, "Don't know how many bytes to read, no Content-length "
+                      "in headers\n");
+    }
+    return FetchResult::kClose;
+  }
+  if (!ok) {
+    return FetchResult::kError;
+  }
 
-  // The buffer contains the HTTP header line and the HTTP headers.
-  size_t i = ReadHeaders(buffer, header, http_headers);
+  // We don't pipeline, so anything after the response is junk.
+  if (!keep_alive || !buffer.IsEmpty()) {
+    return FetchResult::kClose;
+  }
+  return FetchResult::kKeepAlive;
+}
 
-  const size_t kProtocol = 0;
-  const size_t kStatus = 1;
-  const size_t kError = 2;
+static uint64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
 
-  // Make alises for the http header fields.
-  std::string &status = header[kStatus];
-  std::string &protocol = header[kProtocol];
+// What a job does.
+struct Job {
+  std::string host;
+  std::string filename;
+  int num_requests = 1; // -1 means no limit.
+  uint64_t end_time = 0; // No requests are sent after this, if not 0.
+  // With an interval the job sends a request every interval_ns, starting
+  // at first_request, whether or not the responses keep up.  Without one
+  // it sends the next request as soon as it has the last response.
+  uint64_t interval_ns = 0;
+  uint64_t first_request = 0;
+};
+
+// What happened to the requests.
+struct Stats {
+  int64_t responses = 0;
+  int64_t errors = 0;   // Requests that didn't get a whole response.
+  int64_t non_200 = 0;  // Responses with a status other than 200.
+  int64_t bytes = 0;    // Contents received.
+  Histogram latency;    // Nanoseconds per response.
+  // With a request rate, how late each request was sent, in nanoseconds.
+  // This is the client's own lag, which is also in the latency.
+  Histogram send_lateness;
+
+  void Merge(const Stats &other) {
+    responses += other.responses;
+    errors += other.errors;
+    non_200 += other.non_200;
+    bytes += other.bytes;
+    latency.Merge(other.latency);
+    send_lateness.Merge(other.send_lateness);
+  }
+};
+
+// The jobs in a thread share a connection pool and a resolver.  Nothing
+// in here is touched by any other thread until they have all finished.
+struct Shard {
+  Shard(const std::string &host, int max_connections)
+      : pool(resolver, host, max_connections) {}
+
+  co::Resolver resolver;
+  ConnectionPool pool;
+  Stats stats;
+  int num_jobs = 0;
+  int running = 0;
+};
+
+// A sleep can wake late by the kernel's timer slack (50us by default) and
+// more if the thread is busy, so a job with a request rate sleeps until
+// this long before a request is due and yields until the time comes.
+static constexpr uint64_t kSpinNs = 200000;
+
+// Wait until the time given by the monotonic clock.
+static void WaitUntil(co::Coroutine *c, uint64_t time) {
+  uint64_t now = Now();
+  if (now + kSpinNs < time) {
+    c->Nanosleep(time - now - kSpinNs);
+  }
+  while (Now() < time) {
+    c->Yield();
+  }
+}
 
-  // Check for valid status.
-  int status_value = atoi(status.c_str());
-  if (status_value != 200) {
-    fprintf(stderr, "%s Error: %d: ", protocol.c_str(), status_value);
-    // Print all error strings.
-    const char *sep = "";
-    for (size_t i = kError; i < header.size(); i++) {
-      std::string &s = header[i];
-      fprintf(stderr, "%s%s", sep, s.c_str());
-      sep = " ";
-    }
-    fprintf(stderr, "\n");
-  } else {
-    // We are the end of the http headers in the buffer.  We now need to work
-    // out the length.  This is either from the CONTENT-LENGTH header or if
-    // TRANSFER-ENCODING is "chunked", we have a series of chunks, each of which
-    // is preceded by a hex length on a line of its own and terminated with a
-    // CRLF
-    auto it = http_headers.find("TRANSFER-ENCODING");
-    bool is_chunked = false;
-    int content_length = -1;
-
-    if (it != http_headers.end() && it->second == "chunked") {
-      is_chunked = true;
+void Client(co::Coroutine *c, Shard &shard, const Job &job) {
+  // The buffer is used for each connection the job gets from the pool in
+  // turn.
+  co::HttpBuffer buffer;
+  uint64_t due = job.first_request;
+  for (int n = 0; job.num_requests < 0 || n < job.num_requests; n++) {
+    // The latency of a response is measured from when the request was due
+    // to be sent, not from when it was.  If a slow response makes the
+    // next request late, the next one's latency includes the wait, as
+    // it would for a real client sending at that rate.
+    uint64_t start;
+    if (job.interval_ns > 0) {
+      if (job.end_time != 0 && due >= job.end_time) {
+        break;
+      }
+      WaitUntil(c, due);
+      start = due;
+      due += job.interval_ns;
     } else {
-      auto it = http_headers.find("CONTENT-LENGTH");
-      if (it != http_headers.end()) {
-        content_length = (int)strtoll(it->second.c_str(), NULL, 10);
+      start = Now();
+      if (job.end_time != 0 && start >= job.end_time) {
+        break;
       }
     }
 
-    // We use the buffer to hold all the data received, in blocks.
-    if (is_chunked) {
-      ReadChunkedContents(c, fd, buffer, i);
-    } else {
-      if (content_length == -1) {
-        fprintf(stderr,
-                "Don't know how many bytes to read, no Content-length in "
-                "headers\n");
+    FetchResult result;
+    int status_code = 0;
+    int64_t content_length = 0;
+    bool sent = false;
+    for (;;) {
+      bool reused;
+      int fd = shard.pool.Get(c, &reused);
+      if (fd == -1) {
+        shard.stats.errors++;
+        return;
+      }
+      if (job.interval_ns > 0 && !sent) {
+        // Waiting for a connection is the client's lag too.
+        shard.stats.send_lateness.Record(Now() - start);
+        sent = true;
+      }
+      result = Fetch(c, fd, buffer, job.host, job.filename, &status_code,
+                     &content_length);
+      if (result == FetchResult::kNoReply && reused) {
+        // The server closed the connection while it was idle.  Try again
+        // on a new one.
+        shard.pool.Discard(fd);
+        continue;
+      }
+      if (result == FetchResult::kKeepAlive) {
+        shard.pool.Put(fd);
       } else {
-        ReadContents(c, fd, buffer, i, content_length, true);
+        shard.pool.Discard(fd);
       }
+      break;
     }
+
+    Stats &stats = shard.stats;
+    if (result == FetchResult::kError || result == FetchResult::kNoReply) {
+      stats.errors++;
+      continue;
+    }
+    stats.responses++;
+    if (status_code != 200) {
+      stats.non_200++;
+    }
+    stats.bytes += content_length;
+    stats.latency.Record(Now() - start);
+  }
+}
+
+static void PrintJson(const Stats &stats, int num_threads, int num_jobs,
+                      int num_connections, double target_qps,
+                      double seconds) {
+  const Histogram &latency = stats.latency;
+  auto us = [](double ns) { return ns / 1000; };
+  printf("{\n");
+  printf("  \"threads\": %d,\n", num_threads);
+  printf("  \"jobs\": %d,\n", num_jobs);
+  printf("  \"connections\": %d,\n", num_connections);
+  printf("  \"target_qps\": %.1f,\n", target_qps);
+  printf("  \"seconds\": %.3f,\n", seconds);
+  printf("  \"responses\": %lld,\n", static_cast<long long>(stats.responses));
+  printf("  \"errors\": %lld,\n", static_cast<long long>(stats.errors));
+  printf("  \"non_200\": %lld,\n", static_cast<long long>(stats.non_200));
+  printf("  \"bytes\": %lld,\n", static_cast<long long>(stats.bytes));
+  printf("  \"qps\": %.1f,\n", stats.responses / seconds);
+  printf("  \"bytes_per_second\": %.0f,\n", stats.bytes / seconds);
+  printf("  \"latency_us\": {\n");
+  printf("    \"min\": %.1f,\n", us(latency.Min()));
+  printf("    \"mean\": %.1f,\n", us(latency.Mean()));
+  printf("    \"p50\": %.1f,\n", us(latency.Percentile(50)));
+  printf("    \"p90\": %.1f,\n", us(latency.Percentile(90)));
+  printf("    \"p99\": %.1f,\n", us(latency.Percentile(99)));
+  printf("    \"p999\": %.1f,\n", us(latency.Percentile(99.9)));
+  printf("    \"max\": %.1f\n", us(latency.Max()));
+  // Only with a request rate, when requests have a time to be sent at.
+  const Histogram &lateness = stats.send_lateness;
+  printf("  }%s\n", lateness.Count() > 0 ? "," : "");
+  if (lateness.Count() > 0) {
+    printf("  \"send_lateness_us\": {\n");
+    printf("    \"mean\": %.1f,\n", us(lateness.Mean()));
+    printf("    \"p50\": %.1f,\n", us(lateness.Percentile(50)));
+    printf("    \"p99\": %.1f,\n", us(lateness.Percentile(99)));
+    printf("    \"p999\": %.1f,\n", us(lateness.Percentile(99.9)));
+    printf("    \"max\": %.1f\n", us(lateness.Max()));
+    printf("  }\n");
   }
+  printf("}\n");
+}
 
-  close(fd);
+// Parse a number after an option, either as -xN or -x N.
+static int NumberOption(int argc, const char *argv[], int *i) {
+  const char *arg = argv[*i];
+  if (isdigit(arg[2])) {
+    return atoi(&arg[2]);
+  }
+  if (arg[2] != '\0' || ++*i >= argc || !isdigit(argv[*i][0])) {
+    Usage();
+  }
+  return atoi(argv[*i]);
 }
 
 int main(int argc, const char *argv[]) {
   std::string host;
   std::string filename;
   int num_jobs = 1;
+  int num_connections = 0;
+  int num_requests = 0;
+  int num_threads = 1;
+  int seconds = 0;
+  int qps = 0;
+  co::PollerType poller_type = co::PollerType::kDefault;
   for (int i = 1; i < argc; i++) {
     if (argv[i][0] == '-') {
-      if (strcmp(argv[i], "-j") == 0) {
-        // Allow -j N where N is a number
-        i++;
-        if (i < argc) {
-          if (isdigit(argv[i][0])) {
-            num_jobs = atoi(argv[i]);
-          } else {
-            Usage();
-          }
-        } else {
-          Usage();
-        }
-      } else if (argv[i][1] == 'j' && isdigit(argv[i][2])) {
-        // Allow -jN where N is a number.
-        num_jobs = atoi(&argv[i][2]);
-      } else {
+      switch (argv[i][1]) {
+      case 'j':
+        num_jobs = NumberOption(argc, argv, &i);
+        break;
+      case 'c':
+        num_connections = NumberOption(argc, argv, &i);
+        break;
+      case 'n':
+        num_requests = NumberOption(argc, argv, &i);
+        break;
+      case 't':
+        num_threads = NumberOption(argc, argv, &i);
+        break;
+      case 'd':
+        seconds = NumberOption(argc, argv, &i);
+        g_benchmark = true;
+        break;
+      case 'q':
+        qps = NumberOption(argc, argv, &i);
+        g_benchmark = true;
+        break;
+      case 'b':
+        g_benchmark = true;
+        break;
+      case 'u':
+        poller_type = co::PollerType::kIoUring;
+        break;
+      default:
         Usage();
       }
     } else {
@@ -376,34 +589,74 @@ int main(int argc, const char *argv[]) {
   if (host.empty() || filename.empty()) {
     Usage();
   }
+  if (num_jobs <= 0) {
+    num_jobs = 1;
+  }
+  if (num_connections <= 0 || num_connections > num_jobs) {
+    // No point having more connections than jobs.
+    num_connections = num_jobs;
+  }
+  if (num_threads <= 0 || num_threads > num_connections) {
+    // Every thread needs a connection.
+    num_threads = num_connections;
+  }
+  if (num_requests <= 0) {
+    // A run with a time limit goes on until it's up.
+    num_requests = seconds > 0 ? -1 : 1;
+  }
 
-  struct hostent *entry = gethostbyname(host.c_str());
-  if (entry == NULL) {
-    fprintf(stderr, "unknown host %s\n", host.c_str());
-    exit(1);
+  Job job;
+  job.host = host;
+  job.filename = filename;
+  job.num_requests = num_requests;
+  uint64_t start_time = Now();
+  if (seconds > 0) {
+    job.end_time = start_time + static_cast<uint64_t>(seconds) * 1000000000ULL;
+  }
+  if (qps > 0) {
+    // Each job sends its share of the requests, and they take turns.
+    job.interval_ns = static_cast<uint64_t>(num_jobs) * 1000000000ULL / qps;
   }
-  in_addr_t ipaddr = ((struct in_addr *)entry->h_addr_list[0])->s_addr;
 
-  co::CoroutineScheduler scheduler;
-  std::set<std::unique_ptr<co::Coroutine>> jobs;
-  scheduler.SetCompletionCallback([&jobs](co::Coroutine *c) {
-    for (auto it = jobs.begin(); it != jobs.end(); it++) {
-      if (it->get() == c) {
-        jobs.erase(it);
-        return;
-      }
+  // The jobs and connections are shared out among the threads, each with
+  // its own scheduler.
+  std::vector<std::unique_ptr<Shard>> shards;
+  for (int i = 0; i < num_threads; i++) {
+    int connections =
+        num_connections / num_threads + (i < num_connections % num_threads);
+    shards.push_back(std::make_unique<Shard>(host, connections));
+    shards.back()->num_jobs =
+        num_jobs / num_threads + (i < num_jobs % num_threads);
+  }
+
+  co::SchedulerGroup group(num_threads, poller_type);
+  std::atomic<int> running_shards = num_threads;
+  group.Start([&](co::CoroutineScheduler &scheduler, int index) {
+    Shard &shard = *shards[index];
+    // The first job in each shard goes first, then the second in each
+    // and so on.
+    for (int i = 0; i < shard.num_jobs; i++) {
+      Job shard_job = job;
+      shard_job.first_request =
+          start_time + (i * num_threads + index) * job.interval_ns / num_jobs;
+      shard.running++;
+      scheduler.Spawn([&group, &shard, &running_shards,
+                       shard_job](co::Coroutine *c) {
+        Client(c, shard, shard_job);
+        if (--shard.running == 0 && --running_shards == 0) {
+          group.Stop();
+        }
+      });
     }
   });
+  group.Join();
 
-  // Run all the jobs in parallel.  They will be removed from the
-  // jobs set when they complete.
-  for (int i = 0; i < num_jobs; i++) {
-    jobs.insert(std::make_unique<co::Coroutine>(
-        scheduler, [ipaddr, host, filename](co::Coroutine *c) {
-          Client(c, host, ipaddr, filename);
-        }));
+  if (g_benchmark) {
+    Stats stats;
+    for (auto &shard : shards) {
+      stats.Merge(shard->stats);
+    }
+    double elapsed = static_cast<double>(Now() - start_time) / 1e9;
+    PrintJson(stats, num_threads, num_jobs, num_connections, qps, elapsed);
   }
-
-  // Run the main loop
-  scheduler.Run();
 }
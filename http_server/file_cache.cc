@@ -0,0 +1,151 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "file_cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "offload.h"
+
+static uint64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct timespec ModificationTime(const struct stat &st) {
+#if defined(__APPLE__)
+  return st.st_mtimespec;
+#else
+  return st.st_mtim;
+#endif
+}
+
+FileCache::File::~File() {
+  if (data != nullptr) {
+    munmap(const_cast<char *>(data), size);
+  }
+}
+
+FileCache::FileCache(size_t max_bytes, uint64_t revalidate_ns)
+    : max_bytes_(max_bytes), revalidate_ns_(revalidate_ns) {}
+
+FileCache::~FileCache() {
+  while (!lru_.IsEmpty()) {
+    Erase(lru_.Front());
+  }
+}
+
+std::shared_ptr<const FileCache::File>
+FileCache::Lookup(co::Coroutine *c, std::string_view path) {
+  uint64_t now = Now();
+  auto it = files_.find(path);
+  if (it != files_.end()) {
+    std::shared_ptr<File> file = it->second;
+    lru_.Remove(file.get());
+    lru_.PushBack(file.get());
+    if (now - file->checked_at < revalidate_ns_) {
+      return file;
+    }
+    // Time to check that the file hasn't changed.  A file that has been
+    // replaced has a different inode, one that has been written to has a
+    // different modification time or size.  The stat can wait for the
+    // disk, so it's done in the offload pool.  Other requests for the file
+    // are given the cached copy while we wait rather than checking again.
+    file->checked_at = now;
+    struct stat st;
+    int r = co::Offload(c, [&file, &st]() {
+      return stat(file->path.c_str(), &st);
+    });
+    if (r == 0 && st.st_dev == file->dev && st.st_ino == file->ino &&
+        static_cast<size_t>(st.st_size) == file->size &&
+        ModificationTime(st).tv_sec == file->mtime.tv_sec &&
+        ModificationTime(st).tv_nsec == file->mtime.tv_nsec) {
+      return file;
+    }
+    // Another coroutine may have thrown it out while we were waiting.
+    if (auto it = files_.find(path);
+        it != files_.end() && it->second == file) {
+      Erase(file.get());
+    }
+  }
+
+  // A miss is slow anyway so we can afford a string for the system calls.
+  std::string filename(path);
+  size_t max_size = max_bytes_ / 4;
+  std::shared_ptr<File> file = co::Offload(
+      c, [&filename, max_size]() { return Load(filename, max_size); });
+  if (file == nullptr) {
+    return nullptr;
+  }
+  // Another coroutine may have loaded the file while we were waiting.
+  if (auto it = files_.find(path); it != files_.end()) {
+    return it->second;
+  }
+  file->checked_at = now;
+  while (bytes_ + file->size > max_bytes_ && !lru_.IsEmpty()) {
+    Erase(lru_.Front());
+  }
+  bytes_ += file->size;
+  lru_.PushBack(file.get());
+  files_[file->path] = file;
+  return file;
+}
+
+std::shared_ptr<FileCache::File> FileCache::Load(const std::string &path,
+                                                 size_t max_size) {
+  // Non-blocking so that opening a FIFO doesn't wait for a writer.
+  int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat fst;
+  if (fstat(fd, &fst) == -1 || !S_ISREG(fst.st_mode) ||
+      static_cast<size_t>(fst.st_size) > max_size) {
+    close(fd);
+    return nullptr;
+  }
+  auto file = std::make_shared<File>();
+  file->path = path;
+  file->size = static_cast<size_t>(fst.st_size);
+  file->dev = fst.st_dev;
+  file->ino = fst.st_ino;
+  file->mtime = ModificationTime(fst);
+  if (file->size > 0) {
+    int flags = MAP_PRIVATE;
+#if defined(__linux__)
+    // Read the file in now, rather than when the first request for it
+    // touches the pages in the scheduler's thread.
+    flags |= MAP_POPULATE;
+#endif
+    void *p = mmap(nullptr, file->size, PROT_READ, flags, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      return nullptr;
+    }
+    file->data = static_cast<const char *>(p);
+  }
+  // The mapping stays valid after the fd is closed.
+  close(fd);
+
+  char header[128];
+  int n = snprintf(header, sizeof(header),
+                   " 200 OK\r\nContent-type: text/html\r\nContent-length: "
+                   "%zu\r\n",
+                   file->size);
+  file->header.assign(header, n);
+  return file;
+}
+
+void FileCache::Erase(File *file) {
+  lru_.Remove(file);
+  bytes_ -= file->size;
+  // Anyone still sending the file holds a reference to it, so the mapping
+  // goes away when they're done.  Erase by iterator because the key is
+  // owned by the file.
+  files_.erase(files_.find(file->path));
+}
@@ -0,0 +1,93 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef file_cache_h
+#define file_cache_h
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "coroutine.h"
+#include "intrusive_list.h"
+
+// A cache of memory mapped files and their response headers, so that
+// serving a hot file is a single writev from mapped memory instead of a
+// stat, open, some reads and a close.
+//
+// The cache holds at most max_bytes of file contents and throws out the
+// least recently used files to make room.  A file larger than a quarter
+// of the cache isn't cached at all so that one big file can't flush out
+// all the small ones.
+//
+// A cached file is checked against the file system (by stat) when it is
+// looked up more than revalidate_ns after the last check, and reloaded
+// if it has changed.  In between checks a changed file is served from
+// the old mapping, which has the old size but may show some of the new
+// contents.  A file that is truncated while it is being sent will cause
+// a SIGBUS, as with any mapped file.
+//
+// A FileCache isn't thread safe.  Use one per scheduler thread.
+class FileCache {
+public:
+  struct File {
+    std::string path;
+    const char *data = nullptr; // Mapped contents, nullptr if size is 0.
+    size_t size = 0;
+    // The response header for the file, without the protocol at the
+    // front or the blank line at the end: " 200 OK\r\n...\r\n".
+    std::string header;
+
+    ~File();
+
+  private:
+    friend class FileCache;
+
+    dev_t dev = 0;
+    ino_t ino = 0;
+    struct timespec mtime = {};
+    uint64_t checked_at = 0; // When the file was last compared by stat.
+    co::ListLink<File> lru_link;
+  };
+
+  explicit FileCache(size_t max_bytes,
+                     uint64_t revalidate_ns = 1000000000ULL);
+  FileCache(const FileCache &) = delete;
+  FileCache &operator=(const FileCache &) = delete;
+  ~FileCache();
+
+  // Get the file at path, loading it into the cache if necessary.
+  // Returns nullptr if the file doesn't exist, isn't a regular file or
+  // is too big to be cached.  The File stays valid for as long as the
+  // caller holds on to it, even if it is thrown out of the cache.  A file
+  // is loaded in the offload pool, so the coroutine waits for the disk
+  // but the rest of the scheduler doesn't.
+  std::shared_ptr<const File> Lookup(co::Coroutine *c, std::string_view path);
+
+  size_t Bytes() const { return bytes_; }
+  size_t NumFiles() const { return files_.size(); }
+
+private:
+  // Called in the offload pool, so it mustn't touch the cache.
+  static std::shared_ptr<File> Load(const std::string &path, size_t max_size);
+  void Erase(File *file);
+
+  size_t max_bytes_;
+  uint64_t revalidate_ns_;
+  size_t bytes_ = 0;
+  // The keys are views of the files' paths, so a lookup doesn't need to
+  // make a string.
+  std::unordered_map<std::string_view, std::shared_ptr<File>> files_;
+  // Least recently used at the front.
+  co::IntrusiveList<File, &File::lru_link> lru_;
+};
+
+#endif /* file_cache_h */
@@ -3,241 +3,444 @@
 // See LICENSE file for licensing information.
 
 #include "coroutine.h"
+#include "file_cache.h"
+#include "http.h"
+#include "io.h"
+#include "offload.h"
+#include "scheduler_group.h"
+#include "uring.h"
+#include <algorithm>
+#include <atomic>
 #include <csignal>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <netinet/in.h>
-#include <set>
-#include <sstream>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <vector>
 
-static co::CoroutineScheduler *g_scheduler;
+static co::SchedulerGroup *g_group; // Set when running multiple threads.
+static size_t g_cache_bytes = 64 << 20; // 0 turns off the file cache.
+static co::PollerType g_poller_type = co::PollerType::kDefault;
+static int g_backlog = 4096;       // The kernel caps it at somaxconn.
+static int g_max_connections = 0; // 0 means no limit.
+
+// Connections being served, in all threads.
+static std::atomic<int> g_connections;
+
+// How long the listener waits for a connection to finish when it's at the
+// connection limit before turning away the ones that are queued.
+static constexpr uint64_t kOverloadWaitNs = 100000000ULL;
+
+// A listener waiting at the connection limit for a connection to finish.
+// Connections can finish in any thread, so the one that makes room wakes
+// the waiting listeners through their own schedulers.
+struct RoomWaiter {
+  co::CoroutineScheduler *scheduler;
+  co::WaitQueue queue;
+};
+static std::mutex g_room_lock;
+static std::vector<RoomWaiter *> g_room_waiters; // Guarded by g_room_lock.
+// The size of g_room_waiters, so that finishing a connection only takes
+// the lock when there is a listener to wake.
+static std::atomic<int> g_num_room_waiters;
+
+// SIGQUIT prints the scheduler counters and the coroutines, then quits.
+// Neither can be done safely in a signal handler, which might have
+// interrupted malloc or the scheduler itself, so the handler only writes
+// to this pipe and the dumper coroutine does the rest.
+static int g_dump_pipe[2] = {-1, -1};
+
 void Signal(int sig) {
-  printf("\nAll coroutines:\n");
-  g_scheduler->Show();
-  signal(sig, SIG_DFL);
-  raise(sig);
+  char ch = 0;
+  if (write(g_dump_pipe[1], &ch, 1) == -1) {
+    // Already asked.
+  }
 }
 
-// Send a buffer full of data to the coroutines file descriptor.
-static void SendToClient(co::Coroutine *c, int fd, const char *response,
-                         size_t length) {
-  int offset = 0;
-  const size_t kMaxLength = 1024;
-  while (length > 0) {
-    // Wait until we can send to the network.  This will yield to other
-    // coroutines and we will be resumed when we can write.
-    c->Wait(fd, POLLOUT);
-    size_t nbytes = length;
-    if (nbytes > kMaxLength) {
-      nbytes = kMaxLength;
-    }
-    ssize_t n = write(fd, response + offset, nbytes);
-    if (n == -1) {
-      perror("write");
-      return;
-    }
-    if (n == 0) {
-      return;
+// Called in the scheduler's thread, the only place its counters and
+// coroutines can be looked at.
+static void DumpScheduler(co::CoroutineScheduler &scheduler, int index) {
+  std::string stats = scheduler.Stats().ToString();
+  if (index < 0) {
+    printf("\nScheduler: %s\n", stats.c_str());
+  } else {
+    printf("\nScheduler %d: %s\n", index, stats.c_str());
+  }
+  printf("All coroutines:\n");
+  // Show writes to stderr.
+  fflush(stdout);
+  scheduler.Show();
+}
+
+void Dumper(co::Coroutine *c) {
+  c->Wait(g_dump_pipe[0], POLLIN);
+  if (g_group == nullptr) {
+    DumpScheduler(c->Scheduler(), -1);
+  } else {
+    // Each of the group's schedulers dumps itself in its own thread, one
+    // at a time so that the output isn't mixed up.
+    for (int i = 0; i < g_group->Size(); i++) {
+      co::CoroutineScheduler *s = &g_group->Scheduler(i);
+      if (s == &c->Scheduler()) {
+        DumpScheduler(*s, i);
+        continue;
+      }
+      std::atomic<bool> done = false;
+      g_group->Post(i, [s, i, &done]() {
+        DumpScheduler(*s, i);
+        done = true;
+      });
+      while (!done) {
+        c->Millisleep(1);
+      }
     }
-    length -= n;
-    offset += n;
   }
+  signal(SIGQUIT, SIG_DFL);
+  raise(SIGQUIT);
 }
 
-static std::vector<std::string> SplitString(const std::string &str) {
-  std::vector<std::string> result;
-  std::istringstream iss(str);
-  std::string token;
+void Usage(void) {
+  fprintf(stderr,
+          "usage: http_server [-t <threads>] [-c <cache MiB>] [-b <backlog>] "
+          "[-m <max connections>] [-u]\n"
+          "  -u: use io_uring\n");
+  exit(1);
+}
 
-  while (std::getline(iss, token, ' ')) {
-    result.push_back(token);
+// Send a buffer full of data to the coroutines file descriptor.  This
+// only yields to other coroutines if the socket's buffer is full.
+static bool SendToClient(co::Coroutine *c, int fd, const char *response,
+                         size_t length) {
+  if (co::Write(c, fd, response, length) == -1) {
+    perror("write");
+    return false;
   }
+  return true;
+}
 
-  return result;
+// The file cache for this thread.  Coroutines only run on one thread at a
+// time so the cache needs no locking.
+static FileCache *ThreadFileCache() {
+  static thread_local std::unique_ptr<FileCache> cache;
+  if (cache == nullptr) {
+    cache = std::make_unique<FileCache>(g_cache_bytes);
+  }
+  return cache.get();
 }
 
-static void ReadHeaders(std::string &buffer, std::vector<std::string> &header,
-                        std::map<std::string, std::string> &http_headers) {
-  // Parse the header.
-  size_t i = 0;
-  // Find the \r\n at the end of the first line.
-  while (i < buffer.size() && buffer[i] != '\r') {
-    i++;
+// Send a file from the cache: the protocol, the prebuilt header, the
+// connection header and the mapped contents in one writev.  Returns false
+// if the file isn't in the cache and can't be put there.  Otherwise *sent
+// says whether all of it was written; if not, the connection is no good.
+static bool SendCachedFile(co::Coroutine *c, int fd, std::string_view protocol,
+                           std::string_view filename, const char *connection,
+                           bool *sent) {
+  if (g_cache_bytes == 0) {
+    return false;
   }
-  if (i == buffer.size()) {
-    // No header line.
-    return;
+  // Holding on to the file keeps it mapped while we send it, even if
+  // another coroutine causes it to be thrown out of the cache.
+  std::shared_ptr<const FileCache::File> file =
+      ThreadFileCache()->Lookup(c, filename);
+  if (file == nullptr) {
+    return false;
   }
-  std::string header_line(buffer.substr(0, i));
-  i += 2; // Skip \r\n.
-
-  // Parse the header line.  By splitting it at space into String objects
-  // allocated from the heap.
-  header = SplitString(header_line);
-
-  // Extract MIME headers.  Holds pointers to the data in the buffer.  Does
-  // not own the pointers.
-  while (i < buffer.length()) {
-    if (buffer[i] == '\r') {
-      // End of headers is a blank line.
-      i += 2;
-      break;
+  struct iovec iov[4] = {
+      {const_cast<char *>(protocol.data()), protocol.size()},
+      {const_cast<char *>(file->header.data()), file->header.size()},
+      {const_cast<char *>(connection), strlen(connection)},
+      {const_cast<char *>(file->data), file->size},
+  };
+  size_t length = protocol.size() + file->header.size() + strlen(connection) +
+                  file->size;
+  ssize_t n = co::Writev(c, fd, iov, 4);
+  if (n == -1) {
+    perror("writev");
+  }
+  *sent = n == static_cast<ssize_t>(length);
+  return true;
+}
+
+// Files that aren't cached are sent a piece of this size at a time.
+static constexpr size_t kSendPieceSize = 1 << 20;
+
+// Get a piece of a file into the page cache in the offload pool, so that
+// sending it doesn't wait for the disk in the scheduler's thread.  Mapping
+// it with MAP_POPULATE reads it in without copying it anywhere.  The
+// offset must be a multiple of the page size.
+static void Prefetch(co::Coroutine *c, int fd, off_t offset, size_t length) {
+#if defined(__linux__)
+  co::Offload(c, [fd, offset, length]() {
+    void *p =
+        mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, offset);
+    if (p != MAP_FAILED) {
+      munmap(p, length);
     }
-    char *name = &buffer[i];
-    while (i < buffer.size() && buffer[i] != ':') {
-      // Convert name to upper case as they are case insensitive.
-      buffer[i] = toupper(buffer[i]);
-      i++;
+  });
+#endif
+}
+
+// Send a file that isn't in the cache, preceded by the header.  Returns
+// false on error.
+static bool SendUncachedFile(co::Coroutine *c, int fd, int file_fd,
+                             size_t size, const char *header,
+                             size_t header_length) {
+  size_t offset = 0;
+  do {
+    size_t length = std::min(size - offset, kSendPieceSize);
+    if (length > 0) {
+      Prefetch(c, file_fd, static_cast<off_t>(offset), length);
     }
-    // No header value, end of headers.
-    if (i == buffer.size()) {
-      break;
+    ssize_t n = co::SendFile(c, fd, file_fd, static_cast<off_t>(offset),
+                             length, header, header_length);
+    if (n == -1) {
+      perror("sendfile");
+      return false;
     }
-    buffer[i] = '\0'; // Replace : by EOL
-    i++;
-    // Skip to non-space.
-    while (i < buffer.size() && isspace(buffer[i])) {
-      i++;
+    if (static_cast<size_t>(n) < length) {
+      // The file has been truncated.  The client will see a short
+      // response and we can't carry on with the connection.
+      return false;
     }
-    char *value = &buffer[i];
-    while (i < buffer.size()) {
-      if (i < buffer.size() + 3 && buffer[i] == '\r') {
-        // Check for continuation with a space as the first character on the
-        // next line.  TAB too.
-        if (buffer[i + 2] != ' ' && buffer[i + 2] != '\t') {
-          break;
-        }
-      } else if (buffer[i] == '\r') {
-        // No continuation, check for end of value.
-        break;
-      }
-      i++;
+    offset += length;
+    header_length = 0;
+  } while (offset < size);
+  return true;
+}
+
+// How long a connection can sit idle waiting for a request before we
+// close it.
+static constexpr uint64_t kIdleTimeoutNs = 10ULL * 1000000000;
+
+// Handle one request, whose header has been parsed.  Returns true if the
+// connection can be used for another request.
+static bool HandleRequest(co::Coroutine *c, int fd,
+                          const co::HttpParser &request) {
+  // The request line parts point into the connection's buffer, which
+  // stays put until we're done.  The filename has to be a C string for
+  // the system calls, so it's copied, into the coroutine's arena.
+  std::string_view method = request.Method();
+  std::string_view protocol = request.Protocol();
+  std::pmr::string filename(request.Target(), c->Arena());
+
+  bool keep_alive = request.KeepAlive();
+  // We don't read request bodies so we can't find the start of the next
+  // request after one.
+  if (!request.Find(co::HttpHeader::kContentLength).empty() ||
+      !request.Find(co::HttpHeader::kTransferEncoding).empty()) {
+    keep_alive = false;
+  }
+
+  char response[256];
+
+  std::string_view hostname = request.Find(co::HttpHeader::kHost);
+  if (hostname.empty()) {
+    hostname = "unknown";
+  }
+
+  printf("%s: %.*s for %s from %.*s\n", c->Name().c_str(),
+         static_cast<int>(method.size()), method.data(), filename.c_str(),
+         static_cast<int>(hostname.size()), hostname.data());
+
+  // Only support the GET method for now.
+  if (method != "GET") {
+    // Invalid request method.
+    int n = snprintf(response, sizeof(response),
+                     "%.*s 400 Invalid request method\r\nContent-length: "
+                     "0\r\nConnection: close\r\n\r\n",
+                     static_cast<int>(protocol.size()), protocol.data());
+    SendToClient(c, fd, response, n);
+    return false;
+  }
+
+  // The last header line, which is followed by the blank line.
+  const char *connection = keep_alive ? "Connection: keep-alive\r\n\r\n"
+                                      : "Connection: close\r\n\r\n";
+
+  bool sent;
+  if (SendCachedFile(c, fd, protocol, filename, connection, &sent)) {
+    return sent && keep_alive;
+  }
+
+  // The file system calls can wait for the disk, so they're done in the
+  // offload pool.
+  struct stat st;
+  int file_fd = co::Offload(c, [&filename, &st]() {
+    // Non-blocking so that opening a FIFO doesn't wait for a writer.
+    int f = open(filename.c_str(), O_RDONLY | O_NONBLOCK);
+    if (f != -1 && (fstat(f, &st) == -1 || !S_ISREG(st.st_mode))) {
+      close(f);
+      f = -1;
     }
-    buffer[i] = '\0'; // Replace \r by EOL
-    i += 2;
-    http_headers[name] = value;
+    return f;
+  });
+  if (file_fd == -1) {
+    int n = snprintf(response, sizeof(response),
+                     "%.*s 404 Not Found\r\nContent-length: 0\r\n%s",
+                     static_cast<int>(protocol.size()), protocol.data(),
+                     connection);
+    return SendToClient(c, fd, response, n) && keep_alive;
   }
+
+  // Send the file back.  The header goes with the start of the file
+  // and the file itself is sent by the kernel without copying it
+  // through here.
+  int n = snprintf(response, sizeof(response),
+                   "%.*s 200 OK\r\nContent-type: text/html\r\nContent-length: "
+                   "%zd\r\n%s",
+                   static_cast<int>(protocol.size()), protocol.data(),
+                   static_cast<size_t>(st.st_size), connection);
+  bool ok = SendUncachedFile(c, fd, file_fd, static_cast<size_t>(st.st_size),
+                             response, n);
+  close(file_fd);
+  return ok && keep_alive;
 }
 
+// Serve requests on a connection until the client closes it, asks for it
+// to be closed or leaves it idle for too long.  Requests can be pipelined:
+// a client can send the next request before it has the response to the
+// last one, so there may be more than one request in the buffer.
 void Server(co::Coroutine *c, int fd, struct sockaddr_in sender,
             socklen_t sender_len) {
-  std::string buffer;
+  // The buffer limits the size of a request header.  It comes from the
+  // coroutine's arena, like everything else the connection needs.
+  co::HttpBuffer buffer(co::HttpBuffer::kDefaultCapacity, c->Arena());
+  co::HttpParser request(co::HttpParser::Type::kRequest);
 
-  // Read incoming HTTP request and parse it.
   for (;;) {
-    char buf[64];
-
-    // Wait for data to arrive.  This will yield to other coroutines and
-    // we will resume when data is available to read.
-
-    c->Wait(fd, POLLIN);
-    ssize_t n = read(fd, buf, sizeof(buf));
-
-    if (n == -1) {
-      perror("read");
-      close(fd);
-      return;
+    // Parse what's in the buffer, reading more until there's a whole
+    // request header.  The parser carries on from where it got to.
+    co::HttpParser::Status status;
+    while ((status = request.Parse(buffer.Data(), buffer.Size())) ==
+           co::HttpParser::Status::kIncomplete) {
+      // Read the data if it has arrived.  Otherwise this will yield to
+      // other coroutines and we will resume when data is available to read
+      // or the connection has been idle for too long.
+      ssize_t n = buffer.Read(c, fd, kIdleTimeoutNs);
+      if (n == -1) {
+        if (errno != ETIMEDOUT && errno != ENOBUFS) {
+          perror("read");
+        }
+        close(fd);
+        return;
+      }
+      if (n == 0) {
+        // The client closed the connection.
+        close(fd);
+        return;
+      }
     }
-    if (n == 0) {
-      // EOF while reading header, nothing we can do.
-      close(fd);
-      return;
+    if (status == co::HttpParser::Status::kError) {
+      static const char kBadRequest[] = "HTTP/1.0 400 Bad request\r\n"
+                                        "Content-length: 0\r\n"
+                                        "Connection: close\r\n\r\n";
+      SendToClient(c, fd, kBadRequest, sizeof(kBadRequest) - 1);
+      break;
     }
-    // Append to data buffer.
-    buffer += std::string(buf, n);
 
-    // A blank line terminates the read
-    if (buffer.find("\r\n\r\n") != std::string::npos) {
+    bool keep_alive = HandleRequest(c, fd, request);
+
+    // Take the request out of the buffer, leaving any that follow it.
+    buffer.Consume(request.HeaderLength());
+    request.Reset();
+    if (!keep_alive) {
       break;
     }
   }
 
-  std::vector<std::string> header;
-  std::map<std::string, std::string> http_headers;
-
-  // The buffer contains the HTTP header line and the HTTP headers.
-  ReadHeaders(buffer, header, http_headers);
-
-  // These are the indexes into the http_header for the fields.
-  const size_t kMethod = 0;
-  const size_t kFilename = 1;
-  const size_t kProtocol = 2;
-
-  // Make alises for the http header fields.
-  std::string &method = header[kMethod];
-  std::string &filename = header[kFilename];
-  std::string &protocol = header[kProtocol];
+  close(fd);
+}
 
-  char response[256];
+static bool AtConnectionLimit() {
+  return g_max_connections > 0 && g_connections >= g_max_connections;
+}
 
-  std::string hostname = "unknown";
-  auto it = http_headers.find("HOST");
-  if (it != http_headers.end()) {
-    hostname = it->second;
+// Turn away a connection we have no room for with a 503, without making a
+// coroutine for it.  The socket is new so there's room for the response
+// and it can be written without waiting.  Whatever the client has sent is
+// read first, because closing a socket with unread data resets it and
+// the client might not see the response.
+static void RejectConnection(int fd) {
+  static const char kUnavailable[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                     "Content-length: 0\r\n"
+                                     "Retry-After: 1\r\n"
+                                     "Connection: close\r\n\r\n";
+  char buffer[4096];
+  while (read(fd, buffer, sizeof(buffer)) > 0) {
   }
+  if (write(fd, kUnavailable, sizeof(kUnavailable) - 1) == -1) {
+    // Nothing more we can do for this client.
+  }
+  shutdown(fd, SHUT_WR);
+  close(fd);
+}
 
-  printf("%s: %s for %s from %s\n", c->Name().c_str(), method.c_str(),
-         filename.c_str(), hostname.c_str());
-
-  // Only support the GET method for now.
-
-  if (method == "GET") {
-    struct stat st;
-    int e = stat(filename.c_str(), &st);
-    if (e == -1) {
-      int n = snprintf(response, sizeof(response), "%s 404 Not Found\r\n\r\n",
-                       protocol.c_str());
-      SendToClient(c, fd, response, n);
+// Called by a connection's coroutine when it has finished with the
+// connection.  The waiters are only added while we are at the limit, so
+// this is just the decrement the rest of the time.
+static void ConnectionFinished(co::Coroutine *c) {
+  g_connections--;
+  if (g_num_room_waiters == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(g_room_lock);
+  for (RoomWaiter *waiter : g_room_waiters) {
+    if (waiter->scheduler == &c->Scheduler()) {
+      waiter->queue.NotifyAll();
     } else {
-      int file_fd = open(filename.c_str(), O_RDONLY);
-      if (file_fd == -1) {
-        int n = snprintf(response, sizeof(response), "%s 404 Not Found\r\n\r\n",
-                         protocol.c_str());
-        SendToClient(c, fd, response, n);
-      } else {
-        // Send the file back.
-        int n =
-            snprintf(response, sizeof(response),
-                     "%s 200 OK\r\nContent-type: text/html\r\nContent-length: "
-                     "%zd\r\n\r\n",
-                     protocol.c_str(), static_cast<size_t>(st.st_size));
-        SendToClient(c, fd, response, n);
-
-        for (;;) {
-          char buf[1024];
-          c->Wait(file_fd, POLLIN);
-          ssize_t n = read(file_fd, buf, sizeof(buf));
-          if (n == -1) {
-            perror("file read");
-            break;
-          }
-          if (n == 0) {
-            break;
-          }
-          SendToClient(c, fd, buf, n);
-        }
-        close(file_fd);
-      }
+      // The waiter lives as long as its listener, which is forever.
+      waiter->scheduler->Post([waiter] { waiter->queue.NotifyAll(); });
     }
-  } else {
-    // Invalid request method.
-    int n = snprintf(response, sizeof(response),
-                     "%s 400 Invalid request method\r\n\r\n", protocol.c_str());
-    SendToClient(c, fd, response, n);
   }
+}
 
-  close(fd);
+// Wait until there is room for another connection, woken when a
+// connection finishes.  The count is shared with the other threads, so
+// one of their listeners may have taken the room by the time we run, in
+// which case we wait again.  If no connection finishes in
+// kOverloadWaitNs, the connections queued for us are turned away so they
+// don't wait any longer, and we carry on waiting.
+static void WaitForRoom(co::Coroutine *c, int s,
+                        co::MultishotAcceptor *acceptor, RoomWaiter *waiter) {
+  if (!AtConnectionLimit()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(g_room_lock);
+    g_room_waiters.push_back(waiter);
+    g_num_room_waiters++;
+  }
+  // A connection that finished before we were added has made room, so
+  // check again before waiting.
+  while (AtConnectionLimit()) {
+    if (waiter->queue.Wait(c, kOverloadWaitNs)) {
+      continue;
+    }
+    for (;;) {
+      int fd = acceptor != nullptr ? acceptor->TryAccept()
+                                   : co::TryAccept(s, nullptr, nullptr);
+      if (fd == -1) {
+        break;
+      }
+      RejectConnection(fd);
+    }
+  }
+  std::lock_guard<std::mutex> lock(g_room_lock);
+  g_room_waiters.erase(
+      std::find(g_room_waiters.begin(), g_room_waiters.end(), waiter));
+  g_num_room_waiters--;
 }
 
 void Listener(co::Coroutine *c) {
@@ -248,61 +451,152 @@ void Listener(co::Coroutine *c) {
   }
   int val = 1;
   setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-  struct sockaddr_in addr = {.sin_family = AF_INET,
-                             .sin_port = htons(80),
-                             .sin_len = sizeof(int),
-                             .sin_addr.s_addr = INADDR_ANY};
+  // When running multiple threads, each thread has its own listening
+  // socket bound to the same port.  The kernel shares the incoming
+  // connections among them.
+  setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(80);
+  addr.sin_addr.s_addr = INADDR_ANY;
+#if defined(__APPLE__)
+  addr.sin_len = sizeof(addr);
+#endif
   int e = bind(s, (struct sockaddr *)&addr, sizeof(addr));
   if (e == -1) {
     perror("bind");
     close(s);
     return;
   }
-  listen(s, 10);
-
-  std::set<std::unique_ptr<co::Coroutine>> coroutines;
+  listen(s, g_backlog);
+  // Accept tries to accept before waiting, which mustn't block.
+  co::SetNonBlocking(s);
+
+  // The connection coroutines.  Each one goes back to the pool when its
+  // connection closes and is used again for a later one, so once the
+  // pool has warmed up accepting a connection allocates no memory.  With
+  // multiple threads the group's schedulers have pools of their own.
+  std::unique_ptr<co::CoroutinePool> pool;
+  if (g_group == nullptr) {
+    pool = std::make_unique<co::CoroutinePool>(c->Scheduler());
+  }
 
-  c->Scheduler().SetCompletionCallback([&coroutines](co::Coroutine *c) {
-    for (auto it = coroutines.begin(); it != coroutines.end(); it++) {
-      if (it->get() == c) {
-        coroutines.erase(it);
-        return;
-      }
-    }
-  });
+  // With io_uring a single multishot accept takes all the connections.
+  // The kernel doesn't give us the peer addresses that way, but the
+  // server doesn't use them.
+  std::unique_ptr<co::MultishotAcceptor> acceptor;
+  if (co::UringOf(c) != nullptr) {
+    acceptor = std::make_unique<co::MultishotAcceptor>(c, s);
+  }
 
   // Enter a loop accepting incoming connections and spawning coroutines
   // to handle each one.  All coroutines run "in parallel", cooperating with
   // each other.  No threading here.
+  //
+  // Accept only waits when there are no connections queued, so a burst of
+  // them is taken in one go, without going round the scheduler for each.
+  // At the connection limit we stop taking them, leaving them queued in
+  // the kernel, until a connection finishes.  (With a multishot accept
+  // the kernel carries on accepting and they queue in the acceptor
+  // instead.)
+  RoomWaiter waiter;
+  waiter.scheduler = &c->Scheduler();
   for (;;) {
-    // Wait for incoming connection.  This allows other coroutines to run
-    // while we are waiting.
-    c->Wait(s, POLLIN);
+    WaitForRoom(c, s, acceptor.get(), &waiter);
 
-    struct sockaddr_in sender;
+    // Accept an incoming connection, waiting if there isn't one.  This
+    // allows other coroutines to run while we are waiting.
+    struct sockaddr_in sender = {};
     socklen_t sender_len = sizeof(sender);
-    int fd = accept(s, (struct sockaddr *)&sender, &sender_len);
+    int fd;
+    if (acceptor != nullptr) {
+      fd = acceptor->Accept(c);
+      sender_len = 0;
+    } else {
+      fd = co::Accept(c, s, (struct sockaddr *)&sender, &sender_len);
+    }
     if (fd == -1) {
       perror("accept");
       continue;
     }
+    if (AtConnectionLimit()) {
+      // Another thread took the last of the room while we were waiting.
+      RejectConnection(fd);
+      continue;
+    }
 
-    // Make a coroutine to handle the connection.
-    coroutines.insert(std::make_unique<co::Coroutine>(
-        c->Scheduler(), [fd, sender, sender_len](co::Coroutine *c) {
-          Server(c, fd, sender, sender_len);
-        }));
+    // Make a coroutine to handle the connection.  With multiple threads
+    // it is spawned through the group so that an idle thread can take it
+    // if this one is busy.
+    g_connections++;
+    if (g_group != nullptr) {
+      g_group->Spawn([fd, sender, sender_len](co::Coroutine *c) {
+        Server(c, fd, sender, sender_len);
+        ConnectionFinished(c);
+      });
+      continue;
+    }
+    pool->Spawn([fd, sender, sender_len](co::Coroutine *c) {
+      Server(c, fd, sender, sender_len);
+      ConnectionFinished(c);
+    });
   }
 }
 
 int main(int argc, const char *argv[]) {
-  co::CoroutineScheduler scheduler;
+  int num_threads = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc && isdigit(argv[i + 1][0])) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc &&
+               isdigit(argv[i + 1][0])) {
+      g_cache_bytes = static_cast<size_t>(atoi(argv[++i])) << 20;
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc &&
+               isdigit(argv[i + 1][0])) {
+      g_backlog = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc &&
+               isdigit(argv[i + 1][0])) {
+      g_max_connections = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-u") == 0) {
+      g_poller_type = co::PollerType::kIoUring;
+    } else {
+      Usage();
+    }
+  }
 
-  g_scheduler = &scheduler; // For signal handler.
+  if (pipe(g_dump_pipe) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  co::SetNonBlocking(g_dump_pipe[0]);
+  co::SetNonBlocking(g_dump_pipe[1]);
   signal(SIGPIPE, SIG_IGN);
   signal(SIGQUIT, Signal);
 
+  if (num_threads > 1) {
+    // One scheduler per thread, each with its own listener.  Connections
+    // are usually handled in the thread that accepted them but may be
+    // stolen by an idle thread.
+    co::SchedulerGroup group(num_threads, g_poller_type);
+    g_group = &group;
+    group.Start([](co::CoroutineScheduler &scheduler, int index) {
+      // Accepting connections mustn't be held up by busy handlers.
+      scheduler.Spawn(Listener, "listener")->SetPriority(co::Priority::kHigh);
+      if (index == 0) {
+        scheduler.Spawn(Dumper, "dumper");
+      }
+    });
+    group.Join();
+    return 0;
+  }
+
+  co::CoroutineScheduler scheduler(g_poller_type);
+
   co::Coroutine listener(scheduler, Listener, "listener");
+  // Accepting connections mustn't be held up by busy handlers.
+  listener.SetPriority(co::Priority::kHigh);
+  co::Coroutine dumper(scheduler, Dumper, "dumper");
 
   // Run the main loop
   scheduler.Run();
@@ -0,0 +1,143 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef inline_function_h
+#define inline_function_h
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace co {
+
+template <typename Signature, size_t InlineSize = 48> class InlineFunction;
+
+// A callable wrapper like std::function, but with room inside it for a
+// callable of up to InlineSize bytes, so wrapping a lambda with a few
+// captures doesn't allocate memory.  Anything bigger (or that can't be
+// moved without throwing) is put on the heap as std::function would.
+//
+// It can only be moved, not copied, so it can hold lambdas that capture
+// move-only things like unique_ptrs.
+template <typename R, typename... Args, size_t InlineSize>
+class InlineFunction<R(Args...), InlineSize> {
+  static_assert(InlineSize >= sizeof(void *), "Too small to hold a pointer");
+
+public:
+  InlineFunction() = default;
+  InlineFunction(std::nullptr_t) {}
+
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, InlineFunction> &&
+                std::is_invocable_r_v<R, std::decay_t<F> &, Args...>>>
+  InlineFunction(F &&f) {
+    using Target = std::decay_t<F>;
+    if constexpr (kFitsInline<Target>) {
+      new (storage_) Target(std::forward<F>(f));
+      ops_ = &kInlineOps<Target>;
+    } else {
+      *reinterpret_cast<Target **>(storage_) = new Target(std::forward<F>(f));
+      ops_ = &kHeapOps<Target>;
+    }
+  }
+
+  InlineFunction(InlineFunction &&other) noexcept { MoveFrom(other); }
+
+  InlineFunction &operator=(InlineFunction &&other) noexcept {
+    if (this != &other) {
+      Reset();
+      MoveFrom(other);
+    }
+    return *this;
+  }
+
+  InlineFunction &operator=(std::nullptr_t) {
+    Reset();
+    return *this;
+  }
+
+  ~InlineFunction() { Reset(); }
+
+  R operator()(Args... args) {
+    return ops_->call(storage_, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+  bool operator==(std::nullptr_t) const { return ops_ == nullptr; }
+  bool operator!=(std::nullptr_t) const { return ops_ != nullptr; }
+
+  // True if the callable is held inside rather than on the heap.
+  bool IsInline() const { return ops_ != nullptr && ops_->is_inline; }
+
+private:
+  struct Ops {
+    R (*call)(void *storage, Args &&...args);
+    // Move the callable from one storage to another and destroy what's
+    // left behind.
+    void (*move)(void *from, void *to);
+    void (*destroy)(void *storage);
+    bool is_inline;
+  };
+
+  template <typename F>
+  static constexpr bool kFitsInline =
+      sizeof(F) <= InlineSize &&
+      alignof(F) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<F>;
+
+  template <typename F>
+  static R CallInline(void *storage, Args &&...args) {
+    return (*std::launder(reinterpret_cast<F *>(storage)))(
+        std::forward<Args>(args)...);
+  }
+  template <typename F> static void MoveInline(void *from, void *to) {
+    F *f = std::launder(reinterpret_cast<F *>(from));
+    new (to) F(std::move(*f));
+    f->~F();
+  }
+  template <typename F> static void DestroyInline(void *storage) {
+    std::launder(reinterpret_cast<F *>(storage))->~F();
+  }
+
+  template <typename F>
+  static R CallHeap(void *storage, Args &&...args) {
+    return (**reinterpret_cast<F **>(storage))(std::forward<Args>(args)...);
+  }
+  static void MoveHeap(void *from, void *to) {
+    *reinterpret_cast<void **>(to) = *reinterpret_cast<void **>(from);
+  }
+  template <typename F> static void DestroyHeap(void *storage) {
+    delete *reinterpret_cast<F **>(storage);
+  }
+
+  template <typename F>
+  static constexpr Ops kInlineOps = {&CallInline<F>, &MoveInline<F>,
+                                     &DestroyInline<F>, true};
+  template <typename F>
+  static constexpr Ops kHeapOps = {&CallHeap<F>, &MoveHeap, &DestroyHeap<F>,
+                                   false};
+
+  void MoveFrom(InlineFunction &other) {
+    if (other.ops_ != nullptr) {
+      other.ops_->move(other.storage_, storage_);
+      ops_ = other.ops_;
+      other.ops_ = nullptr;
+    }
+  }
+
+  void Reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char storage_[InlineSize];
+  const Ops *ops_ = nullptr;
+};
+
+} // namespace co
+#endif /* inline_function_h */
@@ -0,0 +1,99 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef intrusive_list_h
+#define intrusive_list_h
+
+#include <cstddef>
+
+namespace co {
+
+// The links for an object that can be held in an IntrusiveList.  An object
+// can be in more than one list at a time provided it has a ListLink for
+// each of them.
+template <typename T> struct ListLink {
+  T *prev = nullptr;
+  T *next = nullptr;
+};
+
+// A doubly linked list that uses links embedded in the objects it holds,
+// so adding and removing never allocates memory and removal of any
+// object is O(1).  The list does not own the objects.
+template <typename T, ListLink<T> T::*Link> class IntrusiveList {
+public:
+  IntrusiveList() = default;
+  IntrusiveList(const IntrusiveList &) = delete;
+  IntrusiveList &operator=(const IntrusiveList &) = delete;
+
+  bool IsEmpty() const { return head_ == nullptr; }
+  size_t Size() const { return size_; }
+
+  T *Front() const { return head_; }
+  T *Back() const { return tail_; }
+  static T *Next(const T *t) { return (t->*Link).next; }
+
+  // Is the object in this list?  Only valid if the object isn't in a
+  // different list using the same link.
+  bool Contains(const T *t) const {
+    return (t->*Link).prev != nullptr || head_ == t;
+  }
+
+  void PushBack(T *t) {
+    ListLink<T> &link = t->*Link;
+    link.prev = tail_;
+    link.next = nullptr;
+    if (tail_ == nullptr) {
+      head_ = t;
+    } else {
+      (tail_->*Link).next = t;
+    }
+    tail_ = t;
+    size_++;
+  }
+
+  void PushFront(T *t) {
+    ListLink<T> &link = t->*Link;
+    link.prev = nullptr;
+    link.next = head_;
+    if (head_ == nullptr) {
+      tail_ = t;
+    } else {
+      (head_->*Link).prev = t;
+    }
+    head_ = t;
+    size_++;
+  }
+
+  void Remove(T *t) {
+    ListLink<T> &link = t->*Link;
+    if (link.prev == nullptr) {
+      head_ = link.next;
+    } else {
+      (link.prev->*Link).next = link.next;
+    }
+    if (link.next == nullptr) {
+      tail_ = link.prev;
+    } else {
+      (link.next->*Link).prev = link.prev;
+    }
+    link.prev = link.next = nullptr;
+    size_--;
+  }
+
+  T *PopFront() {
+    T *t = head_;
+    if (t != nullptr) {
+      Remove(t);
+    }
+    return t;
+  }
+
+private:
+  T *head_ = nullptr;
+  T *tail_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace co
+#endif /* intrusive_list_h */
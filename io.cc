@@ -0,0 +1,622 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <memory_resource>
+
+#include "uring.h"
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+namespace co {
+
+bool SetNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    return false;
+  }
+  if ((flags & O_NONBLOCK) != 0) {
+    return true;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// Wait for an fd after a system call said it would block.  Returns false
+// (with errno set) on timeout.
+static bool WaitFor(Coroutine *c, int fd, short events, uint64_t timeout_ns) {
+  if (c->Wait(fd, events, timeout_ns) == -1) {
+    errno = ETIMEDOUT;
+    return false;
+  }
+  return true;
+}
+
+static bool WouldBlock(int e) { return e == EAGAIN || e == EWOULDBLOCK; }
+
+// When the scheduler uses io_uring, an operation that would block is given
+// to the ring instead of waiting for the fd and trying again.  These
+// return false if there's no ring, or if the kernel gave up on the
+// operation because the fd is non-blocking (older kernels do that),
+// and the caller should wait for the fd as usual.  Otherwise *result is
+// the result of the operation.
+#if defined(__linux__)
+static bool RingOp(Coroutine *c, uint8_t opcode, int fd, const void *addr,
+                   uint64_t len, uint64_t timeout_ns, ssize_t *result) {
+  if (UringOf(c) == nullptr) {
+    return false;
+  }
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uint64_t>(addr);
+  sqe.len = static_cast<uint32_t>(len);
+  // The fd's current position, for reads and writes.
+  sqe.off = static_cast<uint64_t>(-1);
+  *result = UringSubmit(c, sqe, timeout_ns);
+  return !(*result == -1 && (WouldBlock(errno) || errno == EINTR));
+}
+
+static bool RingRead(Coroutine *c, int fd, void *buffer, size_t length,
+                     uint64_t timeout_ns, ssize_t *result) {
+  return RingOp(c, IORING_OP_READ, fd, buffer, length, timeout_ns, result);
+}
+
+static bool RingWrite(Coroutine *c, int fd, const void *buffer,
+                      size_t length, uint64_t timeout_ns, ssize_t *result) {
+  return RingOp(c, IORING_OP_WRITE, fd, buffer, length, timeout_ns, result);
+}
+
+static bool RingWritev(Coroutine *c, int fd, const struct iovec *iov,
+                       int iovcnt, uint64_t timeout_ns, ssize_t *result) {
+  return RingOp(c, IORING_OP_WRITEV, fd, iov, static_cast<uint64_t>(iovcnt),
+                timeout_ns, result);
+}
+
+static bool RingAccept(Coroutine *c, int fd, struct sockaddr *addr,
+                       socklen_t *addrlen, uint64_t timeout_ns,
+                       ssize_t *result) {
+  if (UringOf(c) == nullptr) {
+    return false;
+  }
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_ACCEPT;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uint64_t>(addr);
+  sqe.addr2 = reinterpret_cast<uint64_t>(addrlen);
+  sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  *result = UringSubmit(c, sqe, timeout_ns);
+  return !(*result == -1 && (WouldBlock(errno) || errno == EINTR));
+}
+#else
+static bool RingRead(Coroutine *, int, void *, size_t, uint64_t, ssize_t *) {
+  return false;
+}
+
+static bool RingWrite(Coroutine *, int, const void *, size_t, uint64_t,
+                      ssize_t *) {
+  return false;
+}
+
+static bool RingWritev(Coroutine *, int, const struct iovec *, int, uint64_t,
+                       ssize_t *) {
+  return false;
+}
+
+static bool RingAccept(Coroutine *, int, struct sockaddr *, socklen_t *,
+                       uint64_t, ssize_t *) {
+  return false;
+}
+#endif
+
+ssize_t Read(Coroutine *c, int fd, void *buffer, size_t length,
+             uint64_t timeout_ns) {
+  for (;;) {
+    ssize_t n = ::read(fd, buffer, length);
+    if (n >= 0) {
+      return n;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (!WouldBlock(errno)) {
+      return -1;
+    }
+    if (RingRead(c, fd, buffer, length, timeout_ns, &n)) {
+      return n;
+    }
+    if (!WaitFor(c, fd, POLLIN, timeout_ns)) {
+      return -1;
+    }
+  }
+}
+
+ssize_t Write(Coroutine *c, int fd, const void *buffer, size_t length,
+              uint64_t timeout_ns) {
+  const char *p = static_cast<const char *>(buffer);
+  size_t remaining = length;
+  while (remaining > 0) {
+    ssize_t n = ::write(fd, p, remaining);
+    if (n > 0) {
+      p += n;
+      remaining -= static_cast<size_t>(n);
+      continue;
+    }
+    if (n == 0) {
+      // Nothing written and no error to say why.  Don't leave errno
+      // holding whatever it was before.
+      errno = EPIPE;
+      return -1;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (!WouldBlock(errno)) {
+      return -1;
+    }
+    if (RingWrite(c, fd, p, remaining, timeout_ns, &n)) {
+      if (n == 0) {
+        errno = EPIPE;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      p += n;
+      remaining -= static_cast<size_t>(n);
+    } else if (!WaitFor(c, fd, POLLOUT, timeout_ns)) {
+      return -1;
+    }
+  }
+  return static_cast<ssize_t>(length);
+}
+
+int TryAccept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+  for (;;) {
+#if defined(__linux__)
+    int s = ::accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int s = ::accept(fd, addr, addrlen);
+    if (s != -1) {
+      fcntl(s, F_SETFD, FD_CLOEXEC);
+      SetNonBlocking(s);
+    }
+#endif
+    // A connection that was reset before we got to it isn't an error
+    // for the listener.
+    if (s == -1 && (errno == EINTR || errno == ECONNABORTED)) {
+      continue;
+    }
+    return s;
+  }
+}
+
+int Accept(Coroutine *c, int fd, struct sockaddr *addr, socklen_t *addrlen,
+           uint64_t timeout_ns) {
+  for (;;) {
+    int s = TryAccept(fd, addr, addrlen);
+    if (s != -1) {
+      return s;
+    }
+    if (!WouldBlock(errno)) {
+      return -1;
+    }
+    ssize_t r;
+    if (RingAccept(c, fd, addr, addrlen, timeout_ns, &r)) {
+      if (r == -1 && errno == ECONNABORTED) {
+        continue;
+      }
+      return static_cast<int>(r);
+    }
+    if (!WaitFor(c, fd, POLLIN, timeout_ns)) {
+      return -1;
+    }
+  }
+}
+
+int Connect(Coroutine *c, int fd, const struct sockaddr *addr,
+            socklen_t addrlen, uint64_t timeout_ns) {
+  if (!SetNonBlocking(fd)) {
+    return -1;
+  }
+  if (::connect(fd, addr, addrlen) == 0) {
+    return 0;
+  }
+  if (errno != EINPROGRESS && errno != EINTR) {
+    return -1;
+  }
+  // The connection completes in the background.  The socket becomes
+  // writable when it's done, successfully or not.
+  if (!WaitFor(c, fd, POLLOUT, timeout_ns)) {
+    return -1;
+  }
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+    return -1;
+  }
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+ssize_t Writev(Coroutine *c, int fd, struct iovec *iov, int iovcnt,
+               uint64_t timeout_ns) {
+  size_t total = 0;
+  while (iovcnt > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+      continue;
+    }
+    ssize_t n = ::writev(fd, iov, iovcnt);
+    if (n == 0) {
+      // As for Write.  Going round again could loop forever.
+      errno = EPIPE;
+      return -1;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (!WouldBlock(errno)) {
+        return -1;
+      }
+      if (!RingWritev(c, fd, iov, iovcnt, timeout_ns, &n)) {
+        if (!WaitFor(c, fd, POLLOUT, timeout_ns)) {
+          return -1;
+        }
+        continue;
+      }
+      if (n == 0) {
+        errno = EPIPE;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+    }
+    total += static_cast<size_t>(n);
+    // Skip the iovecs that have been completely written and adjust the
+    // first one that hasn't.
+    size_t written = static_cast<size_t>(n);
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+  return static_cast<ssize_t>(total);
+}
+
+// Files up to this size are read into memory and sent with the header in
+// one writev, which is cheaper than a separate sendfile.
+static constexpr size_t kInlineFileSize = 16 * 1024;
+
+// Size of the buffer used when the data has to be copied.
+static constexpr size_t kCopyBufferSize = 16 * 1024;
+
+// A buffer for data being copied, which is too big for a coroutine's
+// small stack.  It comes from the coroutine's arena and is given back
+// when it goes out of scope.  Being the arena's most recent allocation,
+// its space is reused by the next one, so copying doesn't allocate any
+// memory once the arena has a block.
+class CopyBuffer {
+public:
+  CopyBuffer(Coroutine *c, size_t size)
+      : arena_(c->Arena()), size_(size),
+        data_(static_cast<char *>(arena_->allocate(size))) {}
+  CopyBuffer(const CopyBuffer &) = delete;
+  CopyBuffer &operator=(const CopyBuffer &) = delete;
+  ~CopyBuffer() { arena_->deallocate(data_, size_); }
+
+  char *Data() const { return data_; }
+
+private:
+  std::pmr::memory_resource *arena_;
+  size_t size_;
+  char *data_;
+};
+
+// Copy part of a file through a buffer, for when the kernel can't do it.
+static ssize_t CopyFile(Coroutine *c, int out_fd, int in_fd, off_t offset,
+                        size_t length, uint64_t timeout_ns) {
+  CopyBuffer buffer(c, kCopyBufferSize);
+  size_t sent = 0;
+  while (sent < length) {
+    size_t want = length - sent;
+    if (want > kCopyBufferSize) {
+      want = kCopyBufferSize;
+    }
+    ssize_t n =
+        ::pread(in_fd, buffer.Data(), want, offset + static_cast<off_t>(sent));
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0 ? static_cast<ssize_t>(sent) : -1;
+    }
+    if (Write(c, out_fd, buffer.Data(), static_cast<size_t>(n), timeout_ns) ==
+        -1) {
+      return -1;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  return static_cast<ssize_t>(sent);
+}
+
+#if defined(__linux__)
+// Send a header on a socket, telling the kernel that more data follows so
+// that the header goes in the same packet as the start of the file.
+static bool SendHeader(Coroutine *c, int fd, const void *header,
+                       size_t length, uint64_t timeout_ns) {
+  const char *p = static_cast<const char *>(header);
+  while (length > 0) {
+    ssize_t n = ::send(fd, p, length, MSG_MORE);
+    if (n > 0) {
+      p += n;
+      length -= static_cast<size_t>(n);
+      continue;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0) {
+      errno = EPIPE;
+      return false;
+    }
+    if (errno == ENOTSOCK) {
+      return Write(c, fd, p, length, timeout_ns) != -1;
+    }
+    if (!WouldBlock(errno) || !WaitFor(c, fd, POLLOUT, timeout_ns)) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+ssize_t SendFile(Coroutine *c, int out_fd, int in_fd, off_t offset,
+                 size_t length, const void *header, size_t header_length,
+                 uint64_t timeout_ns) {
+  if (header_length > 0 && length <= kInlineFileSize) {
+    // Small file.  Send the header and the whole file in one go.
+    CopyBuffer buffer(c, kInlineFileSize);
+    size_t got = 0;
+    while (got < length) {
+      ssize_t n = ::pread(in_fd, buffer.Data() + got, length - got,
+                          offset + static_cast<off_t>(got));
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        return -1;
+      }
+      if (n == 0) {
+        break;
+      }
+      got += static_cast<size_t>(n);
+    }
+    struct iovec iov[2] = {{const_cast<void *>(header), header_length},
+                           {buffer.Data(), got}};
+    if (Writev(c, out_fd, iov, 2, timeout_ns) == -1) {
+      return -1;
+    }
+    return static_cast<ssize_t>(got);
+  }
+
+#if defined(__linux__)
+  if (header_length > 0 &&
+      !SendHeader(c, out_fd, header, header_length, timeout_ns)) {
+    return -1;
+  }
+  size_t sent = 0;
+  off_t off = offset;
+  while (sent < length) {
+    ssize_t n = ::sendfile(out_fd, in_fd, &off, length - sent);
+    if (n > 0) {
+      sent += static_cast<size_t>(n);
+      continue;
+    }
+    if (n == 0) {
+      // File is shorter than we were told.
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EINVAL || errno == ENOSYS) {
+      // The fds don't support sendfile.
+      ssize_t r = CopyFile(c, out_fd, in_fd, off, length - sent, timeout_ns);
+      return r == -1 ? -1 : static_cast<ssize_t>(sent) + r;
+    }
+    if (!WouldBlock(errno) || !WaitFor(c, out_fd, POLLOUT, timeout_ns)) {
+      return -1;
+    }
+  }
+  return static_cast<ssize_t>(sent);
+
+#elif defined(__APPLE__)
+  // MacOS sendfile sends the header itself and tells us how much it sent
+  // even when it would block.
+  struct iovec header_iov = {const_cast<void *>(header), header_length};
+  struct sf_hdtr hdtr = {&header_iov, 1, nullptr, 0};
+  size_t sent = 0;
+  size_t header_left = header_length;
+  while (sent < length) {
+    off_t len = static_cast<off_t>(length - sent);
+    int r = ::sendfile(in_fd, out_fd, offset + static_cast<off_t>(sent), &len,
+                       header_left > 0 ? &hdtr : nullptr, 0);
+    size_t n = static_cast<size_t>(len);
+    if (header_left > 0) {
+      size_t h = n < header_left ? n : header_left;
+      header_iov.iov_base = static_cast<char *>(header_iov.iov_base) + h;
+      header_iov.iov_len -= h;
+      header_left -= h;
+      n -= h;
+    }
+    sent += n;
+    if (r == 0) {
+      if (len == 0) {
+        // End of file.
+        break;
+      }
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == ENOTSOCK || errno == EOPNOTSUPP || errno == EINVAL) {
+      if (header_left > 0 &&
+          Write(c, out_fd, header_iov.iov_base, header_left, timeout_ns) ==
+              -1) {
+        return -1;
+      }
+      ssize_t r = CopyFile(c, out_fd, in_fd, offset + static_cast<off_t>(sent),
+                           length - sent, timeout_ns);
+      return r == -1 ? -1 : static_cast<ssize_t>(sent) + r;
+    }
+    if (!WouldBlock(errno) || !WaitFor(c, out_fd, POLLOUT, timeout_ns)) {
+      return -1;
+    }
+  }
+  return static_cast<ssize_t>(sent);
+
+#else
+  if (header_length > 0 &&
+      Write(c, out_fd, header, header_length, timeout_ns) == -1) {
+    return -1;
+  }
+  return CopyFile(c, out_fd, in_fd, offset, length, timeout_ns);
+#endif
+}
+
+// Move data through a buffer, for when splice can't be used.
+static ssize_t CopyStream(Coroutine *c, int out_fd, int in_fd, size_t length,
+                          uint64_t timeout_ns) {
+  CopyBuffer buffer(c, kCopyBufferSize);
+  size_t moved = 0;
+  while (moved < length) {
+    size_t want = length - moved;
+    if (want > kCopyBufferSize) {
+      want = kCopyBufferSize;
+    }
+    ssize_t n = Read(c, in_fd, buffer.Data(), want, timeout_ns);
+    if (n <= 0) {
+      return n == 0 ? static_cast<ssize_t>(moved) : -1;
+    }
+    if (Write(c, out_fd, buffer.Data(), static_cast<size_t>(n), timeout_ns) ==
+        -1) {
+      return -1;
+    }
+    moved += static_cast<size_t>(n);
+  }
+  return static_cast<ssize_t>(moved);
+}
+
+#if defined(__linux__)
+static uint64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Wait until both sides of a splice that would block are ready.  A splice
+// doesn't say which side it was, so a poll that doesn't wait finds out
+// and we wait only for the side that isn't ready, without going through
+// the scheduler for one that is.  One deadline covers all the waiting.
+static bool WaitForSplice(Coroutine *c, int out_fd, int in_fd,
+                          uint64_t timeout_ns) {
+  uint64_t deadline = timeout_ns > 0 ? Now() + timeout_ns : 0;
+  bool waited = false;
+  for (;;) {
+    struct pollfd fds[2] = {{in_fd, POLLIN, 0}, {out_fd, POLLOUT, 0}};
+    if (::poll(fds, 2, 0) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    const struct pollfd *blocked = nullptr;
+    if (fds[0].revents == 0) {
+      blocked = &fds[0];
+    } else if (fds[1].revents == 0) {
+      blocked = &fds[1];
+    }
+    if (blocked == nullptr) {
+      if (!waited) {
+        // Both are ready but the splice would still block (there's room
+        // in the pipe, but not enough, say).  Let the others run rather
+        // than spin.
+        c->Yield();
+      }
+      return true;
+    }
+    uint64_t remaining = 0;
+    if (deadline != 0) {
+      uint64_t now = Now();
+      if (now >= deadline) {
+        errno = ETIMEDOUT;
+        return false;
+      }
+      remaining = deadline - now;
+    }
+    if (!WaitFor(c, blocked->fd, blocked->events, remaining)) {
+      return false;
+    }
+    waited = true;
+  }
+}
+#endif
+
+ssize_t Splice(Coroutine *c, int out_fd, int in_fd, size_t length,
+               uint64_t timeout_ns) {
+#if defined(__linux__)
+  size_t moved = 0;
+  while (moved < length) {
+    ssize_t n = ::splice(in_fd, nullptr, out_fd, nullptr, length - moved,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      moved += static_cast<size_t>(n);
+      continue;
+    }
+    if (n == 0) {
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EINVAL && moved == 0) {
+      // Neither fd is a pipe.
+      return CopyStream(c, out_fd, in_fd, length, timeout_ns);
+    }
+    if (!WouldBlock(errno)) {
+      return -1;
+    }
+    if (!WaitForSplice(c, out_fd, in_fd, timeout_ns)) {
+      return -1;
+    }
+  }
+  return static_cast<ssize_t>(moved);
+#else
+  return CopyStream(c, out_fd, in_fd, length, timeout_ns);
+#endif
+}
+
+} // namespace co
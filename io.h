@@ -0,0 +1,89 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef io_h
+#define io_h
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "coroutine.h"
+
+namespace co {
+
+// I/O functions for coroutines.  Each one tries the system call first and
+// only waits for the fd if the call would block, so a coroutine whose data
+// is already in the kernel doesn't switch at all.  They rely on the fd
+// being non-blocking: fds returned by Accept and fds passed to Connect
+// are made non-blocking, and SetNonBlocking does it for any other fd.
+// When the scheduler uses io_uring, Read, Write, Writev and Accept give an
+// operation that would block to the ring instead of waiting for the fd
+// (see uring.h).
+//
+// The timeout is optional and if greater than zero specifies a
+// nanosecond timeout for each wait.  On a timeout the functions return
+// -1 with errno set to ETIMEDOUT.  Other errors return -1 with errno set
+// by the system call.
+
+// Set O_NONBLOCK on an fd.  Returns false on error.
+bool SetNonBlocking(int fd);
+
+// Read up to length bytes.  Returns the number of bytes read, 0 at end of
+// file, or -1 on error.
+ssize_t Read(Coroutine *c, int fd, void *buffer, size_t length,
+             uint64_t timeout_ns = 0);
+
+// Write all length bytes, waiting as often as necessary.  Returns length,
+// or -1 on error.  If an error occurs after some of the data has been
+// written, there's no way to know how much was written.  A write that
+// makes no progress without saying why fails with EPIPE.
+ssize_t Write(Coroutine *c, int fd, const void *buffer, size_t length,
+              uint64_t timeout_ns = 0);
+
+// Accept a connection on a non-blocking listening socket.  Returns the
+// new fd, which is non-blocking and close-on-exec, or -1 on error.
+int Accept(Coroutine *c, int fd, struct sockaddr *addr, socklen_t *addrlen,
+           uint64_t timeout_ns = 0);
+
+// Accept a connection if there's one waiting, without waiting for one.
+// Returns the new fd, as for Accept, or -1 with errno set to EAGAIN or
+// EWOULDBLOCK if there isn't one, or another errno on error.
+int TryAccept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+// Connect a socket, making it non-blocking first.  Returns 0 when
+// connected, or -1 on error.
+int Connect(Coroutine *c, int fd, const struct sockaddr *addr,
+            socklen_t addrlen, uint64_t timeout_ns = 0);
+
+// Write all the data described by an iovec array in as few system calls
+// as possible.  The iovec array is modified to keep track of partial
+// writes.  Returns the total number of bytes written, or -1 on error.
+ssize_t Writev(Coroutine *c, int fd, struct iovec *iov, int iovcnt,
+               uint64_t timeout_ns = 0);
+
+// Send length bytes of the file in_fd, starting at offset, to out_fd,
+// without copying the data through user space where the operating
+// system allows it (sendfile on Linux and MacOS).  An optional header is
+// sent first, in the same packet as the start of the file.  Small files
+// are sent with the header in a single writev.  Returns the number of
+// bytes of the file sent, which is less than length only if the file is
+// shorter, or -1 on error.
+ssize_t SendFile(Coroutine *c, int out_fd, int in_fd, off_t offset,
+                 size_t length, const void *header = nullptr,
+                 size_t header_length = 0, uint64_t timeout_ns = 0);
+
+// Move up to length bytes from in_fd to out_fd, waiting for either side
+// as necessary.  On Linux, when one of them is a pipe, the data is moved
+// by splice within the kernel.  Otherwise it is read and written through
+// a buffer.  Returns the number of bytes moved, which is less than length
+// only at end of file, or -1 on error.
+ssize_t Splice(Coroutine *c, int out_fd, int in_fd, size_t length,
+               uint64_t timeout_ns = 0);
+
+} // namespace co
+#endif /* io_h */
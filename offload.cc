@@ -0,0 +1,76 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "offload.h"
+
+namespace co {
+
+OffloadPool::OffloadPool(int num_threads) {
+  for (int i = 0; i < num_threads; i++) {
+    threads_.emplace_back([this]() { Worker(); });
+  }
+}
+
+OffloadPool::~OffloadPool() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+OffloadPool &OffloadPool::Default() {
+  static OffloadPool pool;
+  return pool;
+}
+
+void OffloadPool::Run(std::function<void()> function) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    work_.push_back(std::move(function));
+  }
+  cond_.notify_one();
+}
+
+void OffloadPool::Worker() {
+  std::unique_lock<std::mutex> lock(lock_);
+  for (;;) {
+    cond_.wait(lock, [this]() { return stopping_ || !work_.empty(); });
+    // Finish the work that's been queued before stopping, as there are
+    // coroutines waiting for it.
+    if (work_.empty()) {
+      return;
+    }
+    std::function<void()> function = std::move(work_.front());
+    work_.pop_front();
+    lock.unlock();
+    function();
+    lock.lock();
+  }
+}
+
+void OffloadNonTemplate(Coroutine *c, OffloadPool &pool,
+                        const std::function<void()> &function) {
+  // The done flag and the queue are only touched in the scheduler's
+  // thread: the pool thread posts the wakeup to the scheduler, which sees
+  // it when its interrupt fd fires.
+  CoroutineScheduler &scheduler = c->Scheduler();
+  WaitQueue finished;
+  bool done = false;
+  pool.Run([&scheduler, &function, &finished, &done]() {
+    function();
+    scheduler.Post([&finished, &done]() {
+      done = true;
+      finished.NotifyOne();
+    });
+  });
+  while (!done) {
+    finished.Wait(c);
+  }
+}
+
+} // namespace co
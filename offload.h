@@ -0,0 +1,103 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef offload_h
+#define offload_h
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "coroutine.h"
+
+namespace co {
+
+// A small pool of threads for work that would block a scheduler: system
+// calls on regular files (which are always "ready" so waiting for them
+// does nothing), name lookups and anything CPU heavy.  Use it through
+// Offload.
+class OffloadPool {
+public:
+  static constexpr int kDefaultThreads = 4;
+
+  explicit OffloadPool(int num_threads = kDefaultThreads);
+
+  // Waits for the work that has been given to the pool to finish.
+  ~OffloadPool();
+  OffloadPool(const OffloadPool &) = delete;
+  OffloadPool &operator=(const OffloadPool &) = delete;
+
+  // The pool used by Offload unless it's given another.  It's made the
+  // first time it's used.
+  static OffloadPool &Default();
+
+  // Call a function in one of the pool's threads.
+  void Run(std::function<void()> function);
+
+  int Size() const { return static_cast<int>(threads_.size()); }
+
+private:
+  void Worker();
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> work_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// Call function(), which must be callable with no arguments, in a thread
+// of the offload pool and suspend the coroutine until it returns.  The
+// rest of the coroutines in the scheduler carry on running meanwhile.
+// The function's result is returned, and an exception it throws is
+// rethrown in the coroutine.
+//
+// The function runs in another thread so it mustn't touch anything that
+// belongs to the scheduler, or to other coroutines, without locking.  It
+// can use whatever is on the coroutine's stack, as the coroutine isn't
+// going anywhere until it's done.
+void OffloadNonTemplate(Coroutine *c, OffloadPool &pool,
+                        const std::function<void()> &function);
+
+template <typename F>
+std::invoke_result_t<F &> Offload(Coroutine *c, F &&function,
+                                  OffloadPool &pool = OffloadPool::Default()) {
+  using R = std::invoke_result_t<F &>;
+  std::exception_ptr exception;
+  if constexpr (std::is_void_v<R>) {
+    OffloadNonTemplate(c, pool, [&function, &exception]() {
+      try {
+        function();
+      } catch (...) {
+        exception = std::current_exception();
+      }
+    });
+    if (exception != nullptr) {
+      std::rethrow_exception(exception);
+    }
+  } else {
+    std::optional<R> result;
+    OffloadNonTemplate(c, pool, [&function, &result, &exception]() {
+      try {
+        result.emplace(function());
+      } catch (...) {
+        exception = std::current_exception();
+      }
+    });
+    if (exception != nullptr) {
+      std::rethrow_exception(exception);
+    }
+    return std::move(*result);
+  }
+}
+
+} // namespace co
+#endif /* offload_h */
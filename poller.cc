@@ -0,0 +1,514 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "poller.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if defined(__APPLE__)
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#include "uring.h"
+
+#else
+#error "Unknown operating system"
+#endif
+
+namespace co {
+
+// Events that are always reported, whether they were asked for or not.
+static constexpr short kAlwaysReported = POLLERR | POLLHUP | POLLNVAL;
+
+static struct timespec ToTimespec(int64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+  ts.tv_nsec = static_cast<long>(ns % 1000000000);
+  return ts;
+}
+
+#if defined(__APPLE__)
+// For poll, which only takes milliseconds.  Rounded up so that we don't
+// wake before the timer is due and have to poll again.
+static int ToMilliseconds(int64_t ns) {
+  if (ns < 0) {
+    return -1;
+  }
+  int64_t ms = (ns + 999999) / 1000000;
+  return ms > INT32_MAX ? INT32_MAX : static_cast<int>(ms);
+}
+#endif
+
+// Maximum number of events we will take from the kernel in one go.  If
+// there are more, the kernel will give them to us on the next poll.
+static constexpr int kMaxKernelEvents = 256;
+
+Poller::FdState &Poller::GetFdState(int fd) {
+  if (static_cast<size_t>(fd) >= fds_.size()) {
+    fds_.resize(static_cast<size_t>(fd) + 1);
+  }
+  return fds_[fd];
+}
+
+void Poller::SetEvents(int fd, FdState &state, short events) {
+  if (events == state.events) {
+    return;
+  }
+  if (state.always_ready) {
+    if (events == 0) {
+      state.always_ready = false;
+      always_ready_.erase(
+          std::find(always_ready_.begin(), always_ready_.end(), fd));
+    }
+  } else if (!Update(fd, state.events, events)) {
+    // The kernel won't wait for this fd.  Just like ::poll, we treat
+    // it as being ready to go all the time.
+    state.always_ready = true;
+    always_ready_.push_back(fd);
+  }
+  state.events = events;
+}
+
+void Poller::Add(Coroutine *c, const struct pollfd &fd) {
+  if (fd.fd < 0) {
+    return;
+  }
+  FdState &state = GetFdState(fd.fd);
+  state.waiters.push_back({c, fd.events});
+  SetEvents(fd.fd, state, state.events | fd.events);
+}
+
+void Poller::Remove(Coroutine *c, const struct pollfd &fd) {
+  if (fd.fd < 0 || static_cast<size_t>(fd.fd) >= fds_.size()) {
+    return;
+  }
+  FdState &state = fds_[fd.fd];
+  short events = 0;
+  bool removed = false;
+  for (size_t i = 0; i < state.waiters.size();) {
+    Waiter &w = state.waiters[i];
+    if (!removed && w.co == c && w.events == fd.events) {
+      // Order of waiters doesn't matter.
+      w = state.waiters.back();
+      state.waiters.pop_back();
+      removed = true;
+      continue;
+    }
+    events |= w.events;
+    i++;
+  }
+  SetEvents(fd.fd, state, events);
+}
+
+void Poller::Ready(int fd, short revents) {
+  if (fd < 0 || static_cast<size_t>(fd) >= fds_.size()) {
+    return;
+  }
+  for (auto &w : fds_[fd].waiters) {
+    if ((revents & (w.events | kAlwaysReported)) != 0) {
+      events_->emplace_back(w.co, fd);
+    }
+  }
+}
+
+int Poller::Poll(std::vector<PollEvent> &events, int64_t timeout_ns) {
+  size_t start = events.size();
+  if (!always_ready_.empty()) {
+    timeout_ns = 0;
+  }
+  events_ = &events;
+  int n = KernelPoll(timeout_ns);
+  if (n >= 0) {
+    for (int fd : always_ready_) {
+      Ready(fd, fds_[fd].events);
+    }
+  }
+  events_ = nullptr;
+  if (n < 0) {
+    return -1;
+  }
+  return static_cast<int>(events.size() - start);
+}
+
+bool Poller::PrepareWait() {
+  Submit();
+  return always_ready_.empty();
+}
+
+// The portable fallback.  Keeps a persistent pollfd array with one entry
+// per registered fd, updated as waits come and go.
+class PollPoller : public Poller {
+public:
+  PollerType Type() const override { return PollerType::kPoll; }
+
+protected:
+  bool Update(int fd, short old_events, short new_events) override {
+    if (static_cast<size_t>(fd) >= index_.size()) {
+      index_.resize(static_cast<size_t>(fd) + 1, -1);
+    }
+    if (old_events == 0) {
+      index_[fd] = static_cast<int>(pollfds_.size());
+      pollfds_.push_back({.fd = fd, .events = new_events});
+    } else if (new_events == 0) {
+      // Move the last entry into the hole.
+      int i = index_[fd];
+      pollfds_[i] = pollfds_.back();
+      index_[pollfds_[i].fd] = i;
+      pollfds_.pop_back();
+      index_[fd] = -1;
+    } else {
+      pollfds_[index_[fd]].events = new_events;
+    }
+    return true;
+  }
+
+  int KernelPoll(int64_t timeout_ns) override {
+#if defined(__linux__)
+    struct timespec ts = ToTimespec(timeout_ns);
+    int num_ready = ::ppoll(pollfds_.data(), pollfds_.size(),
+                            timeout_ns < 0 ? nullptr : &ts, nullptr);
+#else
+    int num_ready =
+        ::poll(pollfds_.data(), pollfds_.size(), ToMilliseconds(timeout_ns));
+#endif
+    if (num_ready <= 0) {
+      return num_ready;
+    }
+    for (size_t i = 0; i < pollfds_.size() && num_ready > 0; i++) {
+      struct pollfd &pfd = pollfds_[i];
+      if (pfd.revents != 0) {
+        num_ready--;
+        Ready(pfd.fd, pfd.revents);
+      }
+    }
+    return 0;
+  }
+
+private:
+  std::vector<struct pollfd> pollfds_;
+  std::vector<int> index_; // Index into pollfds_ for each fd.
+};
+
+#if defined(__linux__)
+// Linux epoll.  The POLL* and EPOLL* event bits have the same values so
+// there is no need to translate between them.
+class EpollPoller : public Poller {
+public:
+  EpollPoller() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+  ~EpollPoller() override {
+    if (epoll_fd_ != -1) {
+      close(epoll_fd_);
+    }
+    if (timer_fd_ != -1) {
+      close(timer_fd_);
+    }
+  }
+
+  bool Valid() const { return epoll_fd_ != -1; }
+  PollerType Type() const override { return PollerType::kEpoll; }
+  int Fd() const override { return epoll_fd_; }
+
+protected:
+  bool Update(int fd, short old_events, short new_events) override {
+    struct epoll_event e = {.events = static_cast<uint32_t>(new_events)};
+    e.data.fd = fd;
+    int op = old_events == 0   ? EPOLL_CTL_ADD
+             : new_events == 0 ? EPOLL_CTL_DEL
+                               : EPOLL_CTL_MOD;
+    int r = epoll_ctl(epoll_fd_, op, fd, &e);
+    // EPERM means that the fd doesn't support polling (a regular file).
+    // Any other error (like the fd being closed before the wait is
+    // over) is ignored.
+    return !(r == -1 && op == EPOLL_CTL_ADD && errno == EPERM);
+  }
+
+  int KernelPoll(int64_t timeout_ns) override {
+    struct epoll_event events[kMaxKernelEvents];
+    int n = Wait(events, timeout_ns);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == timer_fd_) {
+        uint64_t expirations;
+        if (read(timer_fd_, &expirations, sizeof(expirations)) == -1) {
+          // It's only there to wake us up.
+        }
+        continue;
+      }
+      Ready(events[i].data.fd, static_cast<short>(events[i].events));
+    }
+    return n < 0 ? -1 : 0;
+  }
+
+private:
+  // epoll_pwait2 (Linux 5.11) takes a timespec.  Before that, epoll_wait
+  // only takes milliseconds, so the timeout is rounded down to a whole
+  // number of them and anything left under a millisecond is waited for
+  // with a timerfd.  The timerfd is only armed for that last part, so
+  // there's no extra system call for longer timeouts.
+  int Wait(struct epoll_event *events, int64_t timeout_ns) {
+#if defined(SYS_epoll_pwait2)
+    if (have_pwait2_) {
+      struct timespec ts = ToTimespec(timeout_ns);
+      int n = static_cast<int>(
+          syscall(SYS_epoll_pwait2, epoll_fd_, events, kMaxKernelEvents,
+                  timeout_ns < 0 ? nullptr : &ts, nullptr, 0));
+      if (n != -1 || errno != ENOSYS) {
+        return n;
+      }
+      have_pwait2_ = false;
+    }
+#endif
+    int timeout_ms = -1;
+    if (timeout_ns >= 1000000) {
+      int64_t ms = timeout_ns / 1000000;
+      timeout_ms = ms > INT32_MAX ? INT32_MAX : static_cast<int>(ms);
+    } else if (timeout_ns == 0) {
+      timeout_ms = 0;
+    } else if (timeout_ns > 0 && !ArmTimer(timeout_ns)) {
+      timeout_ms = 1;
+    }
+    return epoll_wait(epoll_fd_, events, kMaxKernelEvents, timeout_ms);
+  }
+
+  // Make the timerfd go off in timeout_ns.  Returns false if there's no
+  // timerfd.
+  bool ArmTimer(int64_t timeout_ns) {
+    if (timer_fd_ == -1) {
+      timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (timer_fd_ == -1) {
+        return false;
+      }
+      struct epoll_event e = {.events = EPOLLIN};
+      e.data.fd = timer_fd_;
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &e);
+    }
+    struct itimerspec spec = {};
+    spec.it_value = ToTimespec(timeout_ns);
+    return timerfd_settime(timer_fd_, 0, &spec, nullptr) == 0;
+  }
+
+  int epoll_fd_;
+  int timer_fd_ = -1;
+  bool have_pwait2_ = true;
+};
+#endif
+
+#if defined(__linux__)
+// Waits for fds with io_uring polls.  A poll in io_uring is one-shot, so
+// each time one fires it is armed again, before the next wait, if the fd is
+// still wanted.  Arming a poll checks the fd straight away so the events
+// stay level triggered.  The same wait picks up the completions of the I/O
+// operations that coroutines have submitted to the ring.
+class UringPoller : public Poller {
+public:
+  explicit UringPoller(std::unique_ptr<IoUring> ring)
+      : ring_(std::move(ring)) {}
+
+  PollerType Type() const override { return PollerType::kIoUring; }
+  IoUring *Uring() override { return ring_.get(); }
+  int Fd() const override { return ring_->Fd(); }
+
+protected:
+  bool Update(int fd, short old_events, short new_events) override {
+    if (static_cast<size_t>(fd) >= polls_.size()) {
+      polls_.resize(static_cast<size_t>(fd) + 1);
+    }
+    FdPoll &p = polls_[fd];
+    if (p.armed) {
+      struct io_uring_sqe *sqe = ring_->GetSqe();
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->addr = UserData(fd, p.generation);
+      p.armed = false;
+    }
+    p.events = new_events;
+    if (new_events != 0) {
+      Arm(fd, p);
+    }
+    return true;
+  }
+
+  int KernelPoll(int64_t timeout_ns) override {
+    Rearm();
+    if (ring_->Enter(1, timeout_ns) == -1) {
+      return -1;
+    }
+    ring_->Reap([this](const struct io_uring_cqe &cqe) {
+      uint64_t data = cqe.user_data;
+      if (data == 0) {
+        return;
+      }
+      if ((data & 1) == 0) {
+        reinterpret_cast<UringOp *>(data)->Complete(cqe.res, cqe.flags);
+        return;
+      }
+      int fd = static_cast<int>(data >> 32);
+      FdPoll &p = polls_[fd];
+      if (!p.armed || data != UserData(fd, p.generation)) {
+        // A poll that has been removed.
+        return;
+      }
+      p.armed = false;
+      rearm_.push_back(fd);
+      Ready(fd, cqe.res < 0 ? POLLERR : static_cast<short>(cqe.res));
+    });
+    return 0;
+  }
+
+  // The ring's fd only becomes readable for completions of what has been
+  // submitted, so the polls and the operations the coroutines have queued
+  // have to go to the kernel before another loop waits for it.
+  void Submit() override {
+    Rearm();
+    ring_->Enter(0, 0);
+  }
+
+private:
+  struct FdPoll {
+    short events = 0;
+    bool armed = false;
+    // Tells a poll's completion from that of an earlier one for the fd.
+    uint32_t generation = 0;
+  };
+
+  // Polls are told apart from operations by the bottom bit.
+  static uint64_t UserData(int fd, uint32_t generation) {
+    return (static_cast<uint64_t>(fd) << 32) | (generation << 1) | 1;
+  }
+
+  // Arm the polls that have fired, if their fds are still wanted.
+  void Rearm() {
+    for (int fd : rearm_) {
+      FdPoll &p = polls_[fd];
+      if (!p.armed && p.events != 0) {
+        Arm(fd, p);
+      }
+    }
+    rearm_.clear();
+  }
+
+  void Arm(int fd, FdPoll &p) {
+    p.generation = (p.generation + 1) & 0x7fffffff;
+    p.armed = true;
+    struct io_uring_sqe *sqe = ring_->GetSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = static_cast<uint16_t>(p.events);
+    sqe->user_data = UserData(fd, p.generation);
+  }
+
+  std::unique_ptr<IoUring> ring_;
+  std::vector<FdPoll> polls_; // Indexed by fd.
+  std::vector<int> rearm_;    // Fds whose polls have fired.
+};
+#endif
+
+#if defined(__APPLE__)
+// MacOS kqueue.  Reading and writing are separate filters in a kqueue
+// so an fd can have up to two registrations.
+class KqueuePoller : public Poller {
+public:
+  KqueuePoller() : kq_(kqueue()) {}
+  ~KqueuePoller() override {
+    if (kq_ != -1) {
+      close(kq_);
+    }
+  }
+
+  bool Valid() const { return kq_ != -1; }
+  PollerType Type() const override { return PollerType::kKqueue; }
+  int Fd() const override { return kq_; }
+
+protected:
+  bool Update(int fd, short old_events, short new_events) override {
+    struct kevent changes[2];
+    int num_changes = 0;
+    auto change = [&](short mask, int16_t filter) {
+      bool was = (old_events & mask) != 0;
+      bool is = (new_events & mask) != 0;
+      if (was != is) {
+        EV_SET(&changes[num_changes++], fd, filter, is ? EV_ADD : EV_DELETE, 0,
+               0, nullptr);
+      }
+    };
+    change(POLLIN | POLLPRI, EVFILT_READ);
+    change(POLLOUT, EVFILT_WRITE);
+    if (num_changes > 0) {
+      kevent(kq_, changes, num_changes, nullptr, 0, nullptr);
+    }
+    return true;
+  }
+
+  int KernelPoll(int64_t timeout_ns) override {
+    struct kevent events[kMaxKernelEvents];
+    struct timespec ts = ToTimespec(timeout_ns);
+    int n = kevent(kq_, nullptr, 0, events, kMaxKernelEvents,
+                   timeout_ns < 0 ? nullptr : &ts);
+    for (int i = 0; i < n; i++) {
+      struct kevent &e = events[i];
+      short revents = e.filter == EVFILT_WRITE ? POLLOUT : POLLIN;
+      if ((e.flags & EV_EOF) != 0) {
+        revents |= POLLHUP;
+      }
+      if ((e.flags & EV_ERROR) != 0) {
+        revents |= POLLERR;
+      }
+      Ready(static_cast<int>(e.ident), revents);
+    }
+    return n < 0 ? -1 : 0;
+  }
+
+private:
+  int kq_;
+};
+#endif
+
+std::unique_ptr<Poller> Poller::Create(PollerType type) {
+  switch (type) {
+  case PollerType::kDefault:
+#if defined(__linux__)
+    return Create(PollerType::kEpoll);
+#elif defined(__APPLE__)
+    return Create(PollerType::kKqueue);
+#endif
+  case PollerType::kPoll:
+    return std::make_unique<PollPoller>();
+  case PollerType::kEpoll: {
+#if defined(__linux__)
+    auto p = std::make_unique<EpollPoller>();
+    if (p->Valid()) {
+      return p;
+    }
+#endif
+    return nullptr;
+  }
+  case PollerType::kIoUring: {
+#if defined(__linux__)
+    if (auto ring = IoUring::Create()) {
+      return std::make_unique<UringPoller>(std::move(ring));
+    }
+#endif
+    return nullptr;
+  }
+  case PollerType::kKqueue: {
+#if defined(__APPLE__)
+    auto p = std::make_unique<KqueuePoller>();
+    if (p->Valid()) {
+      return p;
+    }
+#endif
+    return nullptr;
+  }
+  }
+  return nullptr;
+}
+
+} // namespace co
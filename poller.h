@@ -0,0 +1,129 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef poller_h
+#define poller_h
+
+#include <poll.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace co {
+
+class Coroutine;
+class IoUring;
+
+// The kernel facility used by the scheduler to wait for file descriptors.
+// kDefault picks the best one available for the operating system (epoll
+// on Linux, kqueue on MacOS).  kPoll is the portable ::poll fallback.
+// kIoUring (Linux 5.11 and later) waits for fds with io_uring polls and
+// also lets coroutines submit I/O operations to the ring (see uring.h).
+enum class PollerType {
+  kDefault,
+  kPoll,
+  kEpoll,
+  kKqueue,
+  kIoUring,
+};
+
+// An fd that has become ready for a coroutine.  A nullptr coroutine means
+// that the fd was registered by the scheduler itself (the interrupt fd).
+struct PollEvent {
+  PollEvent() = default;
+  PollEvent(Coroutine *c, int f) : co(c), fd(f) {}
+  Coroutine *co = nullptr;
+  int fd = -1;
+};
+
+// A Poller holds the set of fds that coroutines are waiting for.  Fds are
+// registered when a coroutine starts to wait and are removed when the wait
+// is over, so the cost of a poll depends on the number of fds that
+// are ready, rather than on the number of coroutines in the scheduler.
+//
+// More than one coroutine can wait for the same fd, and for different
+// events on the same fd.  The kernel is told about the union of all the
+// events for the fd.  Events are level triggered, just like ::poll.
+class Poller {
+public:
+  virtual ~Poller() = default;
+
+  // Create a poller of the given type.  Returns nullptr if the type is
+  // not supported on this operating system.
+  static std::unique_ptr<Poller> Create(PollerType type);
+
+  // Register an fd and its events of interest for a coroutine.
+  void Add(Coroutine *c, const struct pollfd &fd);
+
+  // Remove a registration made by Add.
+  void Remove(Coroutine *c, const struct pollfd &fd);
+
+  // Wait for registered fds to become ready, for a maximum of timeout_ns
+  // nanoseconds (-1 means forever).  The timeout is passed to the kernel
+  // with as much precision as it takes, so a timer due in 10us wakes in
+  // about 10us rather than at the next millisecond.  The ready
+  // (coroutine, fd) pairs are appended to events.  Returns the number of
+  // events appended, or -1 on error (errno is set).
+  int Poll(std::vector<PollEvent> &events, int64_t timeout_ns);
+
+  virtual PollerType Type() const = 0;
+
+  // The io_uring used by the poller, if there is one.
+  virtual IoUring *Uring() { return nullptr; }
+
+  // An fd that another event loop can wait for instead of calling Poll:
+  // it polls as readable when Poll has something to return.  It's the
+  // epoll, kqueue or io_uring fd, and is -1 for the poll poller, which
+  // has none.
+  virtual int Fd() const { return -1; }
+
+  // Get ready for another event loop to wait for Fd(), by telling the
+  // kernel about anything it hasn't been told yet.  Returns false if
+  // there are fds that are always ready (regular files), so the wait
+  // mustn't block.
+  bool PrepareWait();
+
+protected:
+  // Tell the kernel that the events being waited for on an fd have
+  // changed.  Either old_events or new_events can be zero, meaning that
+  // the fd is being added or removed.  Returns false if the kernel
+  // refuses to wait for the fd (epoll won't wait for regular files, for
+  // example).  Such fds are treated as always being ready, like ::poll
+  // does.
+  virtual bool Update(int fd, short old_events, short new_events) = 0;
+
+  // Wait for the kernel to tell us about ready fds.  The implementation
+  // calls Ready() for each ready fd.
+  virtual int KernelPoll(int64_t timeout_ns) = 0;
+
+  // Pass any changes that are waiting for the next KernelPoll to the
+  // kernel now.
+  virtual void Submit() {}
+
+  // Called by KernelPoll to report that an fd has revents set.
+  void Ready(int fd, short revents);
+
+private:
+  struct Waiter {
+    Coroutine *co;
+    short events;
+  };
+
+  struct FdState {
+    std::vector<Waiter> waiters;
+    short events = 0;     // Union of the events registered with the kernel.
+    bool always_ready = false;
+  };
+
+  FdState &GetFdState(int fd);
+  void SetEvents(int fd, FdState &state, short events);
+
+  std::vector<FdState> fds_; // Indexed by fd.
+  std::vector<int> always_ready_;
+  std::vector<PollEvent> *events_ = nullptr; // Valid during Poll.
+};
+
+} // namespace co
+#endif /* poller_h */
@@ -0,0 +1,216 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "scheduler_group.h"
+
+namespace co {
+
+// The group and member index of the current thread, if it's one of a
+// group's threads.
+static thread_local SchedulerGroup *current_group = nullptr;
+static thread_local int current_index = -1;
+
+// The most fresh coroutines a scheduler starts each time round its loop.
+static constexpr size_t kMaxFreshPerPass = 32;
+
+SchedulerGroup::SchedulerGroup(int num_schedulers, PollerType poller_type) {
+  for (int i = 0; i < num_schedulers; i++) {
+    auto member = std::make_unique<Member>();
+    member->scheduler = std::make_unique<CoroutineScheduler>(poller_type);
+    // The schedulers keep running while there are no coroutines so that
+    // work can be posted to them.
+    member->scheduler->SetRunForever(true);
+    member->scheduler->SetPollHook(
+        [this, i](bool idle) { FindWork(i, idle); });
+    members_.push_back(std::move(member));
+  }
+}
+
+SchedulerGroup::~SchedulerGroup() {
+  Stop();
+  Join();
+  for (auto &member : members_) {
+    while (FreshCoroutine *fresh = member->fresh.Steal()) {
+      delete fresh;
+    }
+  }
+  while (FreshCoroutine *fresh = free_fresh_) {
+    free_fresh_ = fresh->next;
+    delete fresh;
+  }
+}
+
+void SchedulerGroup::Start(InitFunction init) {
+  for (int i = 0; i < Size(); i++) {
+    threads_.emplace_back([this, i, init]() {
+      current_group = this;
+      current_index = i;
+      Member &member = *members_[i];
+      CoroutineScheduler &scheduler = *member.scheduler;
+      member.pool = std::make_unique<CoroutinePool>(scheduler);
+      if (init != nullptr) {
+        init(scheduler, i);
+      }
+      scheduler.Run();
+      // Coroutines still running become the scheduler's.
+      member.pool.reset();
+      current_group = nullptr;
+      current_index = -1;
+    });
+  }
+}
+
+void SchedulerGroup::Stop() {
+  // Stop is posted rather than called directly so that it takes effect
+  // even if a thread hasn't yet started to run its scheduler.
+  for (auto &member : members_) {
+    CoroutineScheduler *s = member->scheduler.get();
+    s->Post([s]() { s->Stop(); });
+  }
+}
+
+void SchedulerGroup::Join() {
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+}
+
+void SchedulerGroup::Spawn(int index, CoroutineFunction function,
+                           size_t stack_size) {
+  Member *member = members_[index].get();
+  // A CoroutineFunction can't be copied, so it can't go into the
+  // std::function that Post takes.  Pass a pointer to it instead.
+  FreshCoroutine *fresh = NewFresh(std::move(function), stack_size);
+  member->scheduler->Post(
+      [this, member, fresh]() { StartFresh(*member, fresh); });
+}
+
+void SchedulerGroup::Spawn(CoroutineFunction function, size_t stack_size) {
+  if (current_group != this) {
+    int index = static_cast<int>(next_++ % members_.size());
+    Spawn(index, std::move(function), stack_size);
+    return;
+  }
+  Member &member = *members_[current_index];
+  FreshCoroutine *fresh = NewFresh(std::move(function), stack_size);
+  if (!member.fresh.Push(fresh)) {
+    // Deque is full, just start it here.
+    StartFresh(member, fresh);
+    return;
+  }
+  WakeSleeper(current_index);
+}
+
+// Called by scheduler 'index' each time round its loop.  We start our own
+// fresh coroutines, oldest first, a batch on each pass.  If we have
+// nothing to do we try to steal some from the other schedulers.
+void SchedulerGroup::FindWork(int index, bool idle) {
+  Member &member = *members_[index];
+  member.sleeping.store(false);
+  // Start a batch of our own fresh coroutines each time round the loop, so
+  // that a burst of them doesn't take a pass per coroutine to get going.
+  // The limit stops a steady stream of new ones from holding up the
+  // coroutines that are already running.
+  size_t started = 0;
+  while (started < kMaxFreshPerPass) {
+    FreshCoroutine *fresh = member.fresh.Steal();
+    if (fresh == nullptr) {
+      break;
+    }
+    StartFresh(member, fresh);
+    started++;
+  }
+  if (started > 0 || !idle) {
+    return;
+  }
+  // Say we are sleeping before we look for work so that anyone pushing
+  // work after we have looked will wake us up.
+  member.sleeping.store(true);
+  while (started < kMaxFreshPerPass) {
+    FreshCoroutine *fresh = StealFromOthers(index);
+    if (fresh == nullptr) {
+      break;
+    }
+    member.sleeping.store(false);
+    StartFresh(member, fresh);
+    started++;
+  }
+}
+
+// Called in the member's thread.
+void SchedulerGroup::StartFresh(Member &member, FreshCoroutine *fresh) {
+  if (member.pool != nullptr && fresh->stack_size == kCoDefaultStackSize) {
+    member.pool->Spawn(std::move(fresh->function));
+  } else {
+    member.scheduler->Spawn(std::move(fresh->function), nullptr,
+                            fresh->stack_size);
+  }
+  FreeFresh(fresh);
+}
+
+SchedulerGroup::FreshCoroutine *
+SchedulerGroup::NewFresh(CoroutineFunction function, size_t stack_size) {
+  FreshCoroutine *fresh = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(free_lock_);
+    if (free_fresh_ != nullptr) {
+      fresh = free_fresh_;
+      free_fresh_ = fresh->next;
+      num_free_fresh_--;
+    }
+  }
+  if (fresh == nullptr) {
+    return new FreshCoroutine{std::move(function), stack_size};
+  }
+  fresh->function = std::move(function);
+  fresh->stack_size = stack_size;
+  fresh->next = nullptr;
+  return fresh;
+}
+
+void SchedulerGroup::FreeFresh(FreshCoroutine *fresh) {
+  // Let go of anything the function captured now.
+  fresh->function = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(free_lock_);
+    if (num_free_fresh_ < kMaxFreeFresh) {
+      fresh->next = free_fresh_;
+      free_fresh_ = fresh;
+      num_free_fresh_++;
+      return;
+    }
+  }
+  delete fresh;
+}
+
+SchedulerGroup::FreshCoroutine *SchedulerGroup::StealFromOthers(int index) {
+  int n = Size();
+  for (int i = 1; i < n; i++) {
+    Member &victim = *members_[(index + i) % n];
+    if (victim.fresh.IsEmpty()) {
+      continue;
+    }
+    if (FreshCoroutine *fresh = victim.fresh.Steal()) {
+      return fresh;
+    }
+  }
+  return nullptr;
+}
+
+// There's new work in scheduler 'index'.  Wake up one sleeping scheduler
+// so that it can come and steal it.
+void SchedulerGroup::WakeSleeper(int index) {
+  int n = Size();
+  for (int i = 1; i < n; i++) {
+    Member &member = *members_[(index + i) % n];
+    bool sleeping = true;
+    if (member.sleeping.compare_exchange_strong(sleeping, false)) {
+      member.scheduler->Wake();
+      return;
+    }
+  }
+}
+
+} // namespace co
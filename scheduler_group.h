@@ -0,0 +1,130 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef scheduler_group_h
+#define scheduler_group_h
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "coroutine.h"
+#include "work_stealing_deque.h"
+
+namespace co {
+
+// A SchedulerGroup runs a set of CoroutineSchedulers, each in its own
+// thread.  This allows a program to use more than one core while every
+// coroutine still only ever sees a single thread: a coroutine runs in its
+// scheduler's thread for its whole life and coroutines in the same
+// scheduler never run at the same time.  Coroutines in different
+// schedulers do run in parallel, so any data shared between schedulers
+// needs to be protected.
+//
+// A typical use is a network server where each thread has its own
+// listening socket bound to the same port with SO_REUSEPORT, letting the
+// kernel share out the incoming connections.
+//
+// Coroutines spawned from within one of the group's threads are not
+// bound to a scheduler until they start.  Each scheduler holds the ones
+// it spawned in a work-stealing deque and starts them in order, but a
+// scheduler with nothing to do steals them from the others before it
+// blocks.  This evens out the load when one thread gets a burst of work.
+// A coroutine that has started never moves.
+//
+// Each scheduler starts coroutines with the default stack size through a
+// CoroutinePool of its own, and the records of coroutines waiting to
+// start are kept for reuse, so once the group has warmed up spawning a
+// coroutine doesn't allocate memory.
+class SchedulerGroup {
+public:
+  // Called in each scheduler's thread before the scheduler is run.  The
+  // index is the scheduler's position in the group, from 0.
+  using InitFunction =
+      std::function<void(CoroutineScheduler &scheduler, int index)>;
+
+  SchedulerGroup(int num_schedulers,
+                 PollerType poller_type = PollerType::kDefault);
+
+  // Stops the schedulers and waits for the threads to finish.
+  ~SchedulerGroup();
+
+  // Start a thread for each scheduler.  The init function is called in the
+  // thread before the scheduler runs and it will usually create the
+  // coroutines for the thread.  The schedulers run until Stop is called.
+  void Start(InitFunction init = nullptr);
+
+  // Tell all the schedulers to stop.  Can be called from any thread.
+  void Stop();
+
+  // Wait for all the threads to finish.
+  void Join();
+
+  int Size() const { return static_cast<int>(members_.size()); }
+  CoroutineScheduler &Scheduler(int index) {
+    return *members_[index]->scheduler;
+  }
+
+  // Call a function in the thread of the given scheduler.
+  void Post(int index, std::function<void()> function) {
+    members_[index]->scheduler->Post(std::move(function));
+  }
+
+  // Spawn a coroutine in the given scheduler.  Can be called from any
+  // thread.
+  void Spawn(int index, CoroutineFunction function,
+             size_t stack_size = kCoDefaultStackSize);
+
+  // Spawn a coroutine somewhere in the group.  When called from one of the
+  // group's threads the coroutine goes into that scheduler's deque and
+  // may be stolen by another scheduler before it starts.  From any other
+  // thread, the schedulers are used in round-robin order.
+  void Spawn(CoroutineFunction function,
+             size_t stack_size = kCoDefaultStackSize);
+
+private:
+  // A coroutine that hasn't been created yet.
+  struct FreshCoroutine {
+    CoroutineFunction function;
+    size_t stack_size;
+    FreshCoroutine *next = nullptr; // In the free list.
+  };
+
+  // At most this many unused FreshCoroutines are kept for reuse.
+  static constexpr size_t kMaxFreeFresh = 1024;
+
+  struct Member {
+    std::unique_ptr<CoroutineScheduler> scheduler;
+    // Made and destroyed in the scheduler's thread, as a pool must be.
+    std::unique_ptr<CoroutinePool> pool;
+    WorkStealingDeque<FreshCoroutine> fresh;
+    // Set when the scheduler has nothing to do and is about to block.
+    std::atomic<bool> sleeping = false;
+  };
+
+  void FindWork(int index, bool idle);
+  void StartFresh(Member &member, FreshCoroutine *fresh);
+  FreshCoroutine *StealFromOthers(int index);
+  void WakeSleeper(int index);
+
+  // A FreshCoroutine from the free list, or a new one.  A FreshCoroutine
+  // is often started by a different thread to the one that made it, so
+  // the list is shared by the group.
+  FreshCoroutine *NewFresh(CoroutineFunction function, size_t stack_size);
+  void FreeFresh(FreshCoroutine *fresh);
+
+  std::vector<std::unique_ptr<Member>> members_;
+  std::vector<std::thread> threads_;
+  std::atomic<unsigned> next_ = 0;
+
+  std::mutex free_lock_;
+  FreshCoroutine *free_fresh_ = nullptr; // Guarded by free_lock_.
+  size_t num_free_fresh_ = 0;            // Guarded by free_lock_.
+};
+
+} // namespace co
+#endif /* scheduler_group_h */
@@ -0,0 +1,111 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "stack_pool.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(ADDRESS_SANITIZER)
+#include <sanitizer/asan_interface.h>
+#endif
+
+namespace co {
+
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+
+#if !defined(MAP_STACK)
+#define MAP_STACK 0
+#endif
+
+size_t StackPool::PageSize() {
+  static size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return page_size;
+}
+
+int StackPool::ClassIndex(size_t size) {
+  size_t pages = size / PageSize();
+  int index = 0;
+  while ((size_t(1) << index) < pages) {
+    index++;
+  }
+  return index;
+}
+
+size_t StackPool::SizeClass(size_t size) {
+  size_t page_size = PageSize();
+  size_t pages = (size + page_size - 1) / page_size;
+  size_t rounded = 1;
+  while (rounded < pages) {
+    rounded <<= 1;
+  }
+  return rounded * page_size;
+}
+
+StackPool::~StackPool() {
+  for (int i = 0; i < kNumClasses; i++) {
+    size_t size = (size_t(1) << i) * PageSize();
+    for (void *stack : free_[i]) {
+      Unmap(stack, size);
+    }
+  }
+}
+
+void *StackPool::Allocate(size_t size) {
+  int index = ClassIndex(size);
+  if (index < kNumClasses && !free_[index].empty()) {
+    void *stack = free_[index].back();
+    free_[index].pop_back();
+    return stack;
+  }
+  // Map the stack plus a guard page below it.  The mapping doesn't
+  // reserve swap or commit memory until the pages are touched.
+  size_t guard = PageSize();
+  void *mem = mmap(nullptr, size + guard, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+                   0);
+  if (mem == MAP_FAILED) {
+    return nullptr;
+  }
+  if (mprotect(mem, guard, PROT_NONE) == -1) {
+    munmap(mem, size + guard);
+    return nullptr;
+  }
+  return static_cast<char *>(mem) + guard;
+}
+
+void StackPool::Free(void *stack, size_t size) {
+  if (stack == nullptr) {
+    return;
+  }
+#if defined(ADDRESS_SANITIZER)
+  // The coroutine that used the stack may have left redzones poisoned in
+  // it.  They would trip up the next user of the memory, whether that's
+  // a cached stack or a new mapping at the same address.
+  ASAN_UNPOISON_MEMORY_REGION(stack, size);
+#endif
+  int index = ClassIndex(size);
+  if (index < kNumClasses && free_[index].size() < max_cached_) {
+    free_[index].push_back(stack);
+    return;
+  }
+  Unmap(stack, size);
+}
+
+size_t StackPool::NumCached() const {
+  size_t n = 0;
+  for (auto &f : free_) {
+    n += f.size();
+  }
+  return n;
+}
+
+void StackPool::Unmap(void *stack, size_t size) {
+  size_t guard = PageSize();
+  munmap(static_cast<char *>(stack) - guard, size + guard);
+}
+
+} // namespace co
@@ -0,0 +1,69 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef stack_pool_h
+#define stack_pool_h
+
+#include <cstddef>
+#include <vector>
+
+namespace co {
+
+// A pool of coroutine stacks.  Each stack is a separate anonymous mmap
+// with a PROT_NONE guard page below it, so a stack overflow causes a
+// SIGSEGV rather than silently corrupting memory.  The kernel only commits
+// the pages of a stack when they are touched, so a coroutine can be given
+// a large stack and only pay for what it uses.
+//
+// Stack sizes are rounded up to a size class (a power of two number of
+// pages).  Freed stacks are kept by size class and handed out again,
+// avoiding the cost of mapping and unmapping a stack for every coroutine.
+//
+// Note that each stack (and its guard page) is a separate kernel memory
+// mapping, so very large numbers of coroutines may need vm.max_map_count
+// raising on Linux.
+//
+// The pool is not thread safe.  It belongs to a single scheduler.
+class StackPool {
+public:
+  // By default we keep up to this many freed stacks per size class.
+  static constexpr size_t kDefaultMaxCached = 256;
+
+  StackPool(size_t max_cached_per_class = kDefaultMaxCached)
+      : max_cached_(max_cached_per_class) {}
+  ~StackPool();
+
+  StackPool(const StackPool &) = delete;
+  StackPool &operator=(const StackPool &) = delete;
+
+  // The size of stack that will actually be allocated for the requested
+  // size.
+  static size_t SizeClass(size_t size);
+
+  // Allocate a stack of the given size, which must be a value returned by
+  // SizeClass.  Returns the lowest usable address of the stack, or nullptr
+  // if there is no memory.
+  void *Allocate(size_t size);
+
+  // Give a stack back to the pool.  The size must be the size passed to
+  // Allocate.
+  void Free(void *stack, size_t size);
+
+  // Number of freed stacks being held for reuse.
+  size_t NumCached() const;
+
+  static size_t PageSize();
+
+private:
+  static int ClassIndex(size_t size);
+  static void Unmap(void *stack, size_t size);
+
+  static constexpr int kNumClasses = 48;
+
+  size_t max_cached_;
+  std::vector<void *> free_[kNumClasses]; // Freed stacks by class index.
+};
+
+} // namespace co
+#endif /* stack_pool_h */
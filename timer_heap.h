@@ -0,0 +1,115 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef timer_heap_h
+#define timer_heap_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace co {
+
+// A 4-ary min-heap of objects ordered by a deadline held in the object.
+// The object also holds its index in the heap (-1 if not in the heap)
+// so that it can be removed in O(log n) when the thing it is timing
+// finishes before the deadline.  A 4-ary heap is shallower than a binary
+// heap and the children of a node share a cache line.
+//
+// The deadline of an object must not be changed while it is in the heap.
+template <typename T, uint64_t T::*Deadline, int T::*Index> class TimerHeap {
+public:
+  bool IsEmpty() const { return heap_.empty(); }
+  size_t Size() const { return heap_.size(); }
+
+  // The object with the earliest deadline.  Heap must not be empty.
+  T *Top() const { return heap_.front().item; }
+  uint64_t TopDeadline() const { return heap_.front().deadline; }
+
+  bool Contains(const T *t) const { return t->*Index != -1; }
+
+  void Insert(T *t) {
+    heap_.push_back({t->*Deadline, t});
+    SiftUp(heap_.size() - 1);
+  }
+
+  void Remove(T *t) {
+    size_t i = static_cast<size_t>(t->*Index);
+    t->*Index = -1;
+    Entry last = heap_.back();
+    heap_.pop_back();
+    if (i == heap_.size()) {
+      return;
+    }
+    Place(i, last);
+    if (i > 0 && last.deadline < heap_[Parent(i)].deadline) {
+      SiftUp(i);
+    } else {
+      SiftDown(i);
+    }
+  }
+
+  T *Pop() {
+    T *t = Top();
+    Remove(t);
+    return t;
+  }
+
+private:
+  static constexpr size_t kArity = 4;
+
+  struct Entry {
+    uint64_t deadline;
+    T *item;
+  };
+
+  static size_t Parent(size_t i) { return (i - 1) / kArity; }
+
+  void Place(size_t i, const Entry &e) {
+    heap_[i] = e;
+    e.item->*Index = static_cast<int>(i);
+  }
+
+  void SiftUp(size_t i) {
+    Entry e = heap_[i];
+    while (i > 0) {
+      size_t parent = Parent(i);
+      if (heap_[parent].deadline <= e.deadline) {
+        break;
+      }
+      Place(i, heap_[parent]);
+      i = parent;
+    }
+    Place(i, e);
+  }
+
+  void SiftDown(size_t i) {
+    Entry e = heap_[i];
+    size_t size = heap_.size();
+    for (;;) {
+      size_t first = i * kArity + 1;
+      if (first >= size) {
+        break;
+      }
+      size_t last = first + kArity < size ? first + kArity : size;
+      size_t min = first;
+      for (size_t c = first + 1; c < last; c++) {
+        if (heap_[c].deadline < heap_[min].deadline) {
+          min = c;
+        }
+      }
+      if (e.deadline <= heap_[min].deadline) {
+        break;
+      }
+      Place(i, heap_[min]);
+      i = min;
+    }
+    Place(i, e);
+  }
+
+  std::vector<Entry> heap_;
+};
+
+} // namespace co
+#endif /* timer_heap_h */
@@ -0,0 +1,523 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+
+#include "io.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if !defined(IORING_ACCEPT_MULTISHOT)
+// Older headers.  Older kernels say EINVAL.
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+#endif
+
+namespace co {
+
+IoUring *UringOf(Coroutine *c) { return c->Scheduler().Uring(); }
+
+#if defined(__linux__)
+
+// The completion queue is bigger than the submission queue because there
+// can be many more operations in flight (one per connection, say) than are
+// submitted at once.
+static constexpr unsigned kCompletionQueueFactor = 16;
+
+std::unique_ptr<IoUring> IoUring::Create(unsigned entries) {
+  std::unique_ptr<IoUring> ring(new IoUring());
+  if (!ring->Setup(entries)) {
+    return nullptr;
+  }
+  return ring;
+}
+
+bool IoUring::Setup(unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * kCompletionQueueFactor;
+#if defined(IORING_SETUP_COOP_TASKRUN)
+  // Only one thread uses the ring, and it enters the kernel all the time,
+  // so there's no need to interrupt it to run completions.
+  p.flags |= IORING_SETUP_COOP_TASKRUN;
+#endif
+  fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+#if defined(IORING_SETUP_COOP_TASKRUN)
+  if (fd_ == -1 && errno == EINVAL) {
+    // Older kernels don't know the newer flags.
+    p.flags &= ~IORING_SETUP_COOP_TASKRUN;
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+  }
+#endif
+  if (fd_ == -1) {
+    return false;
+  }
+  if ((p.features & IORING_FEAT_EXT_ARG) == 0 ||
+      (p.features & IORING_FEAT_NODROP) == 0) {
+    return false;
+  }
+
+  sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      return false;
+    }
+  }
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+  char *sq = static_cast<char *>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  sq_local_tail_ = *sq_tail_;
+  // Submission queue entries are always used in order so the indirection
+  // array never changes.
+  unsigned *array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) {
+    array[i] = i;
+  }
+
+  char *cq = static_cast<char *>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+  return true;
+}
+
+// How long, at most, the ring's destructor waits for the completions of
+// orphaned operations.
+static constexpr int64_t kOrphanWaitNs = 1000000;
+static constexpr int kOrphanWaits = 10;
+
+IoUring::~IoUring() {
+  // Submit whatever is queued (the cancellations of the orphans, most
+  // likely) and pass the orphans their completions.  The other ops'
+  // owners have gone, so theirs are dropped.
+  for (int i = 0; i < kOrphanWaits && !orphans_.empty(); i++) {
+    if (Enter(1, kOrphanWaitNs) == -1) {
+      break;
+    }
+    Reap([this](const struct io_uring_cqe &cqe) {
+      auto *op = reinterpret_cast<UringOp *>(cqe.user_data);
+      if (std::find(orphans_.begin(), orphans_.end(), op) != orphans_.end()) {
+        op->Complete(cqe.res, cqe.flags);
+      }
+    });
+  }
+  while (!orphans_.empty()) {
+    UringOp *op = orphans_.back();
+    orphans_.pop_back();
+    op->Abandon();
+  }
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != nullptr) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  // Closing the ring cancels anything still in flight.
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+struct io_uring_sqe *IoUring::GetSqe() {
+  Reserve(1);
+  struct io_uring_sqe *sqe = &sqes_[sq_local_tail_ & sq_mask_];
+  sq_local_tail_++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void IoUring::Reserve(unsigned n) {
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sq_local_tail_ - head + n > sq_entries_) {
+    Submit();
+  }
+}
+
+void IoUring::Submit() {
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  unsigned to_submit =
+      sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  while (to_submit > 0) {
+    int n = static_cast<int>(
+        syscall(__NR_io_uring_enter, fd_, to_submit, 0, 0, nullptr, 0));
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // EAGAIN or EBUSY: the kernel is short of resources for the moment,
+      // usually because completions haven't been reaped.  The entries
+      // stay in the queue for the next Enter.
+      break;
+    }
+    to_submit -= static_cast<unsigned>(n);
+  }
+}
+
+int IoUring::Enter(unsigned min_complete, int64_t timeout_ns) {
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  unsigned to_submit =
+      sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout_ns > 0) {
+    ts.tv_sec = timeout_ns / 1000000000;
+    ts.tv_nsec = timeout_ns % 1000000000;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+  } else if (timeout_ns == 0) {
+    min_complete = 0;
+  }
+  int n = static_cast<int>(syscall(
+      __NR_io_uring_enter, fd_, to_submit, min_complete,
+      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)));
+  if (n == -1 && errno != ETIME && errno != EINTR && errno != EAGAIN &&
+      errno != EBUSY) {
+    return -1;
+  }
+  return 0;
+}
+
+void IoUring::RemoveOrphan(UringOp *op) {
+  auto it = std::find(orphans_.begin(), orphans_.end(), op);
+  if (it != orphans_.end()) {
+    orphans_.erase(it);
+  }
+}
+
+bool IoUring::RegisterBuffers(const struct iovec *buffers,
+                              unsigned num_buffers) {
+  if (buffers_registered_ && !UnregisterBuffers()) {
+    return false;
+  }
+  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, buffers,
+              num_buffers) == -1) {
+    return false;
+  }
+  buffers_registered_ = true;
+  return true;
+}
+
+bool IoUring::UnregisterBuffers() {
+  if (syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_BUFFERS, nullptr,
+              0) == -1) {
+    return false;
+  }
+  buffers_registered_ = false;
+  return true;
+}
+
+// An operation submitted by UringSubmit, on the submitting coroutine's
+// stack.
+class Completion : public UringOp {
+public:
+  void Complete(int32_t result, uint32_t flags) override {
+    result_ = result;
+    done_ = true;
+    waiter_.NotifyOne();
+  }
+
+  int32_t Wait(Coroutine *c) {
+    while (!done_) {
+      waiter_.Wait(c);
+    }
+    return result_;
+  }
+
+private:
+  WaitQueue waiter_;
+  int32_t result_ = 0;
+  bool done_ = false;
+};
+
+ssize_t UringSubmit(Coroutine *c, const struct io_uring_sqe &sqe,
+                    uint64_t timeout_ns) {
+  IoUring *ring = UringOf(c);
+  Completion op;
+  struct __kernel_timespec ts;
+  ring->Reserve(timeout_ns > 0 ? 2 : 1);
+  struct io_uring_sqe *s = ring->GetSqe();
+  *s = sqe;
+  s->user_data = reinterpret_cast<uint64_t>(static_cast<UringOp *>(&op));
+  if (timeout_ns > 0) {
+    // The timeout cancels the operation if it hasn't completed in time.
+    // Its own completion has nothing to tell us.
+    s->flags |= IOSQE_IO_LINK;
+    ts.tv_sec = static_cast<int64_t>(timeout_ns / 1000000000ULL);
+    ts.tv_nsec = static_cast<long long>(timeout_ns % 1000000000ULL);
+    struct io_uring_sqe *t = ring->GetSqe();
+    t->opcode = IORING_OP_LINK_TIMEOUT;
+    t->addr = reinterpret_cast<uint64_t>(&ts);
+    t->len = 1;
+  }
+  // The kernel has pointers to op and ts (and whatever the operation
+  // points to) so there's no leaving before it's done, whatever happens.
+  int32_t result = op.Wait(c);
+  if (result < 0) {
+    errno = result == -ECANCELED && timeout_ns > 0 ? ETIMEDOUT : -result;
+    return -1;
+  }
+  return result;
+}
+
+// Do a fixed buffer operation.  Older kernels give EAGAIN for a
+// non-blocking fd that isn't ready rather than waiting for it, in which
+// case we wait for it ourselves and try again.
+static ssize_t FixedOp(Coroutine *c, uint8_t opcode, int fd, const void *buffer,
+                       size_t length, int buffer_index, off_t offset,
+                       short events, uint64_t timeout_ns) {
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uint64_t>(buffer);
+  sqe.len = static_cast<uint32_t>(length);
+  sqe.off = static_cast<uint64_t>(offset);
+  sqe.buf_index = static_cast<uint16_t>(buffer_index);
+  for (;;) {
+    ssize_t n = UringSubmit(c, sqe, timeout_ns);
+    if (n != -1 || (errno != EAGAIN && errno != EINTR)) {
+      return n;
+    }
+    if (errno == EAGAIN && c->Wait(fd, events, timeout_ns) == -1) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+}
+
+#endif
+
+ssize_t UringReadFixed(Coroutine *c, int fd, void *buffer, size_t length,
+                       int buffer_index, off_t offset, uint64_t timeout_ns) {
+#if defined(__linux__)
+  if (UringOf(c) != nullptr) {
+    return FixedOp(c, IORING_OP_READ_FIXED, fd, buffer, length, buffer_index,
+                   offset, POLLIN, timeout_ns);
+  }
+#endif
+  if (offset == -1) {
+    return Read(c, fd, buffer, length, timeout_ns);
+  }
+  for (;;) {
+    ssize_t n = ::pread(fd, buffer, length, offset);
+    if (n != -1 || errno != EINTR) {
+      return n;
+    }
+  }
+}
+
+ssize_t UringWriteFixed(Coroutine *c, int fd, const void *buffer,
+                        size_t length, int buffer_index, off_t offset,
+                        uint64_t timeout_ns) {
+#if defined(__linux__)
+  if (UringOf(c) != nullptr) {
+    const char *p = static_cast<const char *>(buffer);
+    size_t remaining = length;
+    while (remaining > 0) {
+      ssize_t n = FixedOp(c, IORING_OP_WRITE_FIXED, fd, p, remaining,
+                          buffer_index, offset, POLLOUT, timeout_ns);
+      if (n <= 0) {
+        return -1;
+      }
+      p += n;
+      remaining -= static_cast<size_t>(n);
+      if (offset != -1) {
+        offset += n;
+      }
+    }
+    return static_cast<ssize_t>(length);
+  }
+#endif
+  if (offset == -1) {
+    return Write(c, fd, buffer, length, timeout_ns);
+  }
+  const char *p = static_cast<const char *>(buffer);
+  size_t remaining = length;
+  while (remaining > 0) {
+    ssize_t n = ::pwrite(fd, p, remaining, offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    remaining -= static_cast<size_t>(n);
+    offset += n;
+  }
+  return static_cast<ssize_t>(length);
+}
+
+// The multishot accept.  Accepted fds are queued until the acceptor asks
+// for them.
+class MultishotAcceptor::Op final
+#if defined(__linux__)
+    : public UringOp
+#endif
+{
+public:
+  ~Op() {
+    for (int fd : fds) {
+      close(fd);
+    }
+  }
+
+#if defined(__linux__)
+  void Complete(int32_t result, uint32_t flags) override {
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+      // The kernel has stopped accepting, because of an error or because
+      // it was cancelled.
+      armed = false;
+    }
+    if (orphaned) {
+      if (result >= 0) {
+        close(result);
+      }
+      if (!armed) {
+        ring->RemoveOrphan(this);
+        delete this;
+      }
+      return;
+    }
+    if (result >= 0) {
+      fds.push_back(result);
+    } else if (result == -EINVAL && !accepted) {
+      // Multishot accept needs Linux 5.19.
+      unsupported = true;
+    } else if (result != -ECONNABORTED && result != -ECANCELED) {
+      error = -result;
+    }
+    accepted |= result >= 0;
+    waiter.NotifyOne();
+  }
+
+  // The ring is going and the kernel hasn't said it's finished with us,
+  // but it won't be giving us anything more.
+  void Abandon() override { delete this; }
+#endif
+
+  std::deque<int> fds;
+  WaitQueue waiter;
+  bool armed = false;
+  bool orphaned = false; // The acceptor has gone.
+  IoUring *ring = nullptr; // Set when orphaned.
+  bool accepted = false;
+  bool unsupported = false;
+  int error = 0;
+};
+
+MultishotAcceptor::MultishotAcceptor(Coroutine *c, int listen_fd)
+    : listen_fd_(listen_fd), ring_(UringOf(c)), op_(new Op()) {}
+
+MultishotAcceptor::~MultishotAcceptor() {
+#if defined(__linux__)
+  if (op_->armed) {
+    // The kernel has a pointer to the op so it has to stay until the
+    // cancellation completes.  It closes whatever arrives in the meantime
+    // and deletes itself.
+    op_->orphaned = true;
+    op_->ring = ring_;
+    ring_->AddOrphan(op_);
+    struct io_uring_sqe *sqe = ring_->GetSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<uint64_t>(static_cast<UringOp *>(op_));
+    for (int fd : op_->fds) {
+      close(fd);
+    }
+    op_->fds.clear();
+    return;
+  }
+#endif
+  delete op_;
+}
+
+int MultishotAcceptor::Accept(Coroutine *c, uint64_t timeout_ns) {
+  for (;;) {
+    if (!op_->fds.empty()) {
+      int fd = op_->fds.front();
+      op_->fds.pop_front();
+      return fd;
+    }
+    if (ring_ == nullptr || op_->unsupported) {
+      return co::Accept(c, listen_fd_, nullptr, nullptr, timeout_ns);
+    }
+    if (op_->error != 0) {
+      // Report the error that stopped the accept once.  The next call
+      // starts it again.
+      errno = op_->error;
+      op_->error = 0;
+      return -1;
+    }
+#if defined(__linux__)
+    if (!op_->armed) {
+      struct io_uring_sqe *sqe = ring_->GetSqe();
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = listen_fd_;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      sqe->user_data = reinterpret_cast<uint64_t>(static_cast<UringOp *>(op_));
+      op_->armed = true;
+    }
+#endif
+    if (!op_->waiter.Wait(c, timeout_ns)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+}
+
+int MultishotAcceptor::TryAccept() {
+  if (!op_->fds.empty()) {
+    int fd = op_->fds.front();
+    op_->fds.pop_front();
+    return fd;
+  }
+  if (ring_ == nullptr || op_->unsupported) {
+    return co::TryAccept(listen_fd_, nullptr, nullptr);
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+} // namespace co
@@ -0,0 +1,211 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef uring_h
+#define uring_h
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "coroutine.h"
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+namespace co {
+
+// An operation in flight in an io_uring.  The user_data of its submission
+// is a pointer to it and the poller calls Complete with the result of each
+// of its completions, in the scheduler (not in a coroutine).  Completions
+// with a user_data of zero are ignored and odd values are used by the
+// poller for its own polls, so operations must be at least 2 byte aligned.
+class UringOp {
+public:
+  virtual void Complete(int32_t result, uint32_t flags) = 0;
+
+  // Called by the ring's destructor, instead of any more completions, for
+  // an orphaned operation (see IoUring::AddOrphan) the kernel hasn't
+  // finished with.
+  virtual void Abandon() {}
+
+protected:
+  ~UringOp() = default;
+};
+
+#if defined(__linux__)
+// A Linux io_uring, driven with the raw system calls.  The scheduler's
+// poller owns one when it is created with PollerType::kIoUring.
+// Everything put in the submission queue is handed to the kernel in one
+// system call when the scheduler next polls, along with the wait for
+// completions, so a batch of coroutines that all start operations costs
+// one system call rather than one each.
+//
+// Not thread safe: it belongs to the scheduler's thread.
+class IoUring {
+public:
+  static constexpr unsigned kDefaultEntries = 256;
+
+  // Returns nullptr if the kernel doesn't have io_uring, or if it's too old
+  // to wait for completions with a timeout (5.11), or io_uring is disabled.
+  static std::unique_ptr<IoUring> Create(unsigned entries = kDefaultEntries);
+
+  ~IoUring();
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  // Get a zeroed submission queue entry to fill in.  It goes to the kernel
+  // on the next Enter.  If the queue is full, the entries in it are
+  // submitted first.
+  struct io_uring_sqe *GetSqe();
+
+  // Make sure the next n calls to GetSqe return adjacent entries without
+  // a submission in between (for linked operations).
+  void Reserve(unsigned n);
+
+  // Submit what's in the submission queue and wait until there are at
+  // least min_complete completions, for up to timeout_ns nanoseconds
+  // (-1 means forever).  Returns -1 on error (errno is set).  A timeout
+  // or a signal isn't an error.
+  int Enter(unsigned min_complete, int64_t timeout_ns);
+
+  // Call f with each completion queue entry, then give them back to the
+  // kernel.  Returns the number of entries.
+  template <typename F> unsigned Reap(F &&f) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned n = tail - head;
+    while (head != tail) {
+      f(cqes_[head & cq_mask_]);
+      head++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return n;
+  }
+
+  // Register buffers with the kernel for UringReadFixed and
+  // UringWriteFixed.  The kernel pins the memory once rather than on every
+  // operation.  Buffers are referred to by their index in the array and
+  // registering replaces any that are registered already.  Returns false
+  // on error (errno is set).
+  bool RegisterBuffers(const struct iovec *buffers, unsigned num_buffers);
+  bool UnregisterBuffers();
+
+  // An orphaned operation is one whose owner has gone while the kernel
+  // still has it.  It carries on getting its completions from the poller
+  // and removes itself when the last one comes.  If the ring is destroyed
+  // first, the destructor waits briefly for the completions that are on
+  // the way and passes them on, then abandons what's left, so the ops and
+  // any fds in their completions aren't leaked.
+  void AddOrphan(UringOp *op) { orphans_.push_back(op); }
+  void RemoveOrphan(UringOp *op);
+
+  int Fd() const { return fd_; }
+
+private:
+  IoUring() = default;
+  bool Setup(unsigned entries);
+  void Submit();
+
+  int fd_ = -1;
+  bool buffers_registered_ = false;
+  std::vector<UringOp *> orphans_;
+
+  void *sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void *cq_ring_ = nullptr; // Same as sq_ring_ if the kernel maps them
+  size_t cq_ring_size_ = 0; // together.
+  struct io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sq_local_tail_ = 0; // Published to the kernel by Enter.
+
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe *cqes_ = nullptr;
+};
+#else
+class IoUring;
+#endif
+
+// The scheduler's ring, or nullptr if it doesn't use io_uring.  When it
+// does, the functions in io.h give an operation that would block to the
+// ring, rather than waiting for the fd to be ready and trying again, so
+// the kernel does the I/O itself as soon as it can.
+IoUring *UringOf(Coroutine *c);
+
+#if defined(__linux__)
+// Submit an operation to the scheduler's ring (which must exist) and
+// suspend the coroutine until it completes.  The sqe is copied, apart from
+// its user_data.  The timeout is optional and if greater than zero
+// specifies a nanosecond timeout linked to the operation.  Returns the
+// result of the operation, or -1 with errno set if it failed (ETIMEDOUT on
+// a timeout).  The operation is submitted, along with everything else
+// submitted in the meantime, when the scheduler next polls.
+//
+// Anything the operation points to must stay valid until it completes.
+// When the memory is on the coroutine's stack that means the coroutine
+// must not be destroyed while it's in here.
+ssize_t UringSubmit(Coroutine *c, const struct io_uring_sqe &sqe,
+                    uint64_t timeout_ns = 0);
+#endif
+
+// Read and write using one of the buffers registered with
+// IoUring::RegisterBuffers.  The data must lie within the buffer.  An
+// offset of -1 means the fd's current position (and is the only choice
+// for sockets and pipes).  UringWriteFixed writes everything.  Without
+// io_uring they use plain reads and writes, as in io.h.
+ssize_t UringReadFixed(Coroutine *c, int fd, void *buffer, size_t length,
+                       int buffer_index, off_t offset = -1,
+                       uint64_t timeout_ns = 0);
+ssize_t UringWriteFixed(Coroutine *c, int fd, const void *buffer,
+                        size_t length, int buffer_index, off_t offset = -1,
+                        uint64_t timeout_ns = 0);
+
+// Accepts connections on a listening socket with a single multishot
+// accept: the kernel keeps accepting connections, without being asked
+// again, and queues a completion for each one.  Accept returns them one
+// at a time, waiting if there aren't any.  Without io_uring (or on a
+// kernel older than 5.19) it uses co::Accept.
+//
+// The acceptor is used by one coroutine at a time and must be destroyed
+// in the scheduler's thread.  Connections accepted but never returned by
+// Accept are closed.
+class MultishotAcceptor {
+public:
+  MultishotAcceptor(Coroutine *c, int listen_fd);
+  ~MultishotAcceptor();
+  MultishotAcceptor(const MultishotAcceptor &) = delete;
+  MultishotAcceptor &operator=(const MultishotAcceptor &) = delete;
+
+  // The new fd, which is non-blocking and close-on-exec, or -1 on error.
+  int Accept(Coroutine *c, uint64_t timeout_ns = 0);
+
+  // A connection that has already been accepted, or -1 with errno set to
+  // EAGAIN if there isn't one.  Doesn't start the multishot accept.
+  int TryAccept();
+
+private:
+  class Op;
+  int listen_fd_;
+  IoUring *ring_;
+  // Lives on the heap because it may outlive the acceptor: if the
+  // acceptor is destroyed while the accept is in flight, the operation
+  // deletes itself when the kernel is finished with it.
+  Op *op_ = nullptr;
+};
+
+} // namespace co
+#endif /* uring_h */
@@ -0,0 +1,82 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef work_stealing_deque_h
+#define work_stealing_deque_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace co {
+
+// A lock-free Chase-Lev work-stealing deque of pointers with a fixed
+// capacity (Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient
+// Work-Stealing for Weak Memory Models", PPoPP 2013).
+//
+// Only the owning thread may Push, at the bottom.  Any thread, including
+// the owner, may Steal from the top.  Stealing takes the oldest item, so
+// the owner steals from itself to get FIFO order.  (The LIFO pop of the
+// original algorithm isn't needed here, so it's left out.)
+template <typename T> class WorkStealingDeque {
+public:
+  // The capacity is rounded up to a power of two.
+  explicit WorkStealingDeque(size_t capacity = 1024) {
+    size_t c = 1;
+    while (c < capacity) {
+      c <<= 1;
+    }
+    mask_ = c - 1;
+    buffer_ = std::make_unique<std::atomic<T *>[]>(c);
+  }
+
+  // Owner only.  Returns false if the deque is full.
+  bool Push(T *item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    if (static_cast<size_t>(b - t) > mask_) {
+      return false;
+    }
+    buffer_[b & mask_].store(item, std::memory_order_relaxed);
+    bottom_.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Any thread.  Takes the oldest item, or returns nullptr if the deque is
+  // empty or another thread got there first.
+  T *Steal() {
+    // Without Pop the owner never takes from the bottom, so the only race
+    // is between stealers and that is settled by the CAS on top_.  This
+    // means the seq_cst fence of the original isn't needed here.
+    int64_t t = top_.load(std::memory_order_acquire);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    T *item = buffer_[t & mask_].load(std::memory_order_relaxed);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return item;
+  }
+
+  // Approximate, for use as a hint only.
+  bool IsEmpty() const {
+    return top_.load(std::memory_order_relaxed) >=
+           bottom_.load(std::memory_order_relaxed);
+  }
+
+private:
+  // Keep the ends on separate cache lines as they are written by
+  // different threads.
+  alignas(64) std::atomic<int64_t> top_ = 0;
+  alignas(64) std::atomic<int64_t> bottom_ = 0;
+  size_t mask_;
+  std::unique_ptr<std::atomic<T *>[]> buffer_;
+};
+
+} // namespace co
+#endif /* work_stealing_deque_h */